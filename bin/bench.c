@@ -0,0 +1,348 @@
+// Host-side benchmarks for the freestanding runtime and the kernel's
+// rendering code. Everything is compiled straight from src/ and runs against
+// a fake `Graphics` in ordinary memory, so hot paths can be measured (and
+// regressions caught) without booting QEMU.
+//
+//     ./bench            Run everything.
+//     ./bench memcpy     Only run benchmarks whose name contains "memcpy".
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+// The runtime's memory routines would clash with libc's, so they're
+// compiled under other names.
+#define memcpy  runtime_memcpy
+#define memset  runtime_memset
+#define memmove runtime_memmove
+#define memcmp  runtime_memcmp
+#include "../src/cpu.c"
+#include "../src/memory.c"
+#undef memcpy
+#undef memset
+#undef memmove
+#undef memcmp
+
+#include "../src/arena.c"
+#include "../src/format.c"
+#include "../src/pixels.c"
+#include "../src/graphics.c"
+#include "../src/glyph_atlas.c"
+#include "../src/console.c"
+#include "../src/log_ring.c"
+#include "../src/page_allocator.c"
+#include "../src/heap.c"
+
+
+#define SCREEN_WIDTH  1920
+#define SCREEN_HEIGHT 1080
+#define FONT_HEIGHT   16
+#define FONT_SCALE    2
+
+// Each benchmark runs for roughly this long.
+#define TARGET_NS (100 * 1000 * 1000ull)
+
+
+typedef struct Sample
+{
+    u64 ns;
+    u64 cycles;
+} Sample;
+
+
+static const char* g_filter = NULL;
+static volatile u64 g_sink;
+
+
+static Sample sample_now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (Sample) { .ns=(u64) time.tv_sec * 1000000000ull + time.tv_nsec, .cycles=__rdtsc() };
+}
+
+static int selected(const char* name)
+{
+    return !g_filter || strstr(name, g_filter);
+}
+
+// `bytes` is per operation; 0 for benchmarks where it makes no sense.
+static void report(const char* name, u64 operations, u64 bytes, Sample begin, Sample end)
+{
+    double ns     = (double) (end.ns - begin.ns);
+    double cycles = (double) (end.cycles - begin.cycles);
+
+    if (bytes)
+        printf("%-40s %12.2f ns/op %10.1f cycles/op %8.2f bytes/cycle\n",
+               name, ns / operations, cycles / operations, (double) bytes * operations / cycles);
+    else
+        printf("%-40s %12.2f ns/op %10.1f cycles/op\n",
+               name, ns / operations, cycles / operations);
+}
+
+
+// Run `body` in growing batches until TARGET_NS has passed, then report.
+#define BENCH(name, bytes, body)                                        \
+    do {                                                                \
+        if (!selected(name)) break;                                     \
+        u64    operations_ = 0;                                         \
+        u64    batch_      = 1;                                         \
+        Sample begin_      = sample_now();                              \
+        Sample end_        = begin_;                                    \
+        while (end_.ns - begin_.ns < TARGET_NS)                         \
+        {                                                               \
+            for (u64 i_ = 0; i_ < batch_; ++i_) { body; }               \
+            operations_ += batch_;                                      \
+            batch_      *= 2;                                           \
+            end_         = sample_now();                                \
+        }                                                               \
+        report(name, operations_, bytes, begin_, end_);                 \
+    } while (0)
+
+
+static void bench_memory(const char* variant, u8* a, u8* b)
+{
+    static const u64 sizes[] = { 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304 };
+    char name[64];
+
+    for (usize i = 0; i < ARRAY_COUNT(sizes); ++i)
+    {
+        u64 size = sizes[i];
+        snprintf(name, sizeof(name), "memcpy/%s/%llu", variant, (unsigned long long) size);
+        BENCH(name, size, runtime_memcpy(a, b, size));
+    }
+    for (usize i = 0; i < ARRAY_COUNT(sizes); ++i)
+    {
+        u64 size = sizes[i];
+        snprintf(name, sizeof(name), "memset/%s/%llu", variant, (unsigned long long) size);
+        BENCH(name, size, runtime_memset(a, (int) i, size));
+    }
+    for (usize i = 0; i < ARRAY_COUNT(sizes); ++i)
+    {
+        u64 size = sizes[i];
+        snprintf(name, sizeof(name), "memmove/%s/%llu", variant, (unsigned long long) size);
+        BENCH(name, size, runtime_memmove(a + 1, a, size));
+    }
+    for (usize i = 0; i < ARRAY_COUNT(sizes); ++i)
+    {
+        u64 size = sizes[i];
+        runtime_memcpy(b, a, size);
+        snprintf(name, sizeof(name), "memcmp/%s/%llu", variant, (unsigned long long) size);
+        BENCH(name, size, g_sink += runtime_memcmp(a, b, size));
+    }
+}
+
+
+static void bench_format()
+{
+    u64 values[1024];
+    for (usize i = 0; i < ARRAY_COUNT(values); ++i)
+        values[i] = ((u64) rand() << 40) ^ ((u64) rand() << 20) ^ (u64) rand();
+
+    u64 index = 0;
+    BENCH("format/U64ToString/10",      0, g_sink += U64ToString(values[index++ & 1023], 10).data[0]);
+    BENCH("format/U64ToString/small",   0, g_sink += U64ToString(values[index++ & 1023] & 0xFFFF, 10).data[0]);
+    BENCH("format/ToHexString",         0, g_sink += ToHexString(values[index++ & 1023]).data[2]);
+    BENCH("format/ToHexStringTruncated",0, g_sink += ToHexStringTruncated(values[index++ & 1023]).data[2]);
+
+    char   text8[21];
+    char16 text16[21];
+    BENCH("format/FormatDecimal8",      0, g_sink += FormatDecimal8(text8, values[index++ & 1023]));
+    BENCH("format/FormatDecimal8/small",0, g_sink += FormatDecimal8(text8, values[index++ & 1023] & 0xFFFF));
+    BENCH("format/FormatDecimal16",     0, g_sink += FormatDecimal16(text16, values[index++ & 1023]));
+    BENCH("format/FormatHex8",          0, g_sink += FormatHex8(text8, values[index++ & 1023], 0, 0));
+}
+
+
+static void log_ring_discard(const LogRecord* record, void* user)
+{
+    g_sink += record->length + (u64) user;
+}
+
+// The cost at the call site, with the drain amortised over a full ring.
+static void bench_log_ring()
+{
+    const char* line = "Framebuffer write-combining: PAT (1G/2M/4K)\n";
+    u64 length = strlen(line);
+
+    log_ring_init();
+    BENCH("log/ring_write", length,
+          if (!log_ring_write(line, length)) log_ring_drain(log_ring_discard, NULL));
+    BENCH("log/ring_write+drain", length,
+          log_ring_write(line, length); log_ring_drain(log_ring_discard, NULL));
+}
+
+
+static u32 bench_cpu_index()
+{
+    return 0;
+}
+
+// A fake memory map with one conventional range in ordinary memory.
+static void bench_pages()
+{
+    u64 size   = 64 << 20;
+    u8* memory = aligned_alloc(4 << 20, size);
+
+    EFI_MEMORY_DESCRIPTOR descriptor = {
+        .Type          = EfiConventionalMemory,
+        .PhysicalStart = (u64) memory,
+        .NumberOfPages = size / PAGE_SIZE,
+    };
+    Memory map = { .MemoryMap=&descriptor, .MemoryMapSize=sizeof(descriptor), .DescriptorSize=sizeof(descriptor) };
+    arena_init(&map);
+    page_allocator_init(&map);
+
+    // Worst case: every allocation splits a 4 MiB block all the way down,
+    // and every free merges it back up.
+    BENCH("pages/alloc+free", 0, page_free(page_alloc()));
+
+    static u64 pages[256];
+    for (usize i = 0; i < ARRAY_COUNT(pages); ++i)
+        pages[i] = page_alloc();
+    BENCH("pages/alloc+free/fragmented", 0, u64 slot = i_ & 255; page_free(pages[slot]); pages[slot] = page_alloc());
+    for (usize i = 0; i < ARRAY_COUNT(pages); ++i)
+        page_free(pages[i]);
+
+    BENCH("pages/alloc_run/13+free", 0, page_free_run(page_alloc_run(13), 13));
+
+    heap_init();
+    BENCH("heap/kmalloc+kfree/64", 0, kfree(kmalloc(64)));
+    BENCH("heap/kmalloc+kfree/1000", 0, kfree(kmalloc(1000)));
+    BENCH("heap/kmalloc+kfree/16K", 0, kfree(kmalloc(16 << 10)));
+
+    // A working set of mixed sizes, freed in a different order than it was
+    // allocated.
+    static void* objects[1024];
+    for (usize i = 0; i < ARRAY_COUNT(objects); ++i)
+        objects[i] = kmalloc(16 + (i * 37) % 1000);
+    BENCH("heap/kmalloc+kfree/mixed", 0,
+          u64 slot = (i_ * 617) & 1023; kfree(objects[slot]); objects[slot] = kmalloc(16 + (i_ * 37) % 1000));
+    for (usize i = 0; i < ARRAY_COUNT(objects); ++i)
+        kfree(objects[i]);
+
+    // The kernel's path once smp.c has set up the per-CPU caches.
+    g_heap_cpu_index = bench_cpu_index;
+    BENCH("heap/cached/kmalloc+kfree/64", 0, kfree(kmalloc(64)));
+    for (usize i = 0; i < ARRAY_COUNT(objects); ++i)
+        objects[i] = kmalloc(16 + (i * 37) % 1000);
+    BENCH("heap/cached/kmalloc+kfree/mixed", 0,
+          u64 slot = (i_ * 617) & 1023; kfree(objects[slot]); objects[slot] = kmalloc(16 + (i_ * 37) % 1000));
+    for (usize i = 0; i < ARRAY_COUNT(objects); ++i)
+        kfree(objects[i]);
+    g_heap_cpu_index = NULL;
+
+    free(memory);
+}
+
+
+static void bench_rendering()
+{
+    u64 pixels = (u64) SCREEN_WIDTH * SCREEN_HEIGHT;
+    u64 bytes  = pixels * sizeof(Pixel);
+
+    // The glyph atlas takes its rows from the boot arena.
+    u64 arena_size = 4 << 20;
+    u8* arena      = aligned_alloc(PAGE_SIZE, arena_size);
+    EFI_MEMORY_DESCRIPTOR descriptor = {
+        .Type          = EfiConventionalMemory,
+        .PhysicalStart = (u64) arena,
+        .NumberOfPages = arena_size / PAGE_SIZE,
+    };
+    Memory map = { .MemoryMap=&descriptor, .MemoryMapSize=sizeof(descriptor), .DescriptorSize=sizeof(descriptor) };
+    arena_init(&map);
+
+    u8* glyphs = malloc(256 * FONT_HEIGHT);
+    for (int i = 0; i < 256 * FONT_HEIGHT; ++i)
+        glyphs[i] = (u8) rand();
+
+    PSF1_Font font = {
+        .header = { .magic={ 0x36, 0x04 }, .file_mode=0, .font_height=FONT_HEIGHT },
+        .scale  = FONT_SCALE,
+        .glyphs = glyphs,
+    };
+
+    Graphics graphics = {
+        .base                = aligned_alloc(64, bytes),
+        .back_buffer         = aligned_alloc(64, bytes),
+        .size                = bytes,
+        .width               = SCREEN_WIDTH,
+        .height              = SCREEN_HEIGHT,
+        .pixels_per_scanline = SCREEN_WIDTH,
+    };
+
+    graphics_init(&graphics);
+    console_init(&font);
+
+    const Pixel white = { 0xFF, 0xFF, 0xFF, 0xFF };
+    const Pixel black = { 0x00, 0x00, 0x00, 0x00 };
+    u64 glyph_bytes = (u64) 8 * FONT_SCALE * FONT_HEIGHT * FONT_SCALE * sizeof(Pixel);
+
+    u64 index = 0;
+    BENCH("render/glyph_atlas_draw", glyph_bytes,
+          glyph_atlas_draw((index % 200) * 8 * FONT_SCALE, 0, (u8) index, white, black); ++index);
+
+    BENCH("render/fill_back_buffer", bytes, graphics_fill(black));
+    BENCH("render/fill_framebuffer", bytes, pixels_fill(&g_front_surface, white));
+    BENCH("render/fill_rect/64x64", 64 * 64 * sizeof(Pixel), pixels_fill_rect(&g_back_surface, 100, 100, 64, 64, white));
+    BENCH("render/scroll_one_line", bytes, graphics_scroll(FONT_HEIGHT * FONT_SCALE, black));
+
+    graphics_fill(black);
+    BENCH("render/flush_full_screen", bytes, graphics_mark_dirty(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT); graphics_flush());
+
+    const char* line = "The quick brown fox jumps over the lazy dog. 0123456789\n";
+    BENCH("render/console_line", 0, console_write(line); console_present());
+
+    free((void *) graphics.base);
+    free(graphics.back_buffer);
+    free(glyphs);
+    free(arena);
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        g_filter = argv[1];
+
+    u8* a = aligned_alloc(64, 8 << 20);
+    u8* b = aligned_alloc(64, 8 << 20);
+    memset(a, 0x5A, 8 << 20);
+    memset(b, 0xA5, 8 << 20);
+
+    cpu_features_detect();
+    memory_init();
+    MemoryOps selected_ops = g_memory_ops;
+    printf("-- memory (selected: %s, rep threshold: %lld) --\n",
+           selected_ops.name, (long long) selected_ops.rep_threshold);
+
+    g_memory_ops = MEMORY_OPS_SSE2;
+    bench_memory("sse2", a, b);
+    if (cpu_has(CPU_FEATURE_AVX2))
+    {
+        g_memory_ops = MEMORY_OPS_AVX2;
+        bench_memory("avx2", a, b);
+    }
+    g_memory_ops = MEMORY_OPS_SSE2;
+    g_memory_ops.rep_threshold = 0;
+    bench_memory("rep", a, b);
+    g_memory_ops = selected_ops;
+
+    printf("-- format --\n");
+    bench_format();
+
+    printf("-- log ring --\n");
+    bench_log_ring();
+
+    printf("-- page allocator and heap --\n");
+    bench_pages();
+
+    pixels_init();
+    printf("-- rendering (%dx%d, pixel ops: %s) --\n", SCREEN_WIDTH, SCREEN_HEIGHT, g_pixel_ops.name);
+    bench_rendering();
+
+    free(a);
+    free(b);
+    return 0;
+}
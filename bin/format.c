@@ -1,51 +1,38 @@
 #include <stdio.h>
-#include <wchar.h>
-#include <stdlib.h>
 
 #include "../src/types.h"
 #include "../src/format.c"
 
 
-
-Block Allocate(size_t size)
-{
-    Block memory = { .data = malloc(size), .size = size };
-    return memory;
-}
-
-void Deallocate(Block block)
+// The formatting functions produce UTF-16; print them as ASCII.
+void PrintWide(const char16* string)
 {
-    free(block.data);
+    while (*string)
+        putchar((char) *string++);
+    putchar('\n');
 }
 
 
 int main()
 {
     printf("-- Testing ToHexString --\n");
-    printf("%s\n", ToHexString(0 - 1).data);
-    printf("%s\n", ToHexString(0xFF00000000000000).data);
-    printf("%s\n", ToHexString(0x0123456789ABCDEF).data);
-    printf("%s\n", ToHexString(0xFEDCBA9876543210).data);
-    printf("%s\n", ToHexString(0x00000000F0FFFF00).data);
+    PrintWide(ToHexString(0 - 1).data);
+    PrintWide(ToHexString(0xFF00000000000000).data);
+    PrintWide(ToHexString(0x0123456789ABCDEF).data);
+    PrintWide(ToHexString(0xFEDCBA9876543210).data);
+    PrintWide(ToHexString(0x00000000F0FFFF00).data);
 
     printf("-- Testing ToHexStringTruncated --\n");
-    printf("%s\n", ToHexStringTruncated(0 - 1).data);
-    printf("%s\n", ToHexStringTruncated(0xFF00000000000000).data);
-    printf("%s\n", ToHexStringTruncated(0x0123456789ABCDEF).data);
-    printf("%s\n", ToHexStringTruncated(0xFEDCBA9876543210).data);
-    printf("%s\n", ToHexStringTruncated(0x00000000F0FFFF00).data);
-
-
-    printf("-- Testing --\n");
-
-    Allocator allocator = { .Allocate = Allocate, .Deallocate = Deallocate };
-
-    String ascii = LITERAL_TO_STRING("Hello world!\n");
-    int*   utf16 = (int *) AsciiToUtf16(ascii, allocator).data;
-    wprintf("%ls\n", utf16);
-
-
-    char16 data[16];
-    WString buffer = {.data=data, .size=16};
-    U64ToString(1234, buffer, 10);
-}
\ No newline at end of file
+    PrintWide(ToHexStringTruncated(0 - 1).data);
+    PrintWide(ToHexStringTruncated(0xFF00000000000000).data);
+    PrintWide(ToHexStringTruncated(0x0123456789ABCDEF).data);
+    PrintWide(ToHexStringTruncated(0xFEDCBA9876543210).data);
+    PrintWide(ToHexStringTruncated(0x00000000F0FFFF00).data);
+
+    printf("-- Testing U64ToString --\n");
+    PrintWide(U64ToString(0, 10).data);
+    PrintWide(U64ToString(1234, 10).data);
+    PrintWide(U64ToString(0 - 1, 10).data);
+    PrintWide(U64ToString(0xBEEF, 16).data);
+    PrintWide(U64ToString(8, 8).data);
+}
@@ -0,0 +1,254 @@
+// Turn the kernel ELF into a compressed kernel image (see src/kernel_image.h).
+//
+//     ./kernel_pack build/kernel build/kernel.packed
+//
+// Only the PT_LOAD segments are kept. Every block is decompressed again with
+// the bootloader's own decompressor before the image is written.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/types.h"
+#include "../src/elf.h"
+#include "../src/kernel_image.h"
+#include "../src/lz4.c"
+
+
+#define HASH_BITS      16
+#define LAST_LITERALS  5    // The block format ends with at least this many literals...
+#define MATCH_LIMIT    12   // ...and the last match starts at least this far from the end.
+#define MAX_OFFSET     65535
+
+
+static u32 read_u32(const u8* data)
+{
+    u32 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static u8* write_length(u8* out, u64 length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (u8) length;
+    return out;
+}
+
+static u8* write_sequence(u8* out, const u8* literals, u64 literal_count, u64 offset, u64 match_length)
+{
+    u64 match_code = match_length - LZ4_MIN_MATCH;
+    u8* token = out++;
+    *token = (u8) (((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15));
+
+    if (literal_count >= 15)
+        out = write_length(out, literal_count - 15);
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    *out++ = (u8) offset;
+    *out++ = (u8) (offset >> 8);
+
+    if (match_code >= 15)
+        out = write_length(out, match_code - 15);
+    return out;
+}
+
+static u8* write_last_literals(u8* out, const u8* literals, u64 literal_count)
+{
+    *out++ = (u8) ((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15)
+        out = write_length(out, literal_count - 15);
+    memcpy(out, literals, literal_count);
+    return out + literal_count;
+}
+
+
+// Greedy LZ4 block compressor with a single-entry hash table. `destination`
+// must hold `lz4_bound(size)` bytes.
+static u64 lz4_bound(u64 size)
+{
+    return size + size / 255 + 16;
+}
+
+static u64 lz4_compress(const u8* source, u64 size, u8* destination)
+{
+    static u32 table[1 << HASH_BITS];   // Position + 1, 0 for empty.
+    memset(table, 0, sizeof(table));
+
+    u8* out    = destination;
+    u64 anchor = 0;
+    u64 i      = 0;
+
+    if (size > MATCH_LIMIT)
+    {
+        while (i <= size - MATCH_LIMIT)
+        {
+            u32 sequence  = read_u32(source + i);
+            u32 hash      = (sequence * 2654435761u) >> (32 - HASH_BITS);
+            u64 candidate = table[hash];
+            table[hash]   = (u32) i + 1;
+
+            if (!candidate || i - (candidate - 1) > MAX_OFFSET || read_u32(source + candidate - 1) != sequence)
+            {
+                ++i;
+                continue;
+            }
+
+            u64 match  = candidate - 1;
+            u64 length = LZ4_MIN_MATCH;
+            while (i + length < size - LAST_LITERALS && source[match + length] == source[i + length])
+                ++length;
+            while (i > anchor && match > 0 && source[i - 1] == source[match - 1])
+            {
+                --i;
+                --match;
+                ++length;
+            }
+
+            out    = write_sequence(out, source + anchor, i - anchor, i - match, length);
+            i     += length;
+            anchor = i;
+        }
+    }
+
+    out = write_last_literals(out, source + anchor, size - anchor);
+    return out - destination;
+}
+
+
+static u8* read_file(const char* path, u64* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = (u64) ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    u8* data = malloc(*size);
+    if (data && fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <kernel.elf> <output>\n", argv[0]);
+        return 1;
+    }
+
+    u64 elf_size = 0;
+    u8* elf = read_file(argv[1], &elf_size);
+    if (!elf || elf_size < sizeof(Elf64Header) || read_u32(elf) != 0x464C457F || is_elf64(elf) != ELF_YES)
+    {
+        fprintf(stderr, "%s: not a 64-bit ELF file\n", argv[1]);
+        return 1;
+    }
+
+    const Elf64Header*        header   = (const Elf64Header *) elf;
+    const Elf64ProgramHeader* programs = (const Elf64ProgramHeader *) (elf + header->program_header_offset);
+
+    KernelImageSegment segments[64];
+    u16 segment_count = 0;
+    u64 uncompressed  = 0;
+
+    // Worst case is every block stored, plus its header.
+    u64 capacity = 0;
+    for (int i = 0; i < header->program_header_entries; ++i)
+        if (programs[i].type == PT_LOAD)
+            capacity += programs[i].file_size + (programs[i].file_size / KERNEL_IMAGE_BLOCK_SIZE + 1) * sizeof(u32);
+
+    u8* payload = malloc(capacity);
+    u8* cursor  = payload;
+    u8* block    = malloc(lz4_bound(KERNEL_IMAGE_BLOCK_SIZE));
+    u8* check    = malloc(KERNEL_IMAGE_BLOCK_SIZE);
+
+    for (int i = 0; i < header->program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD || program->memory_size == 0)
+            continue;
+        if (segment_count == ARRAY_COUNT(segments) || program->file_offset + program->file_size > elf_size)
+        {
+            fprintf(stderr, "%s: unsupported program header %d\n", argv[1], i);
+            return 1;
+        }
+
+        const u8* data  = elf + program->file_offset;
+        u8*       begin = cursor;
+
+        for (u64 offset = 0; offset < program->file_size; offset += KERNEL_IMAGE_BLOCK_SIZE)
+        {
+            u64 size = program->file_size - offset;
+            if (size > KERNEL_IMAGE_BLOCK_SIZE)
+                size = KERNEL_IMAGE_BLOCK_SIZE;
+
+            u64 compressed = lz4_compress(data + offset, size, block);
+            if (lz4_decompress(block, compressed, check, size) != (i64) size || memcmp(check, data + offset, size) != 0)
+            {
+                fprintf(stderr, "Block at %llx doesn't decompress back to itself\n", (unsigned long long) offset);
+                return 1;
+            }
+
+            u32 block_header = (u32) compressed;
+            const u8* bytes  = block;
+            if (compressed >= size)
+            {
+                block_header = (u32) size | KERNEL_IMAGE_BLOCK_STORED;
+                bytes        = data + offset;
+                compressed   = size;
+            }
+
+            memcpy(cursor, &block_header, sizeof(block_header));
+            memcpy(cursor + sizeof(block_header), bytes, compressed);
+            cursor += sizeof(block_header) + compressed;
+        }
+
+        segments[segment_count++] = (KernelImageSegment) {
+            .virtual_address = program->virtual_address,
+            .file_size       = program->file_size,
+            .memory_size     = program->memory_size,
+            .compressed_size = (u64) (cursor - begin),
+        };
+        uncompressed += program->file_size;
+    }
+
+    KernelImageHeader image_header = {
+        .magic             = KERNEL_IMAGE_MAGIC,
+        .version           = KERNEL_IMAGE_VERSION,
+        .segment_count     = segment_count,
+        .block_size        = KERNEL_IMAGE_BLOCK_SIZE,
+        .entry_point       = header->entry_point,
+        .uncompressed_size = uncompressed,
+    };
+
+    FILE* output = fopen(argv[2], "wb");
+    if (!output)
+    {
+        fprintf(stderr, "Couldn't open %s\n", argv[2]);
+        return 1;
+    }
+    fwrite(&image_header, sizeof(image_header), 1, output);
+    fwrite(segments, sizeof(KernelImageSegment), segment_count, output);
+    fwrite(payload, 1, cursor - payload, output);
+    fclose(output);
+
+    u64 image_size = sizeof(image_header) + segment_count * sizeof(KernelImageSegment) + (cursor - payload);
+    printf("%s: %llu segment bytes -> %llu bytes (ELF was %llu)\n", argv[2],
+           (unsigned long long) uncompressed, (unsigned long long) image_size, (unsigned long long) elf_size);
+
+    free(check);
+    free(block);
+    free(payload);
+    free(elf);
+    return 0;
+}
@@ -24,7 +24,7 @@ mount -t msdos "${disk}" /tmp/mnt &> /dev/null
 cp build/release.BOOTX64.EFI /tmp/mnt/EFI/Boot/BOOTX64.EFI
 cp drive/text.txt /tmp/mnt/text.txt
 cp drive/default-font.psf /tmp/mnt/default-font.psf
-cp build/kernel /tmp/mnt/kernel
+cp build/kernel.packed /tmp/mnt/kernel
 
 
 # Unmount and detach the disk.
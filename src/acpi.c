@@ -0,0 +1,186 @@
+// Just enough ACPI to find the CPUs: RSDP -> XSDT (or RSDT) -> MADT.
+//
+// The bootloader passes the RSDP from the UEFI configuration table. The
+// tables live in ACPI reclaim/NVS memory, which nothing in the kernel frees,
+// and are read in place through the direct map.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define ACPI_MAX_CPUS 256
+
+#define ACPI_MADT_LOCAL_APIC           0
+#define ACPI_MADT_LOCAL_APIC_OVERRIDE  5
+#define ACPI_MADT_LOCAL_X2APIC         9
+
+#define ACPI_CPU_ENABLED        (1u << 0)
+#define ACPI_CPU_ONLINE_CAPABLE (1u << 1)
+
+
+typedef struct __attribute__((packed)) AcpiRsdp
+{
+    char signature[8];      // "RSD PTR "
+    u8   checksum;          // Over the first 20 bytes.
+    char oem[6];
+    u8   revision;          // 0 for ACPI 1.0, 2 from ACPI 2.0 on.
+    u32  rsdt;
+    u32  length;
+    u64  xsdt;
+    u8   extended_checksum; // Over `length` bytes.
+    u8   _reserved[3];
+} AcpiRsdp;
+
+typedef struct __attribute__((packed)) AcpiHeader
+{
+    char signature[4];
+    u32  length;            // Header included.
+    u8   revision;
+    u8   checksum;
+    char oem[6];
+    char oem_table[8];
+    u32  oem_revision;
+    u32  creator;
+    u32  creator_revision;
+} AcpiHeader;
+
+typedef struct __attribute__((packed)) AcpiMadt
+{
+    AcpiHeader header;
+    u32        local_apic;
+    u32        flags;
+    // Variable-length entries, each starting with a type and a length.
+} AcpiMadt;
+
+typedef struct Acpi
+{
+    u8  revision;
+    u64 madt;                       // Physical address, 0 if not found.
+    u64 local_apic;                 // From the MADT, override included.
+    u32 cpu_count;
+    u32 cpus_dropped;               // Past ACPI_MAX_CPUS.
+    u32 cpus_hotplug;               // Disabled but online-capable: not started.
+    u32 apic_ids[ACPI_MAX_CPUS];    // Usable CPUs, in MADT order.
+} Acpi;
+
+
+Acpi g_acpi;
+
+
+static inline const void* acpi_map(u64 physical)
+{
+    return g_paging.pml4 ? paging_direct(physical) : (const void *) physical;
+}
+
+static int acpi_checksum(const void* data, u64 size)
+{
+    const u8* bytes = data;
+    u8 sum = 0;
+    for (u64 i = 0; i < size; ++i)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+static int acpi_signature(const char* a, const char* b, u64 size)
+{
+    for (u64 i = 0; i < size; ++i)
+        if (a[i] != b[i])
+            return 0;
+    return 1;
+}
+
+
+// Look up a table by signature in the XSDT (8-byte entries) or the RSDT
+// (4-byte entries). Returns its physical address, or 0.
+static u64 acpi_find_table(u64 root, u64 entry_size, const char* signature)
+{
+    const AcpiHeader* header = acpi_map(root);
+    if (!acpi_checksum(header, header->length))
+        return 0;
+
+    const u8* entries = (const u8 *) header + sizeof(AcpiHeader);
+    u64 count = (header->length - sizeof(AcpiHeader)) / entry_size;
+    for (u64 i = 0; i < count; ++i)
+    {
+        u64 address = 0;
+        memcpy(&address, entries + i * entry_size, entry_size);    // Unaligned in the XSDT.
+
+        const AcpiHeader* table = acpi_map(address);
+        if (acpi_signature(table->signature, signature, 4) && acpi_checksum(table, table->length))
+            return address;
+    }
+    return 0;
+}
+
+
+// Only enabled CPUs are usable now. An online-capable one is disabled
+// until it's hot-added (ACPI 6.3), and wouldn't answer a startup IPI.
+static void acpi_add_cpu(u32 apic_id, u32 flags)
+{
+    if (!(flags & ACPI_CPU_ENABLED))
+    {
+        if (flags & ACPI_CPU_ONLINE_CAPABLE)
+            g_acpi.cpus_hotplug += 1;
+        return;
+    }
+
+    for (u32 i = 0; i < g_acpi.cpu_count; ++i)
+        if (g_acpi.apic_ids[i] == apic_id)
+            return;     // Firmware may list a CPU as both kinds.
+
+    if (g_acpi.cpu_count == ACPI_MAX_CPUS)
+        g_acpi.cpus_dropped += 1;
+    else
+        g_acpi.apic_ids[g_acpi.cpu_count++] = apic_id;
+}
+
+
+// Find the MADT and collect the local APIC IDs of the usable CPUs. Returns
+// the number of CPUs found, 0 if there's no (valid) MADT.
+u32 acpi_init(u64 rsdp_address)
+{
+    g_acpi = (Acpi) { 0 };
+    if (!rsdp_address)
+        return 0;
+
+    const AcpiRsdp* rsdp = acpi_map(rsdp_address);
+    if (!acpi_signature(rsdp->signature, "RSD PTR ", 8) || !acpi_checksum(rsdp, 20))
+        return 0;
+    g_acpi.revision = rsdp->revision;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt && acpi_checksum(rsdp, rsdp->length))
+        g_acpi.madt = acpi_find_table(rsdp->xsdt, 8, "APIC");
+    else
+        g_acpi.madt = acpi_find_table(rsdp->rsdt, 4, "APIC");
+    if (!g_acpi.madt)
+        return 0;
+
+    const AcpiMadt* madt = acpi_map(g_acpi.madt);
+    g_acpi.local_apic = madt->local_apic;
+
+    const u8* entry = (const u8 *) madt + sizeof(AcpiMadt);
+    const u8* end   = (const u8 *) madt + madt->header.length;
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end)
+    {
+        u32 apic_id = 0;
+        u32 flags   = 0;
+        switch (entry[0])
+        {
+            case ACPI_MADT_LOCAL_APIC:
+                apic_id = entry[3];
+                memcpy(&flags, entry + 4, 4);
+                acpi_add_cpu(apic_id, flags);
+                break;
+            case ACPI_MADT_LOCAL_X2APIC:
+                memcpy(&apic_id, entry + 4, 4);
+                memcpy(&flags,   entry + 8, 4);
+                acpi_add_cpu(apic_id, flags);
+                break;
+            case ACPI_MADT_LOCAL_APIC_OVERRIDE:
+                memcpy(&g_acpi.local_apic, entry + 4, 8);
+                break;
+        }
+        entry += entry[1];
+    }
+
+    return g_acpi.cpu_count;
+}
@@ -0,0 +1,278 @@
+// Local APIC: interrupt acknowledgement and the APIC timer.
+//
+// The x2APIC is used when the CPU has it; its registers are MSRs, and
+// there's no MMIO page to map. Otherwise the xAPIC is addressed through its
+// MMIO page at the physical base from IA32_APIC_BASE. The firmware's MTRRs
+// make that range uncacheable, so the direct map's write-back attribute
+// doesn't matter. Either way `apic_read`/`apic_write` take the xAPIC
+// register offsets.
+//
+// The legacy PICs are moved out of the exception vectors and masked; all
+// interrupts come through the local APIC from now on. `apic_init` runs on
+// the bootstrap processor and `apic_init_cpu` on every other CPU; they all
+// use the same mode and the same timer calibration.
+//
+// The timer counts down at the bus clock divided by 16, a rate CPUID rarely
+// reports, so `apic_init` measures it against the TSC.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define APIC_BASE_MSR           0x1B
+#define APIC_BASE_X2APIC        (1ull << 10)
+#define APIC_BASE_ENABLE        (1ull << 11)
+#define APIC_BASE_ADDRESS       0x000FFFFFFFFFF000ull
+#define APIC_X2APIC_MSR         0x800   // Register `offset` is MSR 0x800 + offset / 16.
+
+#define APIC_ID                 0x020
+#define APIC_VERSION            0x030
+#define APIC_TPR                0x080
+#define APIC_EOI                0x0B0
+#define APIC_SVR                0x0F0
+#define APIC_ESR                0x280
+#define APIC_ICR_LOW            0x300
+#define APIC_ICR_HIGH           0x310   // xAPIC only; the x2APIC ICR is one 64-bit MSR.
+#define APIC_LVT_TIMER          0x320
+#define APIC_LVT_ERROR          0x370
+#define APIC_TIMER_INITIAL      0x380
+#define APIC_TIMER_CURRENT      0x390
+#define APIC_TIMER_DIVIDE       0x3E0
+
+#define APIC_SVR_ENABLE         (1u << 8)
+#define APIC_LVT_MASKED         (1u << 16)
+#define APIC_TIMER_PERIODIC     (1u << 17)
+#define APIC_TIMER_DIVIDE_16    0x3
+
+#define APIC_IPI_FIXED          0x00000
+#define APIC_IPI_INIT           0x00500
+#define APIC_IPI_STARTUP        0x00600
+#define APIC_IPI_PENDING        (1u << 12)  // Delivery status, xAPIC only.
+#define APIC_IPI_ASSERT         (1u << 14)
+#define APIC_IPI_ALL_BUT_SELF   (3u << 18)
+
+#define APIC_TIMER_VECTOR       32
+#define APIC_ERROR_VECTOR       0xFE
+#define APIC_SPURIOUS_VECTOR    0xFF
+
+#define APIC_CALIBRATION_NS     10000000ull
+#define APIC_SHIFT              32
+
+#define PIC1_COMMAND            0x20
+#define PIC1_DATA               0x21
+#define PIC2_COMMAND            0xA0
+#define PIC2_DATA               0xA1
+
+
+typedef struct Apic
+{
+    volatile u32* registers;    // xAPIC MMIO, NULL in x2APIC mode.
+    int           x2apic;
+    u32           id;           // The bootstrap processor's.
+    u32           version;
+
+    u64 timer_hz;               // Timer ticks per second, after the divider.
+    u64 ticks_per_ns;           // 32.32 fixed point.
+
+    // Summed over all CPUs.
+    u64 timer_interrupts;
+    u64 errors;
+    u64 spurious;
+} Apic;
+
+
+Apic g_apic;
+
+
+static inline u32 apic_read(u32 reg)
+{
+    if (g_apic.x2apic)
+        return (u32) read_msr(APIC_X2APIC_MSR + reg / 16);
+    return g_apic.registers[reg / 4];
+}
+
+static inline void apic_write(u32 reg, u32 value)
+{
+    if (g_apic.x2apic)
+        write_msr(APIC_X2APIC_MSR + reg / 16, value);
+    else
+        g_apic.registers[reg / 4] = value;
+}
+
+
+static void apic_end_of_interrupt(u64 vector)
+{
+    if (vector != APIC_SPURIOUS_VECTOR)
+        apic_write(APIC_EOI, 0);
+}
+
+static void apic_timer_interrupt(InterruptFrame* frame, void* user)
+{
+    (void) frame;
+    (void) user;
+    __atomic_fetch_add(&g_apic.timer_interrupts, 1, __ATOMIC_RELAXED);
+}
+
+static void apic_error_interrupt(InterruptFrame* frame, void* user)
+{
+    (void) frame;
+    (void) user;
+    apic_write(APIC_ESR, 0);    // Latches the errors so they can be read.
+    __atomic_fetch_add(&g_apic.errors, 1, __ATOMIC_RELAXED);
+}
+
+static void apic_spurious_interrupt(InterruptFrame* frame, void* user)
+{
+    (void) frame;
+    (void) user;
+    __atomic_fetch_add(&g_apic.spurious, 1, __ATOMIC_RELAXED);
+}
+
+
+// Move the PICs to vectors 0x20-0x2F, so a spurious IRQ 7 or 15 can't look
+// like an exception, and mask every line.
+static void apic_disable_pic()
+{
+    write_port(PIC1_COMMAND, 0x11);     // ICW1: initialize, ICW4 follows.
+    write_port(PIC2_COMMAND, 0x11);
+    write_port(PIC1_DATA, 0x20);        // ICW2: vector base.
+    write_port(PIC2_DATA, 0x28);
+    write_port(PIC1_DATA, 0x04);        // ICW3: slave on IRQ 2.
+    write_port(PIC2_DATA, 0x02);
+    write_port(PIC1_DATA, 0x01);        // ICW4: 8086 mode.
+    write_port(PIC2_DATA, 0x01);
+    write_port(PIC1_DATA, 0xFF);
+    write_port(PIC2_DATA, 0xFF);
+}
+
+
+// Count timer ticks over APIC_CALIBRATION_NS of TSC time.
+static u64 apic_timer_calibrate()
+{
+    if (!g_time.tsc_hz)
+        return 0;
+
+    apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    u64 start = read_tsc();
+    apic_write(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    sleep_ns(APIC_CALIBRATION_NS);
+    u32 remaining = apic_read(APIC_TIMER_CURRENT);
+    u64 end = read_tsc();
+    apic_write(APIC_TIMER_INITIAL, 0);
+
+    u64 ticks = 0xFFFFFFFFull - remaining;
+    u64 ns    = cycles_to_ns(end - start);
+    if (ns == 0)
+        return 0;
+    return ticks * 1000000000ull / ns;
+}
+
+
+// Enable this CPU's local APIC in the mode `apic_init` picked. Every CPU
+// runs this once; the rest of the setup is shared.
+void apic_init_cpu()
+{
+    // Going from disabled straight to x2APIC mode faults; enable the xAPIC
+    // on the way.
+    u64 base = read_msr(APIC_BASE_MSR) | APIC_BASE_ENABLE;
+    write_msr(APIC_BASE_MSR, base);
+    if (g_apic.x2apic)
+        write_msr(APIC_BASE_MSR, base | APIC_BASE_X2APIC);
+
+    apic_write(APIC_TPR, 0);
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    apic_write(APIC_LVT_ERROR, APIC_ERROR_VECTOR);
+    apic_write(APIC_ESR, 0);
+}
+
+u32 apic_id()
+{
+    return g_apic.x2apic ? apic_read(APIC_ID) : apic_read(APIC_ID) >> 24;
+}
+
+
+// Enable the bootstrap processor's local APIC, with the x2APIC when the CPU
+// has one, and calibrate the timer. Needs the IDT and the TSC calibration.
+// Returns 0 if there's no local APIC.
+int apic_init()
+{
+    g_apic = (Apic) { 0 };
+
+    if (!(cpuid(1, 0).edx & (1u << 9)))
+        return 0;
+
+    g_apic.x2apic = cpu_has(CPU_FEATURE_X2APIC);
+    if (!g_apic.x2apic)
+    {
+        u64 physical = read_msr(APIC_BASE_MSR) & APIC_BASE_ADDRESS;
+        g_apic.registers = (volatile u32 *) (g_paging.pml4 ? paging_direct(physical) : (void *) physical);
+    }
+
+    apic_disable_pic();
+
+    interrupt_register(APIC_TIMER_VECTOR,    apic_timer_interrupt,    NULL);
+    interrupt_register(APIC_ERROR_VECTOR,    apic_error_interrupt,    NULL);
+    interrupt_register(APIC_SPURIOUS_VECTOR, apic_spurious_interrupt, NULL);
+    g_interrupt_end_of_irq = apic_end_of_interrupt;
+
+    apic_init_cpu();
+    g_apic.id      = apic_id();
+    g_apic.version = apic_read(APIC_VERSION) & 0xFF;
+
+    u64 giga = 1000000000ull;
+    g_apic.timer_hz     = apic_timer_calibrate();
+    g_apic.ticks_per_ns = ((g_apic.timer_hz / giga) << APIC_SHIFT) + ((g_apic.timer_hz % giga) << APIC_SHIFT) / giga;
+    return 1;
+}
+
+
+// Send an inter-processor interrupt: one of the APIC_IPI_* delivery modes
+// with its vector, to `target`'s APIC ID (ignored with APIC_IPI_ALL_BUT_SELF).
+void apic_send_ipi(u32 target, u32 command)
+{
+    if (g_apic.x2apic)
+    {
+        write_msr(APIC_X2APIC_MSR + APIC_ICR_LOW / 16, ((u64) target << 32) | command);
+        return;
+    }
+
+    apic_write(APIC_ICR_HIGH, target << 24);
+    apic_write(APIC_ICR_LOW, command);
+    while (apic_read(APIC_ICR_LOW) & APIC_IPI_PENDING)
+        __asm__ __volatile__("pause");
+}
+
+
+static u32 apic_timer_count(u64 ns)
+{
+    u64 ticks = (u64) (((u128) ns * g_apic.ticks_per_ns) >> APIC_SHIFT);
+    if (ticks == 0)
+        return 1;
+    if (ticks > 0xFFFFFFFFull)
+        return 0xFFFFFFFF;
+    return (u32) ticks;
+}
+
+// Interrupt once, `ns` from now. Longer than the counter reaches (about a
+// minute at typical rates) is cut short.
+void apic_timer_oneshot(u64 ns)
+{
+    apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    apic_write(APIC_TIMER_INITIAL, apic_timer_count(ns));
+}
+
+// Interrupt every `ns`.
+void apic_timer_periodic(u64 ns)
+{
+    apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    apic_write(APIC_TIMER_INITIAL, apic_timer_count(ns));
+}
+
+void apic_timer_stop()
+{
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_TIMER_INITIAL, 0);
+}
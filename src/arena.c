@@ -0,0 +1,204 @@
+// Boot arena: a bump allocator for data that lives as long as the kernel.
+//
+// Before the page allocator exists, the arena hands out memory from the
+// largest EfiConventionalMemory range in the memory map. The page allocator
+// takes its frame table from the arena, then calls `arena_handover`: the
+// pages the arena has used so far stay allocated, and the rest of the range
+// goes to the page allocator. After that, the arena refills itself with
+// chunks from the page allocator.
+//
+// An allocation is an align and an add. Nothing is freed one allocation at
+// a time. `arena_checkpoint`/`arena_rewind` throw away everything allocated
+// since a point, e.g. scratch space for parsing a table.
+//
+// Not thread-safe; callers serialize.
+#include "bootloader.h"
+#include "types.h"
+
+
+// From page_allocator.c, which itself needs the arena for its frame table.
+u64  page_alloc_order(u32 order);
+void page_free(u64 address);
+
+
+#define ARENA_PAGE_SIZE   4096ull
+#define ARENA_LOW_MEMORY  0x100000ull   // Same as the page allocator's PAGE_LOW_MEMORY.
+#define ARENA_CHUNK_ORDER 4             // 64 KiB chunks after the handover.
+#define ARENA_MAX_ORDER   10            // The page allocator's largest block.
+
+
+// At the start of every chunk from the page allocator, so a rewind can
+// find its way back to the chunk before.
+typedef struct ArenaChunk
+{
+    u64 previous;       // Start of the previous chunk (or the seed range).
+    u64 previous_cursor;
+    u64 previous_end;
+} ArenaChunk;
+
+typedef struct ArenaCheckpoint
+{
+    u64 chunk;
+    u64 cursor;
+} ArenaCheckpoint;
+
+typedef struct ArenaRange
+{
+    u64 begin;
+    u64 end;
+} ArenaRange;
+
+typedef struct Arena
+{
+    u64 chunk;          // Start of the memory being bumped through.
+    u64 cursor;
+    u64 end;
+
+    u64 seed_begin;     // The range from the memory map.
+    u64 seed_end;
+    u64 floor;          // Lowest address `arena_rewind` may go back to.
+    int handed_over;
+
+    u64 used;           // Bytes handed out, alignment padding included.
+    u64 peak;
+    u64 allocations;
+    u64 chunk_pages;    // Pages taken from the page allocator.
+} Arena;
+
+
+Arena g_arena;
+
+
+// Seed the arena with the largest conventional range above 1 MiB.
+// Returns 0 if there isn't one.
+int arena_init(const Memory* memory)
+{
+    g_arena = (Arena) { 0 };
+
+    u64 entries = memory->MemoryMapSize / memory->DescriptorSize;
+    for (u64 i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *)
+            ((const u8 *) memory->MemoryMap + i * memory->DescriptorSize);
+        if (descriptor->Type != EfiConventionalMemory)
+            continue;
+
+        u64 begin = descriptor->PhysicalStart;
+        u64 end   = begin + descriptor->NumberOfPages * ARENA_PAGE_SIZE;
+        if (begin < ARENA_LOW_MEMORY)
+            begin = ARENA_LOW_MEMORY;
+        if (begin < end && end - begin > g_arena.seed_end - g_arena.seed_begin)
+        {
+            g_arena.seed_begin = begin;
+            g_arena.seed_end   = end;
+        }
+    }
+
+    g_arena.chunk  = g_arena.seed_begin;
+    g_arena.cursor = g_arena.seed_begin;
+    g_arena.end    = g_arena.seed_end;
+    g_arena.floor  = g_arena.seed_begin;
+    return g_arena.seed_end != 0;
+}
+
+
+// Move on to a fresh chunk from the page allocator with room for `size`
+// bytes at `alignment`.
+static int arena_refill(u64 size, u64 alignment)
+{
+    u64 needed = sizeof(ArenaChunk) + alignment + size;
+    u32 order  = ARENA_CHUNK_ORDER;
+    while ((ARENA_PAGE_SIZE << order) < needed && order < ARENA_MAX_ORDER)
+        ++order;
+    if ((ARENA_PAGE_SIZE << order) < needed)
+        return 0;
+
+    u64 address = page_alloc_order(order);
+    if (!address)
+        return 0;
+
+    ArenaChunk* chunk      = (ArenaChunk *) address;
+    chunk->previous        = g_arena.chunk;
+    chunk->previous_cursor = g_arena.cursor;
+    chunk->previous_end    = g_arena.end;
+
+    g_arena.chunk        = address;
+    g_arena.cursor       = address + sizeof(ArenaChunk);
+    g_arena.end          = address + (ARENA_PAGE_SIZE << order);
+    g_arena.chunk_pages += 1ull << order;
+    return 1;
+}
+
+
+// Allocate `size` bytes aligned to `alignment`, a power of two. Returns
+// NULL if there's no memory left.
+void* arena_alloc(u64 size, u64 alignment)
+{
+    u64 address = (g_arena.cursor + alignment - 1) & ~(alignment - 1);
+    if (address + size > g_arena.end || address < g_arena.cursor)
+    {
+        if (!g_arena.handed_over || !arena_refill(size, alignment))
+            return NULL;
+        address = (g_arena.cursor + alignment - 1) & ~(alignment - 1);
+    }
+
+    g_arena.used  += address + size - g_arena.cursor;
+    g_arena.cursor = address + size;
+    g_arena.allocations += 1;
+    if (g_arena.used > g_arena.peak)
+        g_arena.peak = g_arena.used;
+
+    return (void *) address;
+}
+
+
+ArenaCheckpoint arena_checkpoint()
+{
+    return (ArenaCheckpoint) { .chunk=g_arena.chunk, .cursor=g_arena.cursor };
+}
+
+// Free everything allocated since `checkpoint`. Chunks taken since then go
+// back to the page allocator. Checkpoints from before the handover can't be
+// rewound past it; that memory belongs to the page allocator's accounting.
+void arena_rewind(ArenaCheckpoint checkpoint)
+{
+    while (g_arena.chunk != checkpoint.chunk && g_arena.chunk != g_arena.seed_begin)
+    {
+        ArenaChunk chunk = *(ArenaChunk *) g_arena.chunk;
+        u64 size = g_arena.end - g_arena.chunk;
+
+        g_arena.used        -= g_arena.cursor - (g_arena.chunk + sizeof(ArenaChunk));
+        g_arena.chunk_pages -= size / ARENA_PAGE_SIZE;
+        page_free(g_arena.chunk);
+
+        g_arena.chunk  = chunk.previous;
+        g_arena.cursor = chunk.previous_cursor;
+        g_arena.end    = chunk.previous_end;
+    }
+
+    if (g_arena.chunk != checkpoint.chunk)
+        return;
+    if (checkpoint.cursor < g_arena.floor && g_arena.chunk == g_arena.seed_begin)
+        checkpoint.cursor = g_arena.floor;
+    if (checkpoint.cursor < g_arena.cursor)
+    {
+        g_arena.used  -= g_arena.cursor - checkpoint.cursor;
+        g_arena.cursor = checkpoint.cursor;
+    }
+}
+
+
+// Called by the page allocator once it's up. Returns the pages of the seed
+// range the arena has used, which the page allocator must leave alone; the
+// rest of the range is the page allocator's. The arena keeps bumping
+// through its last page, then takes chunks from the page allocator.
+ArenaRange arena_handover()
+{
+    u64 end = (g_arena.cursor + ARENA_PAGE_SIZE - 1) & ~(ARENA_PAGE_SIZE - 1);
+    if (g_arena.chunk == g_arena.seed_begin)
+        g_arena.end = end;
+
+    g_arena.floor       = g_arena.cursor;
+    g_arena.handed_over = 1;
+    return (ArenaRange) { .begin=g_arena.seed_begin, .end=end };
+}
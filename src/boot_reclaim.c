@@ -0,0 +1,109 @@
+// Take back the memory the firmware and the bootloader no longer need.
+//
+// After ExitBootServices, EfiBootServicesCode/Data and EfiLoaderData are
+// ours, but they still hold things the kernel uses: the memory map, the font
+// glyphs and, implicitly, the page tables, GDT and IDT the firmware left
+// active. Everything the kernel reads by pointer is copied into the boot
+// arena first; what the CPU itself points at is pinned. The rest is
+// handed to the page allocator.
+//
+// The kernel image, its stack and the back buffer are allocated as
+// KERNEL_MEMORY_TYPE by the bootloader and are never touched here.
+#include "bootloader.h"
+#include "types.h"
+
+
+typedef struct BootReclaimResult
+{
+    u64 pages;      // Pages handed to the allocator.
+    u64 pinned;     // Pages kept for the live page tables, GDT and IDT.
+} BootReclaimResult;
+
+
+// Copy `size` bytes into the boot arena. Returns NULL if there's no room,
+// in which case the caller must not reclaim the source.
+static void* boot_reclaim_copy(const void* source, u64 size)
+{
+    void* copy = arena_alloc(size, 16);
+    if (copy)
+        memcpy(copy, source, size);
+    return copy;
+}
+
+
+// Pin every table reachable from CR3, in case they're still the
+// bootloader's. Tables are read through the identity mapping.
+static u64 boot_reclaim_pin_page_tables()
+{
+    u64* pml4   = (u64 *) (read_cr3() & PAGE_ADDRESS);
+    u64  pinned = page_pin_range((u64) pml4, (u64) pml4 + PAGE_SIZE);
+
+    for (int i = 0; i < 512; ++i)
+    {
+        if (!(pml4[i] & PAGE_PRESENT))
+            continue;
+        u64* pdpt = (u64 *) (pml4[i] & PAGE_ADDRESS);
+        pinned += page_pin_range((u64) pdpt, (u64) pdpt + PAGE_SIZE);
+
+        for (int j = 0; j < 512; ++j)
+        {
+            if (!(pdpt[j] & PAGE_PRESENT) || (pdpt[j] & PAGE_LARGE))
+                continue;
+            u64* pd = (u64 *) (pdpt[j] & PAGE_ADDRESS);
+            pinned += page_pin_range((u64) pd, (u64) pd + PAGE_SIZE);
+
+            for (int k = 0; k < 512; ++k)
+            {
+                if (!(pd[k] & PAGE_PRESENT) || (pd[k] & PAGE_LARGE))
+                    continue;
+                u64 pt = pd[k] & PAGE_ADDRESS;
+                pinned += page_pin_range(pt, pt + PAGE_SIZE);
+            }
+        }
+    }
+
+    return pinned;
+}
+
+
+// Move the memory map and the glyphs out of the bootloader's pools, pin
+// what's still live, and free every reclaimable range in the memory map.
+// `context` must be the kernel's own copy; its pointers are updated.
+BootReclaimResult boot_reclaim(Context* context)
+{
+    BootReclaimResult result = { 0 };
+
+    PSF1_Font* font   = &context->font;
+    u64 glyph_count   = (font->header.file_mode & 1) ? 512 : 256;
+    u64 glyph_bytes   = glyph_count * font->header.font_height;
+    u8* glyphs        = boot_reclaim_copy(font->glyphs, glyph_bytes);
+    void* memory_map  = boot_reclaim_copy(context->memory.MemoryMap, context->memory.MemoryMapSize);
+    if (!glyphs || !memory_map)
+        return result;
+
+    font->glyphs              = glyphs;
+    context->memory.MemoryMap = memory_map;
+
+    result.pinned = boot_reclaim_pin_page_tables();
+
+    DescriptorTablePointer gdtr = read_gdtr();
+    DescriptorTablePointer idtr = read_idtr();
+    result.pinned += page_pin_range(gdtr.base, gdtr.base + gdtr.limit + 1);
+    result.pinned += page_pin_range(idtr.base, idtr.base + idtr.limit + 1);
+
+    const Memory* memory = &context->memory;
+    u64 entries = memory->MemoryMapSize / memory->DescriptorSize;
+    for (u64 i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *)
+            ((const u8 *) memory->MemoryMap + i * memory->DescriptorSize);
+
+        if (page_is_reclaimable(descriptor->Type))
+            result.pages += page_reclaim_range(
+                descriptor->PhysicalStart,
+                descriptor->PhysicalStart + descriptor->NumberOfPages * PAGE_SIZE
+            );
+    }
+
+    return result;
+}
@@ -0,0 +1,39 @@
+// Boot phase timing, shared by the bootloader and the kernel.
+//
+// Each mark records the TSC at the *end* of a phase, so a phase lasted from
+// the previous mark to its own. The first phase is measured from TSC 0,
+// which is roughly when the machine was reset.
+#include "bootloader.h"
+#include "types.h"
+
+
+void boot_timeline_mark(BootTimeline* timeline, const char* name)
+{
+    u64 now = read_tsc();
+    if (timeline->count >= BOOT_TIMELINE_MAX_PHASES)
+        return;
+
+    BootPhase* phase = &timeline->phases[timeline->count++];
+    phase->tsc = now;
+
+    int i = 0;
+    for (; name[i] && i < BOOT_PHASE_NAME_LENGTH - 1; ++i)
+        phase->name[i] = name[i];
+    phase->name[i] = '\0';
+}
+
+
+// Duration of phase `index` in microseconds.
+u64 boot_timeline_phase_us(const BootTimeline* timeline, u32 index)
+{
+    if (!timeline->tsc_hz || index >= timeline->count)
+        return 0;
+
+    u64 begin = index ? timeline->phases[index - 1].tsc : 0;
+    u64 ticks = timeline->phases[index].tsc - begin;
+
+    // Split to avoid overflowing for long phases.
+    u64 seconds = ticks / timeline->tsc_hz;
+    u64 rest    = ticks % timeline->tsc_hz;
+    return seconds * 1000000 + rest * 1000000 / timeline->tsc_hz;
+}
@@ -5,6 +5,20 @@
 #include "types.h"
 
 
+// Memory the bootloader allocates for the kernel (its segments, stack and
+// back buffer) gets this OS-defined EFI memory type, so the kernel can
+// tell it apart from the bootloader's own EfiLoaderData and reclaim the
+// latter.
+#define KERNEL_MEMORY_TYPE 0x80000000u
+
+#define KERNEL_STACK_SIZE  (64 * 1024)
+
+// The kernel is linked at KERNEL_VIRTUAL_BASE + its physical address (see
+// src/kernel.lds). The bootloader maps the first GiB of physical memory
+// there before jumping to it.
+#define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ull
+
+
 typedef struct Pixel {
     u8 blue;
     u8 green;
@@ -14,6 +28,7 @@ typedef struct Pixel {
 
 typedef struct Graphics {
     volatile Pixel* base;
+    Pixel*  back_buffer;  // RAM shadow of `base`, same pitch. The kernel draws here.
     u64     size;
     u32     width;
     u32     height;
@@ -39,10 +54,28 @@ typedef struct PSF1_Font {
     u8*         glyphs;
 } PSF1_Font;
 
+// TSC timestamps taken at the end of each boot phase. The bootloader starts
+// the timeline and the kernel keeps appending to its own copy.
+#define BOOT_TIMELINE_MAX_PHASES 32
+#define BOOT_PHASE_NAME_LENGTH   24
+
+typedef struct BootPhase {
+    char name[BOOT_PHASE_NAME_LENGTH];  // Copied, so it outlives the bootloader image.
+    u64  tsc;
+} BootPhase;
+
+typedef struct BootTimeline {
+    u64       tsc_hz;   // 0 if it couldn't be measured.
+    u32       count;
+    BootPhase phases[BOOT_TIMELINE_MAX_PHASES];
+} BootTimeline;
+
 typedef struct Context
 {
     EFI_RUNTIME_SERVICES* services;
     Memory    memory;
     Graphics  graphics;
     PSF1_Font font;
+    BootTimeline timeline;
+    u64       rsdp;     // Physical address of the ACPI RSDP, 0 if the firmware has none.
 } Context;
@@ -0,0 +1,247 @@
+// Text console on top of the shadow framebuffer.
+//
+// The console is a grid of character cells. Writing text only touches cells;
+// pixels are produced later by `console_present`, which re-rasterizes the
+// cells that differ from what is already on screen. The grid is a ring of
+// rows, so scrolling is a single index bump instead of moving pixels around
+// for every line of output.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define CONSOLE_MAX_COLS 512
+#define CONSOLE_MAX_ROWS 256
+
+#define CONSOLE_DEFAULT_ATTRIBUTE 0x0F  // White on black.
+
+
+typedef struct Cursor
+{
+    int row;
+    int col;
+} Cursor;
+
+// Attribute is VGA-style: low nibble foreground, high nibble background,
+// both indices into `CONSOLE_PALETTE`.
+typedef struct Cell
+{
+    u8 character;
+    u8 attribute;
+} Cell;
+
+typedef struct Console
+{
+    PSF1_Font* font;
+
+    int cols;
+    int rows;
+    int cell_width;
+    int cell_height;
+
+    Cursor cursor;      // In cells, relative to the screen.
+    u8     attribute;   // Used for new text.
+
+    // Ring of rows. Screen row `r` is stored at ring row `(top + r) % rows`.
+    int  top;
+    Cell cells[CONSOLE_MAX_ROWS * CONSOLE_MAX_COLS];
+    u8   dirty[CONSOLE_MAX_ROWS];  // Indexed by ring row.
+
+    // What is currently rasterized in the back buffer, also as a ring.
+    int  shown_top;
+    Cell shown[CONSOLE_MAX_ROWS * CONSOLE_MAX_COLS];
+
+    // Rows scrolled since the last present. Scrolling the pixels is deferred
+    // so a burst of output only moves the image once.
+    int pending_scroll;
+} Console;
+
+
+const Pixel CONSOLE_PALETTE[16] = {
+    { .blue=0x00, .green=0x00, .red=0x00, .alpha=0x00 },  // Black
+    { .blue=0xAA, .green=0x00, .red=0x00, .alpha=0x00 },  // Blue
+    { .blue=0x00, .green=0xAA, .red=0x00, .alpha=0x00 },  // Green
+    { .blue=0xAA, .green=0xAA, .red=0x00, .alpha=0x00 },  // Cyan
+    { .blue=0x00, .green=0x00, .red=0xAA, .alpha=0x00 },  // Red
+    { .blue=0xAA, .green=0x00, .red=0xAA, .alpha=0x00 },  // Magenta
+    { .blue=0x00, .green=0x55, .red=0xAA, .alpha=0x00 },  // Brown
+    { .blue=0xAA, .green=0xAA, .red=0xAA, .alpha=0x00 },  // Light gray
+    { .blue=0x55, .green=0x55, .red=0x55, .alpha=0x00 },  // Dark gray
+    { .blue=0xFF, .green=0x55, .red=0x55, .alpha=0x00 },  // Light blue
+    { .blue=0x55, .green=0xFF, .red=0x55, .alpha=0x00 },  // Light green
+    { .blue=0xFF, .green=0xFF, .red=0x55, .alpha=0x00 },  // Light cyan
+    { .blue=0x55, .green=0x55, .red=0xFF, .alpha=0x00 },  // Light red
+    { .blue=0xFF, .green=0x55, .red=0xFF, .alpha=0x00 },  // Light magenta
+    { .blue=0x55, .green=0xFF, .red=0xFF, .alpha=0x00 },  // Yellow
+    { .blue=0xFF, .green=0xFF, .red=0xFF, .alpha=0xFF },  // White
+};
+
+
+Console g_console;
+
+
+static inline Cell* console_row(int screen_row)
+{
+    return &g_console.cells[((g_console.top + screen_row) % g_console.rows) * CONSOLE_MAX_COLS];
+}
+
+static inline Cell* console_shown_row(int screen_row)
+{
+    return &g_console.shown[((g_console.shown_top + screen_row) % g_console.rows) * CONSOLE_MAX_COLS];
+}
+
+static inline Cell console_blank()
+{
+    return (Cell) { .character=' ', .attribute=g_console.attribute };
+}
+
+
+static void console_draw_cell(int screen_row, int col, Cell cell)
+{
+    int x = col * g_console.cell_width;
+    int y = screen_row * g_console.cell_height;
+
+    glyph_atlas_draw(
+        x, y, cell.character,
+        CONSOLE_PALETTE[cell.attribute & 0x0F],
+        CONSOLE_PALETTE[cell.attribute >> 4]
+    );
+
+    graphics_mark_dirty(x, y, g_console.cell_width, g_console.cell_height);
+}
+
+
+void console_init(PSF1_Font* font)
+{
+    glyph_atlas_init(font);
+
+    g_console.font        = font;
+    g_console.cell_width  = 8 * font->scale;
+    g_console.cell_height = font->header.font_height * font->scale;
+
+    g_console.cols = (int) g_graphics->width  / g_console.cell_width;
+    g_console.rows = (int) g_graphics->height / g_console.cell_height;
+    if (g_console.cols > CONSOLE_MAX_COLS) g_console.cols = CONSOLE_MAX_COLS;
+    if (g_console.rows > CONSOLE_MAX_ROWS) g_console.rows = CONSOLE_MAX_ROWS;
+
+    g_console.cursor    = (Cursor) { 0, 0 };
+    g_console.attribute = CONSOLE_DEFAULT_ATTRIBUTE;
+    g_console.top       = 0;
+    g_console.shown_top = 0;
+    g_console.pending_scroll = 0;
+
+    Cell blank = console_blank();
+    for (int row = 0; row < g_console.rows; ++row)
+    {
+        for (int col = 0; col < g_console.cols; ++col)
+        {
+            g_console.cells[row * CONSOLE_MAX_COLS + col] = blank;
+            g_console.shown[row * CONSOLE_MAX_COLS + col] = blank;
+        }
+        g_console.dirty[row] = 0;
+    }
+
+    graphics_fill(CONSOLE_PALETTE[blank.attribute >> 4]);
+}
+
+
+void console_set_attribute(u8 attribute)
+{
+    g_console.attribute = attribute;
+}
+
+
+void console_newline()
+{
+    g_console.cursor.col = 0;
+    if (g_console.cursor.row + 1 < g_console.rows)
+    {
+        g_console.cursor.row += 1;
+        return;
+    }
+
+    // Rotate the ring: the old top row becomes the new bottom row.
+    g_console.top = (g_console.top + 1) % g_console.rows;
+    g_console.pending_scroll += 1;
+
+    Cell* row   = console_row(g_console.rows - 1);
+    Cell  blank = console_blank();
+    for (int col = 0; col < g_console.cols; ++col)
+        row[col] = blank;
+    g_console.dirty[(g_console.top + g_console.rows - 1) % g_console.rows] = 1;
+}
+
+
+void console_put(char character)
+{
+    if (character == '\n')
+    {
+        console_newline();
+        return;
+    }
+
+    int ring_row = (g_console.top + g_console.cursor.row) % g_console.rows;
+    console_row(g_console.cursor.row)[g_console.cursor.col] = (Cell) {
+        .character=(u8) character,
+        .attribute=g_console.attribute
+    };
+    g_console.dirty[ring_row] = 1;
+
+    if (++g_console.cursor.col >= g_console.cols)
+        console_newline();
+}
+
+
+void console_write(const char* source)
+{
+    while (*source != '\0')
+        console_put(*source++);
+}
+
+
+// Bring the back buffer up to date with the cell grid and flush it.
+void console_present()
+{
+    int scroll = g_console.pending_scroll;
+    if (scroll)
+    {
+        if (scroll > g_console.rows)
+            scroll = g_console.rows;
+
+        // One pixel move for the whole burst. The rows uncovered at the
+        // bottom are cleared to the background, i.e. they now show blanks.
+        Cell blank = { .character=' ', .attribute=CONSOLE_DEFAULT_ATTRIBUTE };
+        graphics_scroll(scroll * g_console.cell_height, CONSOLE_PALETTE[blank.attribute >> 4]);
+
+        g_console.shown_top = (g_console.shown_top + scroll) % g_console.rows;
+        for (int row = g_console.rows - scroll; row < g_console.rows; ++row)
+        {
+            Cell* shown = console_shown_row(row);
+            for (int col = 0; col < g_console.cols; ++col)
+                shown[col] = blank;
+        }
+
+        g_console.pending_scroll = 0;
+    }
+
+    for (int row = 0; row < g_console.rows; ++row)
+    {
+        int ring_row = (g_console.top + row) % g_console.rows;
+        if (!g_console.dirty[ring_row])
+            continue;
+
+        Cell* cells = console_row(row);
+        Cell* shown = console_shown_row(row);
+        for (int col = 0; col < g_console.cols; ++col)
+        {
+            if (cells[col].character != shown[col].character || cells[col].attribute != shown[col].attribute)
+            {
+                console_draw_cell(row, col, cells[col]);
+                shown[col] = cells[col];
+            }
+        }
+
+        g_console.dirty[ring_row] = 0;
+    }
+
+    graphics_flush();
+}
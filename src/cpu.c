@@ -0,0 +1,429 @@
+// Wrappers around CPU identification and control instructions.
+#include "types.h"
+
+
+#define MSR_MTRR_CAP        0x0FE
+#define MSR_MTRR_PHYS_BASE0 0x200   // PHYS_BASE(n) = 0x200 + 2n, PHYS_MASK(n) = 0x201 + 2n.
+#define MSR_PAT             0x277
+#define MSR_MTRR_DEF_TYPE   0x2FF
+
+#define CR0_MP (1ull << 1)
+#define CR0_EM (1ull << 2)
+#define CR0_TS (1ull << 3)
+#define CR0_WP (1ull << 16)
+#define CR0_NW (1ull << 29)
+#define CR0_CD (1ull << 30)
+
+#define CR4_OSFXSR     (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE    (1ull << 18)
+
+#define XCR0_X87       (1ull << 0)
+#define XCR0_SSE       (1ull << 1)
+#define XCR0_AVX       (1ull << 2)
+#define XCR0_OPMASK    (1ull << 5)
+#define XCR0_ZMM_HI256 (1ull << 6)
+#define XCR0_HI16_ZMM  (1ull << 7)
+#define XCR0_AVX512    (XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM)
+
+
+// Bits in `CpuFeatures.bits`. The SIMD extensions past SSE2 are only set
+// when the OS has enabled their register state too, so having the bit
+// means the instructions can be used.
+typedef enum CpuFeature
+{
+    CPU_FEATURE_FXSR,
+    CPU_FEATURE_SSE2,
+    CPU_FEATURE_SSE3,
+    CPU_FEATURE_SSSE3,
+    CPU_FEATURE_SSE4_1,
+    CPU_FEATURE_SSE4_2,
+    CPU_FEATURE_POPCNT,
+    CPU_FEATURE_XSAVE,
+    CPU_FEATURE_AVX,
+    CPU_FEATURE_AVX2,
+    CPU_FEATURE_BMI1,
+    CPU_FEATURE_BMI2,
+    CPU_FEATURE_AVX512F,
+    CPU_FEATURE_AVX512BW,
+    CPU_FEATURE_AVX512VL,
+    CPU_FEATURE_ERMS,
+    CPU_FEATURE_FSRM,
+    CPU_FEATURE_INVARIANT_TSC,
+    CPU_FEATURE_TSC_DEADLINE,
+    CPU_FEATURE_RDTSCP,
+    CPU_FEATURE_X2APIC,
+    CPU_FEATURE_MONITOR,
+    CPU_FEATURE_PAT,
+    CPU_FEATURE_MTRR,
+    CPU_FEATURE_PAGE_1G,
+    CPU_FEATURE_FSGSBASE,
+    CPU_FEATURE_WAITPKG,
+    CPU_FEATURE_COUNT,
+} CpuFeature;
+
+const char* CPU_FEATURE_NAMES[CPU_FEATURE_COUNT] = {
+    "fxsr", "sse2", "sse3", "ssse3", "sse4.1", "sse4.2", "popcnt", "xsave",
+    "avx", "avx2", "bmi1", "bmi2", "avx512f", "avx512bw", "avx512vl", "erms",
+    "fsrm", "invariant-tsc", "tsc-deadline", "rdtscp", "x2apic", "monitor",
+    "pat", "mtrr", "1g-pages", "fsgsbase", "waitpkg",
+};
+
+typedef struct CpuFeatures
+{
+    u64 bits;
+    u32 max_leaf;
+    u32 max_extended_leaf;
+    u64 xcr0;               // 0 if XSAVE isn't enabled.
+    u32 xsave_size;         // Bytes XSAVE needs for the state enabled in XCR0.
+} CpuFeatures;
+
+
+// Operand of lgdt/sgdt and lidt/sidt.
+typedef struct __attribute__((packed)) DescriptorTablePointer
+{
+    u16 limit;      // Size in bytes, minus one.
+    u64 base;
+} DescriptorTablePointer;
+
+typedef struct CpuidResult
+{
+    u32 eax;
+    u32 ebx;
+    u32 ecx;
+    u32 edx;
+} CpuidResult;
+
+
+static inline CpuidResult cpuid(u32 leaf, u32 subleaf)
+{
+    CpuidResult result;
+    __asm__ __volatile__(
+        "cpuid"
+        : "=a" (result.eax), "=b" (result.ebx), "=c" (result.ecx), "=d" (result.edx)
+        : "a" (leaf), "c" (subleaf)
+    );
+    return result;
+}
+
+static inline u64 read_msr(u32 msr)
+{
+    u32 low, high;
+    __asm__ __volatile__("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((u64) high << 32) | low;
+}
+
+static inline void write_msr(u32 msr, u64 value)
+{
+    __asm__ __volatile__("wrmsr" : : "c" (msr), "a" ((u32) value), "d" ((u32) (value >> 32)) : "memory");
+}
+
+static inline u64 read_cr0()
+{
+    u64 value;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r" (value));
+    return value;
+}
+
+static inline void write_cr0(u64 value)
+{
+    __asm__ __volatile__("mov %0, %%cr0" : : "r" (value) : "memory");
+}
+
+static inline u64 read_cr2()
+{
+    u64 value;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r" (value));
+    return value;
+}
+
+static inline u64 read_cr3()
+{
+    u64 value;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r" (value));
+    return value;
+}
+
+static inline void write_cr3(u64 value)
+{
+    __asm__ __volatile__("mov %0, %%cr3" : : "r" (value) : "memory");
+}
+
+static inline DescriptorTablePointer read_gdtr()
+{
+    DescriptorTablePointer pointer;
+    __asm__ __volatile__("sgdt %0" : "=m" (pointer));
+    return pointer;
+}
+
+static inline DescriptorTablePointer read_idtr()
+{
+    DescriptorTablePointer pointer;
+    __asm__ __volatile__("sidt %0" : "=m" (pointer));
+    return pointer;
+}
+
+static inline u64 read_cr4()
+{
+    u64 value;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r" (value));
+    return value;
+}
+
+static inline void write_cr4(u64 value)
+{
+    __asm__ __volatile__("mov %0, %%cr4" : : "r" (value) : "memory");
+}
+
+static inline void write_back_invalidate()
+{
+    __asm__ __volatile__("wbinvd" : : : "memory");
+}
+
+// Not serializing; good enough for timing things in the millisecond range.
+static inline u64 read_tsc()
+{
+    u32 low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return ((u64) high << 32) | low;
+}
+
+// Only valid once CR4.OSXSAVE is set; check CPUID.1:ECX.OSXSAVE first.
+static inline u64 read_xcr0()
+{
+    u32 low, high;
+    __asm__ __volatile__("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+    return ((u64) high << 32) | low;
+}
+
+static inline void write_xcr0(u64 value)
+{
+    __asm__ __volatile__("xsetbv" : : "c" (0), "a" ((u32) value), "d" ((u32) (value >> 32)) : "memory");
+}
+
+static inline u8 read_port(u16 port)
+{
+    u8 result = 0;
+    __asm__ __volatile__("in %%dx, %%al" : "=a" (result) : "d" (port));
+    return result;
+}
+
+static inline void write_port(u16 port, u8 data)
+{
+    __asm__ __volatile__("out %%al, %%dx" : : "a" (data), "d" (port));
+}
+
+// `rep outsb`; hypervisors handle the whole string in one exit instead of
+// one per byte.
+static inline void write_port_string(u16 port, const u8* data, u64 count)
+{
+    __asm__ __volatile__("rep outsb" : "+S" (data), "+c" (count) : "d" (port) : "memory");
+}
+
+// Disable interrupts and return the previous RFLAGS for `interrupts_restore`.
+static inline u64 interrupts_disable()
+{
+    u64 flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void interrupts_restore(u64 flags)
+{
+    __asm__ __volatile__("push %0; popfq" : : "r" (flags) : "memory", "cc");
+}
+
+static inline void interrupts_enable()
+{
+    __asm__ __volatile__("sti" : : : "memory");
+}
+
+
+// Set once kernel threads can be preempted (threads.c). Until then nothing
+// needs interrupts off around per-CPU data, and the host benchmarks, which
+// can't `cli`, share this code.
+int g_preemption = 0;
+
+// Keep the current thread on this CPU until `preempt_enable`.
+static inline u64 preempt_disable()
+{
+    return g_preemption ? interrupts_disable() : 0;
+}
+
+static inline void preempt_enable(u64 flags)
+{
+    if (flags)      // RFLAGS always has bit 1 set, so 0 means nothing was saved.
+        interrupts_restore(flags);
+}
+
+
+// Test-and-test-and-set lock. Spinning only reads, so waiters don't fight
+// over the cache line until it's released.
+//
+// Once `g_preemption` is set, holding a lock keeps interrupts off. That
+// makes locks safe to take in interrupt handlers, which the scheduler does
+// from the timer interrupt (threads.c), and means a holder is never
+// preempted, so nothing waits out a time slice for a lock. Before that,
+// interrupts are left alone, and no interrupt handler may take a lock.
+typedef struct Spinlock
+{
+    volatile u32 locked;
+    u64          flags;     // From `preempt_disable`, for the holder.
+} Spinlock;
+
+static inline void spin_lock(Spinlock* lock)
+{
+    u64 flags = preempt_disable();
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            __asm__ __volatile__("pause");
+    lock->flags = flags;
+}
+
+static inline void spin_unlock(Spinlock* lock)
+{
+    u64 flags = lock->flags;
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable(flags);
+}
+
+// Arm the monitor on the cache line holding `address`; a write to it ends
+// the next `mwait`.
+static inline void cpu_monitor(const volatile void* address)
+{
+    __asm__ __volatile__("monitor" : : "a" (address), "c" (0), "d" (0) : "memory");
+}
+
+// Enable interrupts and wait in C1 for a write to the monitored line or an
+// interrupt. As with `interrupts_enable_and_halt`, an interrupt can't be
+// taken between the `sti` and the `mwait`; it ends the wait instead.
+static inline void interrupts_enable_and_mwait()
+{
+    __asm__ __volatile__("sti; mwait" : : "a" (0), "c" (0) : "memory");
+}
+
+// Enable interrupts and halt until the next one. `sti` takes effect after
+// the following instruction, so nothing slips in between the two.
+static inline void interrupts_enable_and_halt()
+{
+    __asm__ __volatile__("sti; hlt" : : : "memory");
+}
+
+
+CpuFeatures g_cpu;
+
+
+
+
+static inline int cpu_has(CpuFeature feature)
+{
+    return (g_cpu.bits >> feature) & 1;
+}
+
+static inline void cpu_set(CpuFeature feature, u32 reg, int bit)
+{
+    if ((reg >> bit) & 1)
+        g_cpu.bits |= 1ull << feature;
+}
+
+
+// Fill `g_cpu` from CPUID and the current XCR0. Cheap enough to run again
+// after `cpu_enable_simd` changes what's usable.
+void cpu_features_detect()
+{
+    g_cpu = (CpuFeatures) { 0 };
+    g_cpu.max_leaf          = cpuid(0, 0).eax;
+    g_cpu.max_extended_leaf = cpuid(0x80000000, 0).eax;
+
+    CpuidResult leaf1 = cpuid(1, 0);
+    cpu_set(CPU_FEATURE_FXSR,         leaf1.edx, 24);
+    cpu_set(CPU_FEATURE_SSE2,         leaf1.edx, 26);
+    cpu_set(CPU_FEATURE_PAT,          leaf1.edx, 16);
+    cpu_set(CPU_FEATURE_MTRR,         leaf1.edx, 12);
+    cpu_set(CPU_FEATURE_SSE3,         leaf1.ecx, 0);
+    cpu_set(CPU_FEATURE_MONITOR,      leaf1.ecx, 3);
+    cpu_set(CPU_FEATURE_SSSE3,        leaf1.ecx, 9);
+    cpu_set(CPU_FEATURE_SSE4_1,       leaf1.ecx, 19);
+    cpu_set(CPU_FEATURE_SSE4_2,       leaf1.ecx, 20);
+    cpu_set(CPU_FEATURE_X2APIC,       leaf1.ecx, 21);
+    cpu_set(CPU_FEATURE_POPCNT,       leaf1.ecx, 23);
+    cpu_set(CPU_FEATURE_TSC_DEADLINE, leaf1.ecx, 24);
+    cpu_set(CPU_FEATURE_XSAVE,        leaf1.ecx, 26);
+
+    // AVX state is only usable once the OS has enabled it in XCR0.
+    int osxsave = (leaf1.ecx >> 27) & 1;
+    if (osxsave)
+        g_cpu.xcr0 = read_xcr0();
+    int avx_state    = (g_cpu.xcr0 & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX);
+    int avx512_state = avx_state && (g_cpu.xcr0 & XCR0_AVX512) == XCR0_AVX512;
+    if (avx_state)
+        cpu_set(CPU_FEATURE_AVX, leaf1.ecx, 28);
+    if (osxsave && g_cpu.max_leaf >= 0xD)
+        g_cpu.xsave_size = cpuid(0xD, 0).ebx;
+
+    if (g_cpu.max_leaf >= 7)
+    {
+        CpuidResult leaf7 = cpuid(7, 0);
+        cpu_set(CPU_FEATURE_FSGSBASE, leaf7.ebx, 0);
+        cpu_set(CPU_FEATURE_BMI1,     leaf7.ebx, 3);
+        cpu_set(CPU_FEATURE_BMI2,     leaf7.ebx, 8);
+        cpu_set(CPU_FEATURE_ERMS,     leaf7.ebx, 9);
+        cpu_set(CPU_FEATURE_WAITPKG,  leaf7.ecx, 5);
+        cpu_set(CPU_FEATURE_FSRM,     leaf7.edx, 4);
+        if (avx_state)
+            cpu_set(CPU_FEATURE_AVX2, leaf7.ebx, 5);
+        if (avx512_state)
+        {
+            cpu_set(CPU_FEATURE_AVX512F,  leaf7.ebx, 16);
+            cpu_set(CPU_FEATURE_AVX512BW, leaf7.ebx, 30);
+            cpu_set(CPU_FEATURE_AVX512VL, leaf7.ebx, 31);
+        }
+    }
+
+    if (g_cpu.max_extended_leaf >= 0x80000001)
+    {
+        CpuidResult extended = cpuid(0x80000001, 0);
+        cpu_set(CPU_FEATURE_PAGE_1G, extended.edx, 26);
+        cpu_set(CPU_FEATURE_RDTSCP,  extended.edx, 27);
+    }
+    if (g_cpu.max_extended_leaf >= 0x80000007)
+        cpu_set(CPU_FEATURE_INVARIANT_TSC, cpuid(0x80000007, 0).edx, 8);
+}
+
+
+// Turn on SSE (FXSAVE and SIMD exceptions) and, with XSAVE, every register
+// state the CPU supports out of x87/SSE/AVX/AVX-512, on this CPU only.
+// Ring 0 only; the bootloader leaves this to the firmware.
+void cpu_enable_simd_state()
+{
+    CpuidResult leaf1 = cpuid(1, 0);
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+
+    u64 cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    int has_xsave = (leaf1.ecx >> 26) & 1;
+    if (has_xsave)
+        cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+
+    if (has_xsave && cpuid(0, 0).eax >= 0xD)
+    {
+        CpuidResult state = cpuid(0xD, 0);
+        u64 supported = ((u64) state.edx << 32) | state.eax;
+
+        u64 xcr0 = XCR0_X87 | XCR0_SSE;
+        if ((leaf1.ecx >> 28) & 1)
+            xcr0 |= supported & XCR0_AVX;
+        if ((xcr0 & XCR0_AVX) && (supported & XCR0_AVX512) == XCR0_AVX512)
+            xcr0 |= XCR0_AVX512;
+        write_xcr0(xcr0);
+    }
+}
+
+// `cpu_enable_simd_state`, then detect again. Once, on the bootstrap
+// processor; the other CPUs only enable the state.
+void cpu_enable_simd()
+{
+    cpu_enable_simd_state();
+    cpu_features_detect();
+}
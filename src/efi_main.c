@@ -6,9 +6,14 @@
 #include "bootloader.h"
 
 #include "elf.h"
+#include "kernel_image.h"
 
+#include "cpu.c"
+#include "log.c"
 #include "format.c"
 #include "memory.c"
+#include "boot_timeline.c"
+#include "lz4.c"
 
 
 // https://github.com/torvalds/linux/blob/5bfc75d92efd494db37f5c4c173d3639d4772966/drivers/firmware/efi/libstub/x86-stub.c
@@ -16,6 +21,7 @@ EFI_SYSTEM_TABLE*      g_SystemTable;
 EFI_BOOT_SERVICES*     g_BootServices;
 EFI_RUNTIME_SERVICES*  g_RuntimeServices;
 Graphics               g_Graphics;
+BootTimeline           g_BootTimeline;
 
 
 
@@ -75,103 +81,211 @@ void EfiPrintString(const CHAR16* string)
     g_SystemTable->ConOut->OutputString(g_SystemTable->ConOut, string);
 }
 
-void EfiPrintChar(CHAR16 character)
+// EfiPrintF renders into this buffer and hands it to the firmware in one
+// OutputString call, or whenever it fills up. Console output is a slow path
+// in most firmware, and it used to be called once per character.
+#define EFI_PRINT_BUFFER_SIZE 256
+
+typedef struct EfiPrintBuffer
 {
-    CHAR16 string[] = { character, L'\0' };
-    g_SystemTable->ConOut->OutputString(g_SystemTable->ConOut, string);
+    CHAR16 data[EFI_PRINT_BUFFER_SIZE + 1];  // Room for the terminator.
+    UINTN  count;
+} EfiPrintBuffer;
+
+#define EFI_PRINT_LEFT  1   // '-': pad on the right.
+#define EFI_PRINT_ZERO  2   // '0': pad numbers with zeros.
+#define EFI_PRINT_ALT   4   // '#': prefix with 0x or 0.
+
+
+void EfiPrintFlush(EfiPrintBuffer* buffer)
+{
+    if (buffer->count == 0)
+        return;
+
+    buffer->data[buffer->count] = L'\0';
+    g_SystemTable->ConOut->OutputString(g_SystemTable->ConOut, buffer->data);
+
+    // Mirror to the log as ASCII. The firmware console wants "\n\r"; the
+    // log backends take plain '\n'.
+    char  text[EFI_PRINT_BUFFER_SIZE];
+    UINTN count = 0;
+    for (UINTN i = 0; i < buffer->count; ++i)
+    {
+        CHAR16 c = buffer->data[i];
+        if (c != L'\r')
+            text[count++] = c < 0x80 ? (char) c : '?';
+    }
+    log_write(text, count);
+
+    buffer->count = 0;
 }
 
+static inline void EfiPrintPut(EfiPrintBuffer* buffer, CHAR16 character)
+{
+    if (buffer->count == EFI_PRINT_BUFFER_SIZE)
+        EfiPrintFlush(buffer);
+    buffer->data[buffer->count++] = character;
+}
+
+static inline void EfiPrintRepeat(EfiPrintBuffer* buffer, CHAR16 character, int count)
+{
+    for (; count > 0; --count)
+        EfiPrintPut(buffer, character);
+}
+
+// Put `prefix` and `count` characters of `text`, padded to `width`. Zero
+// padding goes between the prefix and the text, like printf.
+void EfiPrintField(EfiPrintBuffer* buffer, const CHAR16* prefix, const CHAR16* text, int count, int width, int flags)
+{
+    int prefix_count = 0;
+    while (prefix[prefix_count])
+        ++prefix_count;
+
+    int padding = width - prefix_count - count;
+
+    if (!(flags & (EFI_PRINT_LEFT | EFI_PRINT_ZERO)))
+        EfiPrintRepeat(buffer, L' ', padding);
+    for (int i = 0; i < prefix_count; ++i)
+        EfiPrintPut(buffer, prefix[i]);
+    if ((flags & EFI_PRINT_ZERO) && !(flags & EFI_PRINT_LEFT))
+        EfiPrintRepeat(buffer, L'0', padding);
+    for (int i = 0; i < count; ++i)
+        EfiPrintPut(buffer, text[i]);
+    if (flags & EFI_PRINT_LEFT)
+        EfiPrintRepeat(buffer, L' ', padding);
+}
 
+void EfiPrintNumber(EfiPrintBuffer* buffer, u64 value, int negative, u32 base, int upper, int width, int flags)
+{
+    CHAR16  text[24];
+    CHAR16* end   = text + ARRAY_COUNT(text);
+    CHAR16* begin = end;
+    if (base == 10)
+    {
+        end = text + FormatDecimal16(text, value);
+        begin = text;
+    }
+    else if (base == 16)
+    {
+        end = text + FormatHex16(text, value, 0, !upper);
+        begin = text;
+    }
+    else
+    {
+        do {
+            *--begin = L'0' + value % base;
+            value /= base;
+        } while (value);
+    }
+
+    const CHAR16* prefix = L"";
+    if (negative)
+        prefix = L"-";
+    else if ((flags & EFI_PRINT_ALT) && base == 16)
+        prefix = upper ? L"0X" : L"0x";
+    else if ((flags & EFI_PRINT_ALT) && base == 8 && *begin != L'0')
+        prefix = L"0";
+
+    EfiPrintField(buffer, prefix, begin, (int) (end - begin), width, flags);
+}
+
+
+// A small printf: %[-0#][width][l|ll|z](c|d|i|u|o|x|X|s|%).
+// Without a length modifier integers are 32-bit; 'l', 'll' and 'z' all
+// mean 64-bit (unlike the Microsoft ABI, where long is 32-bit). Strings are
+// CHAR16.
 void EfiPrintF(const CHAR16* format, ...)
 {
     va_list arg;
     va_start(arg, format);
 
+    EfiPrintBuffer buffer;
+    buffer.count = 0;
+
     const CHAR16* character = format;
     while (*character != L'\0')
     {
-//        if (*character == '\t')
-//        {
-//            INT32 x = 0;
-//            INT32 y = 0;
-//            EfiGetCursorPosition(&x, &y);
-//            EfiSetCursorPosition(x + (TAB_SIZE - (x % TAB_SIZE)), y);
-//
-//            character++;
-//        }
         if (*character != L'%')
         {
-            EfiPrintChar(*character);
-            character++;
+            EfiPrintPut(&buffer, *character++);
+            continue;
         }
-        else
+        character++;
+
+        int flags = 0;
+        for (;; character++)
+        {
+            if      (*character == L'-') flags |= EFI_PRINT_LEFT;
+            else if (*character == L'0') flags |= EFI_PRINT_ZERO;
+            else if (*character == L'#') flags |= EFI_PRINT_ALT;
+            else break;
+        }
+
+        int width = 0;
+        for (; *character >= L'0' && *character <= L'9'; character++)
+            width = width * 10 + (*character - L'0');
+
+        int wide = 0;
+        while (*character == L'l' || *character == L'z')
         {
+            wide = 1;
             character++;
-            switch (*character)
+        }
+
+        switch (*character)
+        {
+            case L'c':
             {
-                case L'c':
-                {
-                    CHAR16 i = va_arg(arg, int);  // Fetch char argument
-                    EfiPrintChar(i);
-                    break;
-                }
-                case L'd' :
-                {
-                    int i = va_arg(arg, int);  // Fetch Decimal/Integer argument
-                    if (i < 0)
-                    {
-                        i = -i;
-                        EfiPrintChar(L'-');
-                    }
-                    EfiPrintString(U64ToString(i, 10).data);
-                    break;
-                }
-                case L'o':
-                {
-//                    i = va_arg(arg,
-//                    unsigned int); //Fetch Octal representation
-//                    puts(convert(i, 8));
-                    break;
-                }
-                case L's':
-                {
-                    CHAR16* s = va_arg(arg, CHAR16*);       //Fetch string
-                    EfiPrintString(s);
-                    break;
-                }
-                case L'x':
-                {
-                    unsigned int i = va_arg(arg, unsigned int); //Fetch Hexadecimal representation
-                    EfiPrintString(ToHexStringTruncated(i).data);
-                    break;
-                }
-                case L'z':  // size_t or ssize_t
-                {
-                    character++;
-                    if (*character == L'u')
-                    {
-                        usize x = va_arg(arg, usize);
-                        EfiPrintString(U64ToString(x, 10).data);
-                        break;
-                    }
-                    else
-                    {
-//                        EFI_ASSERT(EFI_ERROR);
-                        return;
-                    }
-                }
-                default:
-                {
-//                    EFI_ASSERT(EFI_ERROR);
-                    return;
-                }
+                CHAR16 c = (CHAR16) va_arg(arg, int);
+                EfiPrintField(&buffer, L"", &c, 1, width, flags & EFI_PRINT_LEFT);
+                break;
+            }
+            case L'd':
+            case L'i':
+            {
+                i64 i = wide ? va_arg(arg, i64) : va_arg(arg, int);
+                u64 magnitude = i < 0 ? (u64) 0 - (u64) i : (u64) i;
+                EfiPrintNumber(&buffer, magnitude, i < 0, 10, 0, width, flags);
+                break;
+            }
+            case L'u':
+            case L'o':
+            case L'x':
+            case L'X':
+            {
+                u64 u = wide ? va_arg(arg, u64) : va_arg(arg, unsigned int);
+                u32 base = *character == L'u' ? 10 : *character == L'o' ? 8 : 16;
+                EfiPrintNumber(&buffer, u, 0, base, *character == L'X', width, flags);
+                break;
+            }
+            case L's':
+            {
+                const CHAR16* s = va_arg(arg, const CHAR16*);
+                if (!s)
+                    s = L"(null)";
+                int count = 0;
+                while (s[count])
+                    ++count;
+                EfiPrintField(&buffer, L"", s, count, width, flags & EFI_PRINT_LEFT);
+                break;
+            }
+            case L'%':
+            {
+                EfiPrintPut(&buffer, L'%');
+                break;
+            }
+            default:
+            {
+                // Unknown specifier; stop rather than misread the arguments.
+                EfiPrintFlush(&buffer);
+                va_end(arg);
+                return;
             }
-            character++;
         }
-
+        character++;
     }
 
-    //Module 3: Closing argument list to necessary clean-up
+    EfiPrintFlush(&buffer);
     va_end(arg);
 }
 
@@ -290,8 +404,8 @@ EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* EfiInitializeFileSystem(EFI_HANDLE ImageHandle)
         (void **) &Volume
     ));
 
-    EfiPrintF(L"Image loaded at: %x\n\r", (usize) LoadedImage->ImageBase);
-    EfiPrintF(L"Image size:      %x\n\r", (usize) LoadedImage->ImageSize);
+    EfiPrintF(L"Image loaded at: %#lx\n\r", (u64) LoadedImage->ImageBase);
+    EfiPrintF(L"Image size:      %#lx\n\r", (u64) LoadedImage->ImageSize);
 
     return Volume;
 }
@@ -364,6 +478,18 @@ void EfiInitGraphics()
     g_Graphics.width  = GraphicsOutput->Mode->Info->HorizontalResolution;
     g_Graphics.height = GraphicsOutput->Mode->Info->VerticalResolution;
     g_Graphics.pixels_per_scanline = GraphicsOutput->Mode->Info->PixelsPerScanLine;
+
+    // The kernel never reads from VRAM (it's very slow), so it gets a RAM copy
+    // of the framebuffer to draw into and streams the changes out itself.
+    UINTN BackBufferSize = (UINTN) g_Graphics.pixels_per_scanline * g_Graphics.height * sizeof(Pixel);
+    EFI_PHYSICAL_ADDRESS BackBuffer = 0;
+    EFI_ASSERT(g_BootServices->AllocatePages(
+        AllocateAnyPages,
+        KERNEL_MEMORY_TYPE,
+        (BackBufferSize + 4095) / 4096,
+        &BackBuffer
+    ));
+    g_Graphics.back_buffer = (Pixel *) BackBuffer;
 }
 
 
@@ -458,15 +584,15 @@ void EfiPrintMemoryMap(UINTN MemoryMapSize, EFI_MEMORY_DESCRIPTOR* MemoryMap, UI
 
         if (i % 2 == 0)
         {
-            EfiPrintF(L"%s - %zu\t - ", EFI_MEMORY_TYPE_STRINGS[desc->Type], kb);
+            EfiPrintF(L"%-26s %8zu KiB   ", EFI_MEMORY_TYPE_STRINGS[desc->Type], kb);
         }
         else
         {
-            EfiPrintF(L"%s - %zu\n\r", EFI_MEMORY_TYPE_STRINGS[desc->Type], kb);
+            EfiPrintF(L"%-26s %8zu KiB\n\r", EFI_MEMORY_TYPE_STRINGS[desc->Type], kb);
         }
     }
 
-    EfiPrintF(L"Total memory: %zu\n\r", TotalRam);
+    EfiPrintF(L"Total memory: %zu KiB\n\r", TotalRam);
 }
 
 
@@ -544,7 +670,7 @@ PSF1_Font EfiLoadFont(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume)
 
         EFI_ASSERT(File->SetPosition(File, sizeof(PSF1_Header)));
         EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, size, (void**)&font.glyphs));
-        EfiPrintF(L"Size: %d\n\r", size);
+        EfiPrintF(L"Size: %zu\n\r", size);
         EFI_ASSERT(File->Read(File, &size, font.glyphs));
 
         EfiPrintF(L"Font Loaded!\n\r");
@@ -554,103 +680,446 @@ PSF1_Font EfiLoadFont(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume)
 }
 
 
-int EfiLoadElf(EFI_HANDLE ImageHandle, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume, u8* data)
+// Read `size` bytes at `offset` straight into `destination`.
+void EfiReadAt(EFI_FILE_PROTOCOL* File, UINT64 offset, void* destination, UINTN size)
 {
-    PSF1_Font font = EfiLoadFont(Volume);
+    UINTN read = size;
+    EFI_ASSERT(File->SetPosition(File, offset));
+    EFI_ASSERT(File->Read(File, &read, destination));
+    EFI_ASSERT(read == size ? EFI_SUCCESS : EFI_END_OF_FILE);
+}
 
-    if (!is_elf64(data))
-        return ELF_ERROR;
 
-    const Elf64Header*        header   = (Elf64Header*) data;
-    const Elf64ProgramHeader* programs = (Elf64ProgramHeader*) (data + header->program_header_offset);
-//    const Elf64SectionHeader* section  = (Elf64SectionHeader*) (data + header->section_header_offset);
+UINT64 EfiFileSize(EFI_FILE_PROTOCOL* File)
+{
+    // EFI_FILE_INFO ends in the file name, so ask how big it is first.
+    UINTN size = 0;
+    EFI_STATUS status = File->GetInfo(File, &EFI_FILE_INFO_GUID, &size, NULL);
+    EFI_ASSERT(status == EFI_BUFFER_TOO_SMALL ? EFI_SUCCESS : status);
+
+    EFI_FILE_INFO* info = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, size, (void **) &info));
+    EFI_ASSERT(File->GetInfo(File, &EFI_FILE_INFO_GUID, &size, info));
+
+    UINT64 file_size = info->FileSize;
+    EFI_ASSERT(g_BootServices->FreePool(info));
+    return file_size;
+}
+
 
-    // https://wiki.osdev.org/ELF
-    for (int i = 0; i < header->program_header_entries; ++i)
+// Where a segment linked at `address` is loaded.
+UINT64 EfiKernelPhysical(UINT64 address)
+{
+    return address >= KERNEL_VIRTUAL_BASE ? address - KERNEL_VIRTUAL_BASE : address;
+}
+
+
+// Allocate the pages for a segment at its address. Segments come sorted by
+// address, but two of them may share a page, so only what the previous one
+// didn't already cover is allocated; `allocated_end` tracks that.
+void EfiAllocateSegment(UINT64 address, UINT64 size, EFI_PHYSICAL_ADDRESS* allocated_end)
+{
+    EFI_PHYSICAL_ADDRESS begin = address & ~0xFFFull;
+    EFI_PHYSICAL_ADDRESS end   = (address + size + 0xFFF) & ~0xFFFull;
+    if (begin < *allocated_end)
+        begin = *allocated_end;
+
+    if (begin < end)
     {
-        const Elf64ProgramHeader* program = &programs[i];
+        EFI_PHYSICAL_ADDRESS pages = begin;
+        EFI_ASSERT(g_BootServices->AllocatePages(AllocateAddress, KERNEL_MEMORY_TYPE, (end - begin) / 0x1000, &pages));
+        *allocated_end = end;
+    }
+}
 
-        if (program->type == PT_LOAD)
-        {
-            // Allocate `size` virtual memory at `address` and copy from
-            // source to destination.
-            // If the file_size and memory_size members differ,
-            // the segment is padded with zeros.
 
-            uint64_t destination = program->virtual_address;
-            uint64_t dest_size   = program->memory_size;
+typedef __attribute__((sysv_abi)) int (*elf_main_fn)(Context*);
+
+// Call the kernel on its own stack. The firmware's stack is boot services
+// memory, which the kernel wants to reclaim.
+int EfiCallKernel(elf_main_fn entry_point, Context* context, u8* stack_top)
+{
+    int result;
+    __asm__ __volatile__(
+        "mov %%rsp, %%rbx\n\t"
+        "mov %[stack], %%rsp\n\t"
+        "call *%[entry]\n\t"
+        "mov %%rbx, %%rsp\n\t"
+        : "=a" (result), "+D" (context)
+        : [stack] "r" (stack_top), [entry] "r" (entry_point)
+        // Everything a System V function may clobber that we must preserve
+        // under the Microsoft ABI, plus rbx for the old stack pointer.
+        : "rbx", "rcx", "rdx", "rsi", "r8", "r9", "r10", "r11", "memory", "cc",
+          "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"
+    );
+    return result;
+}
 
-            const uint8_t* source = data + program->file_offset;
-            uint64_t source_size  = program->file_size;
 
-            EfiPrintF(L"Sizes %d to %d\r\n", (u64)dest_size, source_size);
-            EFI_ASSERT(dest_size >= source_size ? EFI_SUCCESS : EFI_ERROR);
+// Page tables for entering a higher-half kernel: the firmware's PML4 with
+// the first GiB of physical memory added at KERNEL_VIRTUAL_BASE, in 2 MiB
+// pages. Allocated while boot services are still up, filled in after.
+typedef struct EfiKernelTables
+{
+    UINT64* pml4;
+    UINT64* pdpt;
+    UINT64* pd;
+} EfiKernelTables;
 
-            EfiPrintF(L"Mapping %x to %x\r\n", (u64)source, destination);
-            memcpy((void *)destination, source, source_size);
-            EfiPrintF(L"Done!\r\n");
-        }
+EfiKernelTables EfiAllocateKernelTables()
+{
+    EFI_PHYSICAL_ADDRESS pages = 0;
+    EFI_ASSERT(g_BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, 3, &pages));
+    memset((void *) pages, 0, 3 * 4096);
+
+    return (EfiKernelTables) {
+        .pml4 = (UINT64 *) pages,
+        .pdpt = (UINT64 *) (pages + 4096),
+        .pd   = (UINT64 *) (pages + 2 * 4096),
+    };
+}
+
+// Only after ExitBootServices; the firmware may still change its tables
+// until then. The kernel builds its own and drops these (see paging.c).
+void EfiEnterKernelTables(EfiKernelTables tables)
+{
+    const UINT64 present_writable = 0x3;
+    const UINT64 large            = 0x80;
+
+    memcpy(tables.pml4, (void *) (read_cr3() & 0x000FFFFFFFFFF000ull), 4096);
+    for (UINT64 i = 0; i < 512; ++i)
+        tables.pd[i] = (i << 21) | present_writable | large;
+    tables.pdpt[(KERNEL_VIRTUAL_BASE >> 30) & 511] = (UINT64) tables.pd   | present_writable;
+    tables.pml4[(KERNEL_VIRTUAL_BASE >> 39) & 511] = (UINT64) tables.pdpt | present_writable;
+
+    write_cr3((UINT64) tables.pml4);
+}
+
+
+int EfiGuidEqual(const EFI_GUID* a, const EFI_GUID* b)
+{
+    const u8* x = (const u8 *) a;
+    const u8* y = (const u8 *) b;
+    for (UINTN i = 0; i < sizeof(EFI_GUID); ++i)
+        if (x[i] != y[i])
+            return 0;
+    return 1;
+}
+
+// The ACPI root pointer from the configuration table, preferring the
+// ACPI 2.0 one (it has the 64-bit XSDT). 0 if there's neither.
+UINT64 EfiFindRsdp()
+{
+    UINT64 rsdp = 0;
+    for (UINTN i = 0; i < g_SystemTable->NumberOfTableEntries; ++i)
+    {
+        const EFI_CONFIGURATION_TABLE* table = &g_SystemTable->ConfigurationTable[i];
+        if (EfiGuidEqual(&table->VendorGuid, &EFI_ACPI_20_TABLE_GUID))
+            return (UINT64) table->VendorTable;
+        if (EfiGuidEqual(&table->VendorGuid, &ACPI_TABLE_GUID))
+            rsdp = (UINT64) table->VendorTable;
     }
+    return rsdp;
+}
 
-    EfiPrintF(L"Entry point: %x\r\n", header->entry_point);
 
-    typedef __attribute__((sysv_abi)) int (*elf_main_fn)(Context*);
+// Leave the firmware behind and jump to the kernel.
+int EfiStartKernel(EFI_HANDLE ImageHandle, UINT64 entry, PSF1_Font font)
+{
+    EfiPrintF(L"Entry point: %#lx\r\n", entry);
 
-    void* entry_point_address = (void *) header->entry_point;
+    void* entry_point_address = (void *) entry;
     elf_main_fn entry_point = (elf_main_fn) entry_point_address;
 
+    EFI_PHYSICAL_ADDRESS stack = 0;
+    EFI_ASSERT(g_BootServices->AllocatePages(AllocateAnyPages, KERNEL_MEMORY_TYPE, KERNEL_STACK_SIZE / 4096, &stack));
+
+    UINT64 rsdp = EfiFindRsdp();
+
+    int higher_half = entry >= KERNEL_VIRTUAL_BASE;
+    EfiKernelTables tables = { 0 };
+    if (higher_half)
+        tables = EfiAllocateKernelTables();
+
     Memory memory = EfiExitBootServices(ImageHandle);
+    boot_timeline_mark(&g_BootTimeline, "exit boot services");
+
+    if (higher_half)
+        EfiEnterKernelTables(tables);
+
     Context context = {
         .memory=memory,
         .graphics=g_Graphics,
         .services=g_RuntimeServices,
         .font=font,
+        .timeline=g_BootTimeline,
+        .rsdp=rsdp,
     };
 
-    int result = entry_point(&context);
-    return result;
+    return EfiCallKernel(entry_point, &context, (u8 *) stack + KERNEL_STACK_SIZE);
+}
+
+
+// Load the PT_LOAD segments of the ELF file directly from disk. Only the
+// headers are read into a buffer; every segment is read straight into pages
+// allocated at its virtual address, and only the part past `file_size`
+// (.bss) is zeroed.
+int EfiLoadElf(EFI_HANDLE ImageHandle, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume, EFI_FILE_PROTOCOL* File, UINT64 file_size)
+{
+    PSF1_Font font = EfiLoadFont(Volume);
+    boot_timeline_mark(&g_BootTimeline, "font");
+
+    Elf64Header header;
+    if (file_size < sizeof(header))
+        return ELF_ERROR;
+    EfiReadAt(File, 0, &header, sizeof(header));
+
+    if (is_elf64((const u8 *) &header) != ELF_YES)
+        return ELF_ERROR;
+    if (header.program_header_entry_size != sizeof(Elf64ProgramHeader))
+        return ELF_ERROR;
+
+    UINTN programs_size = (UINTN) header.program_header_entries * sizeof(Elf64ProgramHeader);
+    if (header.program_header_offset + programs_size > file_size)
+        return ELF_ERROR;
+
+    Elf64ProgramHeader* programs = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, programs_size, (void **) &programs));
+    EfiReadAt(File, header.program_header_offset, programs, programs_size);
+
+    EFI_PHYSICAL_ADDRESS allocated_end = 0;
+
+    // https://wiki.osdev.org/ELF
+    for (int i = 0; i < header.program_header_entries; ++i)
+    {
+        const Elf64ProgramHeader* program = &programs[i];
+        if (program->type != PT_LOAD || program->memory_size == 0)
+            continue;
+
+        EFI_ASSERT(program->memory_size >= program->file_size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+        EFI_ASSERT(program->file_offset + program->file_size <= file_size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+
+        UINT64 physical = EfiKernelPhysical(program->virtual_address);
+        EfiAllocateSegment(physical, program->memory_size, &allocated_end);
+
+        u8* destination = (u8 *) physical;
+        EfiPrintF(L"Loading %lu bytes (%lu in memory) to %#lx\r\n", program->file_size, program->memory_size, physical);
+
+        if (program->file_size)
+            EfiReadAt(File, program->file_offset, destination, program->file_size);
+        if (program->memory_size > program->file_size)
+            memset(destination + program->file_size, 0, program->memory_size - program->file_size);
+    }
+
+    EFI_ASSERT(g_BootServices->FreePool(programs));
+    EFI_ASSERT(File->Close(File));
+    boot_timeline_mark(&g_BootTimeline, "kernel load");
+
+    return EfiStartKernel(ImageHandle, header.entry_point, font);
+}
+
+
+// Sequential reader over part of a file. Reads are done in big chunks and
+// handed out in pieces, so the number of (slow) firmware calls depends on
+// the size of the data and not on how many blocks it's cut into.
+typedef struct EfiReader
+{
+    EFI_FILE_PROTOCOL* File;
+    u8*                buffer;
+    UINTN              capacity;
+    UINTN              begin;
+    UINTN              end;
+    UINT64             remaining;   // Bytes not yet read from the file.
+} EfiReader;
+
+// Return the next `size` bytes, or NULL if the file ends before that.
+// `size` must not exceed the reader's capacity.
+const u8* EfiReaderTake(EfiReader* reader, UINTN size)
+{
+    if (reader->end - reader->begin < size)
+    {
+        UINTN kept = reader->end - reader->begin;
+        memmove(reader->buffer, reader->buffer + reader->begin, kept);
+        reader->begin = 0;
+        reader->end   = kept;
+
+        UINTN wanted = reader->capacity - kept;
+        if (wanted > reader->remaining)
+            wanted = reader->remaining;
+
+        EFI_ASSERT(reader->File->Read(reader->File, &wanted, reader->buffer + kept));
+        reader->end       += wanted;
+        reader->remaining -= wanted;
+
+        if (reader->end < size)
+            return NULL;
+    }
+
+    const u8* data = reader->buffer + reader->begin;
+    reader->begin += size;
+    return data;
+}
+
+
+// Load a compressed kernel image (see kernel_image.h). The compressed data
+// is read in large chunks and each block is decompressed straight into its
+// segment, so the only copy is the decompression itself.
+int EfiLoadPackedKernel(EFI_HANDLE ImageHandle, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume, EFI_FILE_PROTOCOL* File, UINT64 file_size)
+{
+    PSF1_Font font = EfiLoadFont(Volume);
+    boot_timeline_mark(&g_BootTimeline, "font");
+
+    KernelImageHeader header;
+    if (file_size < sizeof(header))
+        return -1;
+    EfiReadAt(File, 0, &header, sizeof(header));
+
+    if (header.magic != KERNEL_IMAGE_MAGIC || header.version != KERNEL_IMAGE_VERSION)
+        return -1;
+    if (header.block_size == 0 || header.block_size > KERNEL_IMAGE_BLOCK_SIZE)
+        return -1;
+
+    UINTN segments_size = (UINTN) header.segment_count * sizeof(KernelImageSegment);
+    if (sizeof(header) + segments_size > file_size)
+        return -1;
+
+    KernelImageSegment* segments = NULL;
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, segments_size, (void **) &segments));
+    EfiReadAt(File, sizeof(header), segments, segments_size);
+
+    // Room for several blocks; a block is never stored larger than `block_size`.
+    EfiReader reader = {
+        .File      = File,
+        .capacity  = 4 * (header.block_size + sizeof(u32)),
+        .remaining = file_size - sizeof(header) - segments_size,
+    };
+    EFI_ASSERT(g_BootServices->AllocatePool(EfiLoaderData, reader.capacity, (void **) &reader.buffer));
+
+    EfiPrintF(L"Decompressing %lu bytes of kernel from %lu bytes\r\n", header.uncompressed_size, reader.remaining);
+
+    EFI_PHYSICAL_ADDRESS allocated_end = 0;
+    for (int i = 0; i < header.segment_count; ++i)
+    {
+        const KernelImageSegment* segment = &segments[i];
+        EFI_ASSERT(segment->memory_size >= segment->file_size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+
+        UINT64 physical = EfiKernelPhysical(segment->virtual_address);
+        EfiAllocateSegment(physical, segment->memory_size, &allocated_end);
+
+        u8* destination = (u8 *) physical;
+        for (UINT64 offset = 0; offset < segment->file_size; offset += header.block_size)
+        {
+            UINT64 size = segment->file_size - offset;
+            if (size > header.block_size)
+                size = header.block_size;
+
+            const u8* block_header = EfiReaderTake(&reader, sizeof(u32));
+            EFI_ASSERT(block_header ? EFI_SUCCESS : EFI_END_OF_FILE);
+
+            u32 compressed;
+            memcpy(&compressed, block_header, sizeof(compressed));
+            u32 stored     = compressed & KERNEL_IMAGE_BLOCK_STORED;
+            compressed    &= ~KERNEL_IMAGE_BLOCK_STORED;
+            EFI_ASSERT(compressed <= header.block_size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+
+            const u8* block = EfiReaderTake(&reader, compressed);
+            EFI_ASSERT(block ? EFI_SUCCESS : EFI_END_OF_FILE);
+
+            if (stored)
+            {
+                EFI_ASSERT(compressed == size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+                memcpy(destination + offset, block, size);
+            }
+            else
+            {
+                i64 written = lz4_decompress(block, compressed, destination + offset, size);
+                EFI_ASSERT(written == (i64) size ? EFI_SUCCESS : EFI_LOAD_ERROR);
+            }
+        }
+
+        if (segment->memory_size > segment->file_size)
+            memset(destination + segment->file_size, 0, segment->memory_size - segment->file_size);
+    }
+
+    EFI_ASSERT(g_BootServices->FreePool(reader.buffer));
+    EFI_ASSERT(g_BootServices->FreePool(segments));
+    EFI_ASSERT(File->Close(File));
+    boot_timeline_mark(&g_BootTimeline, "kernel load");
+
+    return EfiStartKernel(ImageHandle, header.entry_point, font);
 }
 
 
 int EfiLoadKernel(EFI_HANDLE ImageHandle, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume)
 {
     EFI_FILE_PROTOCOL* KernelFile = EfiOpenFile(Volume, L"kernel");
-    Array KernelSource = EfiReadFile(KernelFile, 0x10000);
-    if (KernelSource.data)
+    if (!KernelFile)
+        return -1;
+
+    UINT64 size = EfiFileSize(KernelFile);
+    EfiPrintF(L"Kernel size: %lu bytes\n\r", size);
+
+    u32 magic = 0;
+    if (size < sizeof(magic))
+        return -1;
+    EfiReadAt(KernelFile, 0, &magic, sizeof(magic));
+
+    if ((u16) magic == 0x8664)  // X86_64 (COFF?)
     {
+        EfiPrintF(L"Loading x86_64 kernel\n\r");
+        EFI_ASSERT(KernelFile->SetPosition(KernelFile, 0));
+        Array KernelSource = EfiReadFile(KernelFile, size);
         u8* s = KernelSource.data;
-        u16 format = *(u16*)s;
-        if (format == 0x8664)  // X86_64 (COFF?)
-        {
-            EfiPrintF(L"Loading x86_64 kernel\n\r");
-            u16 entry_point = *((u16*) &s[0x24]);
-            Memory memory = EfiExitBootServices(ImageHandle);
-            typedef __attribute__((ms_abi)) int (*KernelMainFn)(EFI_RUNTIME_SERVICES*, Graphics, Memory);
-            u8* KernelMain = &KernelSource.data[entry_point];
-            KernelMainFn kernel_main = (KernelMainFn) KernelMain;
-            int result = kernel_main(g_RuntimeServices, g_Graphics, memory);
-            return result;
-        }
-        else if (*(u32*)s == 0x464C457F)
-        {
-            return EfiLoadElf(ImageHandle, Volume, KernelSource.data);
-        }
-        else
-        {
-            EfiPrintF(L"Error at line %d!\n\r", __LINE__);
-            return -1;
-        }
+        u16 entry_point = *((u16*) &s[0x24]);
+        Memory memory = EfiExitBootServices(ImageHandle);
+        typedef __attribute__((ms_abi)) int (*KernelMainFn)(EFI_RUNTIME_SERVICES*, Graphics, Memory);
+        u8* KernelMain = &KernelSource.data[entry_point];
+        KernelMainFn kernel_main = (KernelMainFn) KernelMain;
+        int result = kernel_main(g_RuntimeServices, g_Graphics, memory);
+        return result;
     }
+    else if (magic == 0x464C457F)
+    {
+        return EfiLoadElf(ImageHandle, Volume, KernelFile, size);
+    }
+    else if (magic == KERNEL_IMAGE_MAGIC)
+    {
+        return EfiLoadPackedKernel(ImageHandle, Volume, KernelFile, size);
+    }
+    else
+    {
+        EfiPrintF(L"Error at line %d!\n\r", __LINE__);
+        return -1;
+    }
+}
+
 
-    return -1;
+// Count TSC ticks across a firmware delay. 10 ms keeps the error well
+// below what the boot phases are reported in.
+u64 EfiMeasureTscHz()
+{
+    u64 begin = read_tsc();
+    EFI_ASSERT(g_BootServices->Stall(10000));
+    u64 end = read_tsc();
+    return (end - begin) * 100;
 }
 
 
 EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 {
+    boot_timeline_mark(&g_BootTimeline, "firmware");
+    cpu_features_detect();
+    memory_init();
+    log_init();
     EfiInit(SystemTable);
+    boot_timeline_mark(&g_BootTimeline, "efi init");
+
+    g_BootTimeline.tsc_hz = EfiMeasureTscHz();
+    boot_timeline_mark(&g_BootTimeline, "tsc calibration");
 
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume = EfiInitializeFileSystem(ImageHandle);
+    boot_timeline_mark(&g_BootTimeline, "file system");
 
     EfiLoadKernel(ImageHandle, Volume);
     EfiHalt();
@@ -89,6 +89,9 @@ struct EFI_GUID EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID    = {0x9042a9de,  0x23dc, 0x4
 struct EFI_GUID EFI_LOADED_IMAGE_PROTOCOL_GUID       = {0x5b1b31a1,  0x9562, 0x11d2, {0x8e, 0x3f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
 struct EFI_GUID EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID = {0x0964e5b22, 0x6459, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
 struct EFI_GUID EFI_DEVICE_PATH_PROTOCOL_GUID        = {0x09576e91,  0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
+struct EFI_GUID EFI_FILE_INFO_GUID                   = {0x09576e92,  0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
+struct EFI_GUID EFI_ACPI_20_TABLE_GUID               = {0x8868e871,  0xe4f1, 0x11d3, {0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81}};
+struct EFI_GUID ACPI_TABLE_GUID                      = {0xeb9d2d30,  0x2d88, 0x11d3, {0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d}};
 
 // We are forward declaring these structs so that the function typedefs can operate.
 struct EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL;
@@ -199,6 +202,9 @@ typedef struct EFI_MEMORY_DESCRIPTOR
     UINT64                   Attribute;
 } EFI_MEMORY_DESCRIPTOR;
 
+// Memory descriptor attribute: the range supports write-back caching.
+#define EFI_MEMORY_WB 0x0000000000000008ull
+
 // UEFI 2.9 Specs PDF Page 181
 typedef enum EFI_INTERFACE_TYPE
 {
@@ -456,6 +462,9 @@ typedef EFI_STATUS (*EFI_FILE_READ)(struct EFI_FILE_PROTOCOL* This, UINTN *Buffe
 typedef EFI_STATUS (*EFI_FILE_WRITE)(struct EFI_FILE_PROTOCOL* This, UINTN *BufferSize, void *Buffer);
 typedef EFI_STATUS (*EFI_FILE_GET_POSITION)(struct EFI_FILE_PROTOCOL* This, UINT64 *Position);
 typedef EFI_STATUS (*EFI_FILE_SET_POSITION)(struct EFI_FILE_PROTOCOL* This, UINT64 Position);
+typedef EFI_STATUS (*EFI_FILE_GET_INFO)(struct EFI_FILE_PROTOCOL* This, EFI_GUID *InformationType, UINTN *BufferSize, void *Buffer);
+typedef EFI_STATUS (*EFI_FILE_SET_INFO)(struct EFI_FILE_PROTOCOL* This, EFI_GUID *InformationType, UINTN BufferSize, void *Buffer);
+typedef EFI_STATUS (*EFI_FILE_FLUSH)(struct EFI_FILE_PROTOCOL* This);
 
 // UEFI 2.9 Specs PDF Page 512
 typedef struct EFI_FILE_PROTOCOL
@@ -468,8 +477,26 @@ typedef struct EFI_FILE_PROTOCOL
     EFI_FILE_WRITE          Write;
     EFI_FILE_GET_POSITION   GetPosition;
     EFI_FILE_SET_POSITION   SetPosition;
+    EFI_FILE_GET_INFO       GetInfo;
+    EFI_FILE_SET_INFO       SetInfo;
+    EFI_FILE_FLUSH          Flush;
 } EFI_FILE_PROTOCOL;
 
+// Returned by `GetInfo` with EFI_FILE_INFO_GUID. `FileName` is a
+// null-terminated string of variable length, so `Size` is the real size.
+// UEFI 2.9 Specs PDF Page 526
+typedef struct EFI_FILE_INFO
+{
+    UINT64      Size;
+    UINT64      FileSize;
+    UINT64      PhysicalSize;
+    EFI_TIME    CreateTime;
+    EFI_TIME    LastAccessTime;
+    EFI_TIME    ModificationTime;
+    UINT64      Attribute;
+    CHAR16      FileName[];
+} EFI_FILE_INFO;
+
 typedef EFI_STATUS (*EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_OPEN_VOLUME)(struct EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* This, EFI_FILE_PROTOCOL **Root);
 
 // UEFI 2.9 Specs PDF Page 510
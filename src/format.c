@@ -1,3 +1,11 @@
+// Integer to text conversion.
+//
+// The core is generated for both `char` (the kernel) and `char16` (UEFI)
+// from format_template.c: FormatDecimal8/16 and FormatHex8/16 write into a
+// caller's buffer. Decimal takes two digits per division from a lookup
+// table and sizes the output up front, so there's no reversal pass; hex is
+// one nibble table lookup per digit. The older struct-returning functions
+// below are built on top of it.
 #include "types.h"
 
 enum Error
@@ -11,66 +19,79 @@ typedef struct HexString {
 } HexString;
 
 typedef struct IntString {
-    char16 data[20];
+    char16 data[65];  // Enough for base 2.
 } IntString;
 
 
-HexString ToHexString(size_t data)
+#define FORMAT_DIGIT_ROW(x) x"0" x"1" x"2" x"3" x"4" x"5" x"6" x"7" x"8" x"9"
+
+// "00", "01", ..., "99" back to back.
+static const char FORMAT_DIGIT_PAIRS[201] =
+    FORMAT_DIGIT_ROW("0") FORMAT_DIGIT_ROW("1") FORMAT_DIGIT_ROW("2") FORMAT_DIGIT_ROW("3") FORMAT_DIGIT_ROW("4")
+    FORMAT_DIGIT_ROW("5") FORMAT_DIGIT_ROW("6") FORMAT_DIGIT_ROW("7") FORMAT_DIGIT_ROW("8") FORMAT_DIGIT_ROW("9");
+
+static const char FORMAT_HEX_UPPER[17] = "0123456789ABCDEF";
+static const char FORMAT_HEX_LOWER[17] = "0123456789abcdef";
+
+// FORMAT_POWERS_OF_10[i] = 10^i, except [0], which is 0 so that zero counts
+// as one digit.
+static const u64 FORMAT_POWERS_OF_10[20] = {
+    0ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull,
+};
+
+
+// log10 from the bit length (1233/4096 ~ log10(2)), then one comparison to
+// correct it.
+static inline usize FormatDecimalDigits(u64 value)
 {
-    HexString string = {};
-    string.data[0] = L'0';
-    string.data[1] = L'x';
+    usize guess = ((64 - __builtin_clzll(value | 1)) * 1233) >> 12;
+    return guess - (value < FORMAT_POWERS_OF_10[guess]) + 1;
+}
 
-    u8 x[] = { 56, 48, 40, 32, 24, 16, 8, 0 };
-    for (usize i = 0; i < ARRAY_COUNT(x); ++i)
-    {
-        uintn shift = x[i];
-        u64   mask  = 0xFF;
+static inline usize FormatHexDigits(u64 value)
+{
+    return (64 - __builtin_clzll(value | 1) + 3) / 4;
+}
 
-        u8 a = (data & (mask << shift)) >> shift;
-        string.data[2 + 2*i] = (a / 16 >= 10) ? L'A' + (a / 16) - 10: L'0' + (a / 16);
-        string.data[3 + 2*i] = (a % 16 >= 10) ? L'A' + (a % 16) - 10: L'0' + (a % 16);
-    }
 
+#define FORMAT_CHAR       char
+#define FORMAT_NAME(name) name##8
+#include "format_template.c"
+#undef FORMAT_CHAR
+#undef FORMAT_NAME
+
+#define FORMAT_CHAR       char16
+#define FORMAT_NAME(name) name##16
+#include "format_template.c"
+#undef FORMAT_CHAR
+#undef FORMAT_NAME
+
+
+HexString ToHexString(size_t data)
+{
+    HexString string;
+    string.data[0] = L'0';
+    string.data[1] = L'x';
+    FormatHex16(string.data + 2, data, 16, 0);
     return string;
 }
 
 
+// Leading zero bytes (not digits) are dropped, so there's always an even
+// number of digits, and 0 becomes just "0x".
 HexString ToHexStringTruncated(size_t data)
 {
-    HexString string = {};
+    HexString string;
     string.data[0] = L'0';
     string.data[1] = L'x';
 
-    uintn index       = 0;
-    int   found_first = 0;
-
-    u8 x[] = { 56, 48, 40, 32, 24, 16, 8, 0 };
-    for (usize i = 0; i < ARRAY_COUNT(x); ++i)
-    {
-        uintn shift = x[i];
-        u64   mask  = 0xFF;
-
-        u8 a = (data & (mask << shift)) >> shift;
-        if (a == 0)
-        {
-            if (found_first)
-            {
-                string.data[2 + 2*index] = L'0';
-                string.data[3 + 2*index] = L'0';
-                ++index;
-            }
-        }
-        else
-        {
-            string.data[2 + 2*index] = (a / 16 >= 10) ? L'A' + (a / 16) - 10: L'0' + (a / 16);
-            string.data[3 + 2*index] = (a % 16 >= 10) ? L'A' + (a % 16) - 10: L'0' + (a % 16);
-            ++index;
-
-            found_first = 1;
-        }
-
-    }
+    if (data)
+        FormatHex16(string.data + 2, data, 2 * ((64 - __builtin_clzll(data) + 7) / 8), 0);
+    else
+        string.data[2] = L'\0';
 
     return string;
 }
@@ -78,7 +99,18 @@ HexString ToHexStringTruncated(size_t data)
 
 IntString U64ToString(usize n, usize base)
 {
-    IntString string = {};
+    IntString string;
+    if (base == 10)
+    {
+        FormatDecimal16(string.data, n);
+        return string;
+    }
+    if (base == 16)
+    {
+        FormatHex16(string.data, n, 0, 0);
+        return string;
+    }
+
     int i = 0;
     while (1)
     {
@@ -0,0 +1,58 @@
+// Integer formatting core, instantiated once per character width by
+// format.c. Expects FORMAT_CHAR (the character type) and FORMAT_NAME(name)
+// (appends the width suffix) to be defined, and the tables from format.c.
+//
+// All functions write straight into the caller's buffer, null-terminate it
+// and return the number of characters written (excluding the terminator).
+#if !defined(FORMAT_CHAR) || !defined(FORMAT_NAME)
+#error "format_template.c is included by format.c only."
+#endif
+
+
+// `out` needs room for 21 characters.
+usize FORMAT_NAME(FormatDecimal)(FORMAT_CHAR* out, u64 value)
+{
+    usize        count  = FormatDecimalDigits(value);
+    FORMAT_CHAR* cursor = out + count;
+    *cursor = 0;
+
+    // Two digits per division.
+    while (value >= 100)
+    {
+        const char* pair = &FORMAT_DIGIT_PAIRS[(value % 100) * 2];
+        value /= 100;
+        *--cursor = (FORMAT_CHAR) pair[1];
+        *--cursor = (FORMAT_CHAR) pair[0];
+    }
+    if (value >= 10)
+    {
+        const char* pair = &FORMAT_DIGIT_PAIRS[value * 2];
+        *--cursor = (FORMAT_CHAR) pair[1];
+        *--cursor = (FORMAT_CHAR) pair[0];
+    }
+    else
+    {
+        *--cursor = (FORMAT_CHAR) ('0' + value);
+    }
+
+    return count;
+}
+
+
+// Hexadecimal without prefix, zero-extended to at least `digits` digits
+// (0 means as few as possible, but at least one). `out` needs room for 17
+// characters.
+usize FORMAT_NAME(FormatHex)(FORMAT_CHAR* out, u64 value, usize digits, int lowercase)
+{
+    const char* table = lowercase ? FORMAT_HEX_LOWER : FORMAT_HEX_UPPER;
+
+    usize count = FormatHexDigits(value);
+    if (count < digits)
+        count = digits;
+
+    for (usize i = count; i > 0; --i, value >>= 4)
+        out[i - 1] = (FORMAT_CHAR) table[value & 0xF];
+    out[count] = 0;
+
+    return count;
+}
@@ -0,0 +1,133 @@
+// Pre-expanded PSF1 glyphs.
+//
+// A PSF1 glyph is always 8 pixels wide, so every glyph row is one of 256 bit
+// patterns. For a given scale and colour pair, each pattern is expanded once
+// into `8 * scale` ready-made pixels. Drawing a character is then one lookup
+// and `scale` row copies per glyph row, with no per-pixel work at all. This
+// covers every glyph of the font in 256 rows instead of storing each glyph
+// at full size (which would be megabytes at scale 3). The rows come from
+// the boot arena, sized for the scale in use.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define GLYPH_ATLAS_MAX_SCALE 8
+#define GLYPH_ATLAS_SLOTS     4   // Colour pairs kept expanded at once.
+
+
+typedef struct GlyphAtlasSlot
+{
+    int   valid;
+    Pixel foreground;
+    Pixel background;
+    Pixel* rows;        // 256 rows of `row_width` pixels.
+} GlyphAtlasSlot;
+
+typedef struct GlyphAtlas
+{
+    PSF1_Font* font;
+    int        scale;
+    int        row_width;   // 8 * scale
+    int        next_victim;
+    int        capacity;    // Row width the slots were allocated for.
+    GlyphAtlasSlot slots[GLYPH_ATLAS_SLOTS];
+} GlyphAtlas;
+
+
+GlyphAtlas g_glyph_atlas;
+
+
+static inline int pixel_equal(Pixel a, Pixel b)
+{
+    return a.blue == b.blue && a.green == b.green && a.red == b.red && a.alpha == b.alpha;
+}
+
+
+static void glyph_atlas_expand(GlyphAtlasSlot* slot, Pixel foreground, Pixel background)
+{
+    int scale = g_glyph_atlas.scale;
+
+    slot->valid      = 1;
+    slot->foreground = foreground;
+    slot->background = background;
+
+    for (int pattern = 0; pattern < 256; ++pattern)
+    {
+        Pixel* row = slot->rows + pattern * g_glyph_atlas.row_width;
+        for (int bit = 0; bit < 8; ++bit)
+            g_pixel_ops.fill_span(row + bit * scale, (pattern & (0x80 >> bit)) ? foreground : background, scale);
+    }
+}
+
+
+// Find (or build) the expanded rows for a colour pair.
+static GlyphAtlasSlot* glyph_atlas_slot(Pixel foreground, Pixel background)
+{
+    for (int i = 0; i < GLYPH_ATLAS_SLOTS; ++i)
+    {
+        GlyphAtlasSlot* slot = &g_glyph_atlas.slots[i];
+        if (slot->valid && pixel_equal(slot->foreground, foreground) && pixel_equal(slot->background, background))
+            return slot;
+    }
+
+    GlyphAtlasSlot* slot = &g_glyph_atlas.slots[g_glyph_atlas.next_victim];
+    g_glyph_atlas.next_victim = (g_glyph_atlas.next_victim + 1) % GLYPH_ATLAS_SLOTS;
+
+    glyph_atlas_expand(slot, foreground, background);
+    return slot;
+}
+
+
+// Rasterize the font at its current scale. Clamps the scale to what the
+// atlas can hold. Returns 0 if the arena is out of memory.
+int glyph_atlas_init(PSF1_Font* font)
+{
+    if (font->scale < 1)                     font->scale = 1;
+    if (font->scale > GLYPH_ATLAS_MAX_SCALE) font->scale = GLYPH_ATLAS_MAX_SCALE;
+
+    g_glyph_atlas.font        = font;
+    g_glyph_atlas.scale       = font->scale;
+    g_glyph_atlas.row_width   = 8 * font->scale;
+    g_glyph_atlas.next_victim = 0;
+
+    // Rows for a smaller scale fit in what a larger one left behind.
+    if (g_glyph_atlas.row_width > g_glyph_atlas.capacity)
+    {
+        for (int i = 0; i < GLYPH_ATLAS_SLOTS; ++i)
+        {
+            g_glyph_atlas.slots[i].rows = arena_alloc(256 * g_glyph_atlas.row_width * sizeof(Pixel), 64);
+            if (!g_glyph_atlas.slots[i].rows)
+            {
+                g_glyph_atlas.capacity = 0;
+                return 0;
+            }
+        }
+        g_glyph_atlas.capacity = g_glyph_atlas.row_width;
+    }
+
+    for (int i = 0; i < GLYPH_ATLAS_SLOTS; ++i)
+        g_glyph_atlas.slots[i].valid = 0;
+    return 1;
+}
+
+
+// Draw an opaque glyph into the back buffer with its top-left corner at (x, y).
+// Doesn't mark anything dirty; that's up to the caller.
+void glyph_atlas_draw(int x, int y, u8 character, Pixel foreground, Pixel background)
+{
+    if (!g_glyph_atlas.capacity)
+        return;
+
+    GlyphAtlasSlot* slot   = glyph_atlas_slot(foreground, background);
+    int             height = g_glyph_atlas.font->header.font_height;
+    int             scale  = g_glyph_atlas.scale;
+    u32             width  = g_glyph_atlas.row_width;
+
+    const u8* glyph = g_glyph_atlas.font->glyphs + character * height;
+    for (int row = 0; row < height; ++row)
+    {
+        const Pixel* source = slot->rows + glyph[row] * width;
+        for (int i = 0; i < scale; ++i)
+            g_pixel_ops.copy_span(graphics_row(y++) + x, source, width);
+    }
+}
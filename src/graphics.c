@@ -0,0 +1,149 @@
+// Shadow framebuffer for the kernel.
+//
+// All drawing goes into `Graphics.back_buffer`, which lives in ordinary
+// (cached) RAM. The framebuffer itself is only ever written, never read:
+// reads from VRAM are extremely slow, and the old scroll code did one for
+// every pixel on the screen. Instead, each scanline keeps a dirty span and
+// `graphics_flush` streams only those spans out to `Graphics.base`.
+//
+// The actual pixel work is done by the routines in pixels.c.
+#include "bootloader.h"
+#include "types.h"
+
+
+// 8K UHD. Only bounds the per-scanline dirty tables.
+#define GRAPHICS_MAX_HEIGHT 4320
+
+
+Graphics* g_graphics = NULL;
+
+PixelSurface g_back_surface;    // Graphics.back_buffer
+PixelSurface g_front_surface;   // Graphics.base
+
+// Dirty span of each scanline as [begin, end) in pixels. A clean row has
+// begin >= end. `g_dirty_top`/`g_dirty_bottom` bound the dirty rows so a
+// flush doesn't have to visit the whole table.
+u32 g_dirty_begin[GRAPHICS_MAX_HEIGHT];
+u32 g_dirty_end[GRAPHICS_MAX_HEIGHT];
+u32 g_dirty_top    = 0;
+u32 g_dirty_bottom = 0;
+
+
+static inline Pixel* graphics_row(int y)
+{
+    return g_graphics->back_buffer + (u64) g_graphics->pixels_per_scanline * y;
+}
+
+
+void graphics_mark_dirty(int x, int y, int w, int h)
+{
+    int width  = (int) g_graphics->width;
+    int height = (int) g_graphics->height;
+
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > width)  w = width  - x;
+    if (y + h > height) h = height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    for (int row = y; row < y + h; ++row)
+    {
+        if (g_dirty_begin[row] >= g_dirty_end[row])
+        {
+            g_dirty_begin[row] = x;
+            g_dirty_end[row]   = x + w;
+        }
+        else
+        {
+            if ((u32) x < g_dirty_begin[row])     g_dirty_begin[row] = x;
+            if ((u32) x + w > g_dirty_end[row])   g_dirty_end[row]   = x + w;
+        }
+    }
+
+    if (g_dirty_top >= g_dirty_bottom)
+    {
+        g_dirty_top    = y;
+        g_dirty_bottom = y + h;
+    }
+    else
+    {
+        if ((u32) y < g_dirty_top)         g_dirty_top    = y;
+        if ((u32) y + h > g_dirty_bottom)  g_dirty_bottom = y + h;
+    }
+}
+
+
+void graphics_init(Graphics* graphics)
+{
+    g_graphics = graphics;
+
+    if (g_graphics->height > GRAPHICS_MAX_HEIGHT)
+        g_graphics->height = GRAPHICS_MAX_HEIGHT;
+
+    for (u32 row = 0; row < GRAPHICS_MAX_HEIGHT; ++row)
+    {
+        g_dirty_begin[row] = 0;
+        g_dirty_end[row]   = 0;
+    }
+    g_dirty_top    = 0;
+    g_dirty_bottom = 0;
+
+    g_back_surface = (PixelSurface) {
+        .pixels   = g_graphics->back_buffer,
+        .width    = g_graphics->width,
+        .height   = g_graphics->height,
+        .pitch    = g_graphics->pixels_per_scanline,
+        .uncached = 0,
+    };
+    g_front_surface = g_back_surface;
+    g_front_surface.pixels   = (Pixel *) g_graphics->base;
+    g_front_surface.uncached = 1;
+}
+
+
+void graphics_flush()
+{
+    if (g_dirty_top >= g_dirty_bottom)
+        return;
+
+    for (u32 row = g_dirty_top; row < g_dirty_bottom; ++row)
+    {
+        u32 begin = g_dirty_begin[row];
+        u32 end   = g_dirty_end[row];
+        if (begin >= end)
+            continue;
+
+        // Non-temporal stores bypass the cache and are combined into full
+        // bus writes, so neither side evicts anything useful.
+        g_pixel_ops.stream_copy_span(
+            pixels_at(&g_front_surface, begin, row),
+            pixels_at(&g_back_surface, begin, row),
+            end - begin
+        );
+
+        g_dirty_begin[row] = 0;
+        g_dirty_end[row]   = 0;
+    }
+
+    pixels_fence();
+
+    g_dirty_top    = 0;
+    g_dirty_bottom = 0;
+}
+
+
+void graphics_fill(Pixel pixel)
+{
+    pixels_fill(&g_back_surface, pixel);
+    graphics_mark_dirty(0, 0, g_graphics->width, g_graphics->height);
+}
+
+
+// Move the whole image up by `lines` scanlines and clear what's uncovered at
+// the bottom. Happens entirely in RAM; the next flush rewrites the screen.
+void graphics_scroll(int lines, Pixel background)
+{
+    pixels_scroll(&g_back_surface, lines, background);
+    graphics_mark_dirty(0, 0, g_graphics->width, g_graphics->height);
+}
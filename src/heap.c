@@ -0,0 +1,400 @@
+// Kernel heap: `kmalloc`/`kfree` on top of the page allocator.
+//
+// Requests up to HEAP_MAX_SMALL bytes are rounded up to one of the size
+// classes below and served from slabs: 16 KiB blocks from the page allocator
+// holding a HeapSlab header followed by objects of one class. Free objects
+// are linked through their first word, and a slab is aligned to its size,
+// so `kfree` finds the slab (and with it the class) by masking the pointer.
+// Nothing is stored next to an object.
+//
+// Larger requests get a power-of-two block of pages straight from the page
+// allocator, which remembers its order. The page allocator's tag tells the
+// two kinds apart: the first frame of a slab is tagged HEAP_TAG_SLAB.
+//
+// Each class keeps its slabs with room on a list and one empty slab in
+// reserve, so a class that bounces between empty and one object doesn't hit
+// the page allocator every time. Each class has its own lock, which is
+// never held across a call into the page allocator.
+//
+// In front of the classes, every CPU keeps a small cache of free objects
+// per class: `kmalloc` pops from it and `kfree` pushes onto it, with
+// preemption off and no lock. Only when a cache runs empty or full does a
+// batch of objects move between it and the class, under the class lock.
+// The caches need to know which CPU they're on; smp.c sets
+// `g_heap_cpu_index`, and until then (and on the host) every call goes
+// straight to the classes.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define HEAP_SLAB_ORDER  2
+#define HEAP_SLAB_SIZE   (PAGE_SIZE << HEAP_SLAB_ORDER)
+#define HEAP_MAX_SMALL   2048
+#define HEAP_ALIGNMENT   16
+#define HEAP_TAG_SLAB    0x51AB
+
+#define HEAP_CACHE_SIZE  16     // Objects per CPU and class.
+#define HEAP_CACHE_BATCH 8      // Moved between a cache and its class at once.
+#define HEAP_CACHE_CPUS  64     // CPUs past that go straight to the classes.
+
+// Powers of two and the points halfway between them, so past 32 bytes
+// rounding up never wastes more than a third of an object.
+static const u32 HEAP_CLASS_SIZES[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+#define HEAP_CLASS_COUNT (sizeof(HEAP_CLASS_SIZES) / sizeof(HEAP_CLASS_SIZES[0]))
+
+
+typedef struct HeapSlab
+{
+    struct HeapSlab* next;      // In the class' `partial` list.
+    struct HeapSlab* prev;
+    void* free;                 // Freed objects.
+    u32   bump;                 // Offset of the first object never handed out.
+    u32   used;                 // Objects handed out.
+    u32   size_class;
+    u32   _padding[7];          // Objects start 64-byte aligned.
+} HeapSlab;
+
+typedef struct HeapClass
+{
+    Spinlock  lock              __attribute__((aligned(64)));
+    HeapSlab* partial;          // Slabs with at least one free object.
+    HeapSlab* spare;            // An empty slab kept in reserve.
+    u32       size;
+    u32       capacity;         // Objects per slab.
+    u64       allocations;      // Objects taken out of slabs, into caches included.
+    u64       frees;
+    u64       slabs;            // Slabs currently owned, the spare included.
+} HeapClass;
+
+typedef struct HeapCache
+{
+    u32   count[HEAP_CLASS_COUNT];
+    void* objects[HEAP_CLASS_COUNT][HEAP_CACHE_SIZE];
+    u64   allocations;
+    u64   frees;
+} __attribute__((aligned(64))) HeapCache;
+
+// Updated outside the fast path, with atomics; see `heap_stats` for totals.
+typedef struct HeapStats
+{
+    u64 allocations;            // `kmalloc`/`kfree` calls that bypassed the caches.
+    u64 frees;
+    u64 failures;               // Requests the page allocator couldn't back.
+    u64 small_bytes;            // Bytes taken out of slabs (cached objects included), rounded up to their class.
+    u64 slab_pages;
+    u64 large_allocations;      // Live allocations straight from the page allocator.
+    u64 large_pages;
+} HeapStats;
+
+
+HeapClass g_heap_classes[HEAP_CLASS_COUNT];
+HeapCache g_heap_caches[HEAP_CACHE_CPUS];
+HeapStats g_heap_stats;
+
+// Index of the current CPU, for its cache. Only called with preemption off.
+u32 (*g_heap_cpu_index)() = NULL;
+
+// Size class for each 16-byte step up to HEAP_MAX_SMALL.
+u8 g_heap_class_of[HEAP_MAX_SMALL / HEAP_ALIGNMENT + 1];
+
+
+void heap_init()
+{
+    u32 class = 0;
+    for (u32 step = 0; step < ARRAY_COUNT(g_heap_class_of); ++step)
+    {
+        while (HEAP_CLASS_SIZES[class] < step * HEAP_ALIGNMENT)
+            ++class;
+        g_heap_class_of[step] = (u8) class;
+    }
+
+    for (u32 i = 0; i < HEAP_CLASS_COUNT; ++i)
+    {
+        g_heap_classes[i] = (HeapClass) {
+            .size     = HEAP_CLASS_SIZES[i],
+            .capacity = (u32) ((HEAP_SLAB_SIZE - sizeof(HeapSlab)) / HEAP_CLASS_SIZES[i]),
+        };
+    }
+    memset(g_heap_caches, 0, sizeof(g_heap_caches));
+    g_heap_stats = (HeapStats) { 0 };
+}
+
+
+static void heap_partial_push(HeapClass* class, HeapSlab* slab)
+{
+    slab->prev = NULL;
+    slab->next = class->partial;
+    if (class->partial)
+        class->partial->prev = slab;
+    class->partial = slab;
+}
+
+static void heap_partial_remove(HeapClass* class, HeapSlab* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        class->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+
+// No lock held: this calls into the page allocator.
+static HeapSlab* heap_slab_create(u32 size_class)
+{
+    u64 address = page_alloc_order(HEAP_SLAB_ORDER);
+    if (!address)
+        return NULL;
+    page_set_tag(address, HEAP_TAG_SLAB);
+
+    // Objects are carved out with `bump` as they're needed, so a new slab
+    // is ready without touching anything past its header.
+    HeapSlab* slab   = (HeapSlab *) address;
+    slab->free       = NULL;
+    slab->bump       = sizeof(HeapSlab);
+    slab->used       = 0;
+    slab->size_class = size_class;
+
+    __atomic_add_fetch(&g_heap_stats.slab_pages, 1ull << HEAP_SLAB_ORDER, __ATOMIC_RELAXED);
+    return slab;
+}
+
+// No lock held, and the slab already off its class' books.
+static void heap_slab_destroy(HeapSlab* slab)
+{
+    __atomic_sub_fetch(&g_heap_stats.slab_pages, 1ull << HEAP_SLAB_ORDER, __ATOMIC_RELAXED);
+    page_free((u64) slab);
+}
+
+
+// Take up to `count` objects out of the class' slabs. Returns how many,
+// 0 if the page allocator is out of memory.
+static u32 heap_class_take(u32 size_class, void** objects, u32 count)
+{
+    HeapClass* class = &g_heap_classes[size_class];
+    u32 taken = 0;
+
+    spin_lock(&class->lock);
+    while (taken < count)
+    {
+        HeapSlab* slab = class->partial;
+        if (!slab)
+        {
+            slab = class->spare;
+            class->spare = NULL;
+            if (!slab)
+            {
+                if (taken)
+                    break;      // Enough to go on with.
+
+                spin_unlock(&class->lock);
+                slab = heap_slab_create(size_class);
+                spin_lock(&class->lock);
+                if (!slab)
+                    break;
+                class->slabs += 1;
+            }
+            heap_partial_push(class, slab);
+        }
+
+        void* object = slab->free;
+        if (object)
+        {
+            slab->free = *(void **) object;
+        }
+        else
+        {
+            object = (u8 *) slab + slab->bump;
+            slab->bump += class->size;
+        }
+
+        if (++slab->used == class->capacity)
+            heap_partial_remove(class, slab);
+        objects[taken++] = object;
+    }
+    class->allocations += taken;
+    spin_unlock(&class->lock);
+
+    __atomic_add_fetch(&g_heap_stats.small_bytes, (u64) taken * class->size, __ATOMIC_RELAXED);
+    return taken;
+}
+
+// Put `count` objects (at most HEAP_CACHE_BATCH) back into their slabs.
+static void heap_class_give(u32 size_class, void** objects, u32 count)
+{
+    HeapClass* class = &g_heap_classes[size_class];
+    HeapSlab*  empty[HEAP_CACHE_BATCH];
+    u32        empty_count = 0;
+
+    spin_lock(&class->lock);
+    for (u32 i = 0; i < count; ++i)
+    {
+        void*     object = objects[i];
+        HeapSlab* slab   = (HeapSlab *) ((u64) object & ~(HEAP_SLAB_SIZE - 1));
+
+        *(void **) object = slab->free;
+        slab->free = object;
+
+        if (slab->used-- == class->capacity)
+            heap_partial_push(class, slab);
+
+        if (slab->used == 0)
+        {
+            heap_partial_remove(class, slab);
+            if (class->spare)
+            {
+                empty[empty_count++] = class->spare;
+                class->slabs -= 1;
+            }
+
+            // Start over from the bump pointer, so the objects are handed
+            // out in address order again.
+            slab->free   = NULL;
+            slab->bump   = sizeof(HeapSlab);
+            class->spare = slab;
+        }
+    }
+    class->frees += count;
+    spin_unlock(&class->lock);
+
+    __atomic_sub_fetch(&g_heap_stats.small_bytes, (u64) count * class->size, __ATOMIC_RELAXED);
+    for (u32 i = 0; i < empty_count; ++i)
+        heap_slab_destroy(empty[i]);
+}
+
+
+// This CPU's cache, or NULL. Preemption must be off.
+static inline HeapCache* heap_cache()
+{
+    if (!g_heap_cpu_index)
+        return NULL;
+    u32 index = g_heap_cpu_index();
+    return index < HEAP_CACHE_CPUS ? &g_heap_caches[index] : NULL;
+}
+
+static void* heap_alloc_small(u32 size_class)
+{
+    void* object = NULL;
+
+    u64 flags = preempt_disable();
+    HeapCache* cache = heap_cache();
+    if (cache)
+    {
+        u32* count = &cache->count[size_class];
+        if (*count == 0)
+            *count = heap_class_take(size_class, cache->objects[size_class], HEAP_CACHE_BATCH);
+        if (*count)
+        {
+            object = cache->objects[size_class][--*count];
+            cache->allocations += 1;
+        }
+    }
+    preempt_enable(flags);
+
+    if (!cache && heap_class_take(size_class, &object, 1))
+        __atomic_add_fetch(&g_heap_stats.allocations, 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+static void heap_free_small(HeapSlab* slab, void* object)
+{
+    u32 size_class = slab->size_class;
+
+    u64 flags = preempt_disable();
+    HeapCache* cache = heap_cache();
+    if (cache)
+    {
+        u32* count = &cache->count[size_class];
+        if (*count == HEAP_CACHE_SIZE)
+        {
+            *count -= HEAP_CACHE_BATCH;
+            heap_class_give(size_class, &cache->objects[size_class][*count], HEAP_CACHE_BATCH);
+        }
+        cache->objects[size_class][(*count)++] = object;
+        cache->frees += 1;
+    }
+    preempt_enable(flags);
+
+    if (!cache)
+    {
+        heap_class_give(size_class, &object, 1);
+        __atomic_add_fetch(&g_heap_stats.frees, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+// Allocate `size` bytes, aligned to HEAP_ALIGNMENT (to the page for sizes
+// past HEAP_MAX_SMALL). Returns NULL for 0 bytes or if memory ran out.
+void* kmalloc(u64 size)
+{
+    if (size == 0)
+        return NULL;
+
+    if (size <= HEAP_MAX_SMALL)
+    {
+        void* result = heap_alloc_small(g_heap_class_of[(size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT]);
+        if (!result)
+            __atomic_add_fetch(&g_heap_stats.failures, 1, __ATOMIC_RELAXED);
+        return result;
+    }
+
+    u32 order = 0;
+    while ((PAGE_SIZE << order) < size && order <= PAGE_MAX_ORDER)
+        ++order;
+
+    void* result = (void *) page_alloc_order(order);
+    if (!result)
+    {
+        __atomic_add_fetch(&g_heap_stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_add_fetch(&g_heap_stats.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_heap_stats.large_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_heap_stats.large_pages, 1ull << order, __ATOMIC_RELAXED);
+    return result;
+}
+
+
+void kfree(void* pointer)
+{
+    if (!pointer)
+        return;
+
+    u64 address = (u64) pointer;
+    u64 slab    = address & ~(HEAP_SLAB_SIZE - 1);
+
+    // A slab can't go away while one of its objects is still out, so its
+    // tag is stable here.
+    if (page_tag(slab) == HEAP_TAG_SLAB)
+    {
+        heap_free_small((HeapSlab *) slab, pointer);
+        return;
+    }
+
+    u64 index = page_index(address);
+    if (index >= g_pages.count || g_pages.frames[index].state != PAGE_FRAME_ALLOCATED)
+        return;
+
+    u64 order = g_pages.frames[index].order;
+    __atomic_add_fetch(&g_heap_stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_heap_stats.large_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_heap_stats.large_pages, 1ull << order, __ATOMIC_RELAXED);
+    page_free(address);
+}
+
+
+// The counters with the per-CPU caches' added in. Racy while other CPUs
+// allocate.
+HeapStats heap_stats()
+{
+    HeapStats stats = g_heap_stats;
+    for (u32 i = 0; i < HEAP_CACHE_CPUS; ++i)
+    {
+        stats.allocations += g_heap_caches[i].allocations;
+        stats.frees       += g_heap_caches[i].frees;
+    }
+    return stats;
+}
@@ -0,0 +1,360 @@
+// Descriptor tables and interrupt dispatch.
+//
+// Each CPU gets its own GDT and TSS (CpuTables); the IDT is shared. All 256
+// vectors go through a 16-byte assembly stub that pushes the vector (and a
+// 0 where the CPU doesn't push an error code), then a common entry that
+// saves the general-purpose registers and the FPU/SIMD state and calls
+// `interrupt_dispatch` with an InterruptFrame.
+//
+// The kernel is compiled with SSE, and memcpy/memset use AVX2 when they
+// can, so any C handler may touch vector registers. The common entry saves
+// the whole XSAVE state (FXSAVE without it) around the call. That costs a
+// few hundred cycles per interrupt; skipping it would mean building every
+// handler without SIMD.
+//
+// Vectors 0-31 are CPU exceptions. Unless a handler is registered, an
+// exception is reported on the log and the console and the CPU halts.
+// Vectors from INTERRUPT_FIRST_IRQ up are acknowledged at the local APIC
+// after their handler runs (see apic.c).
+#include "bootloader.h"
+#include "types.h"
+
+
+#define GDT_KERNEL_CODE     0x08
+#define GDT_KERNEL_DATA     0x10
+#define GDT_TSS             0x18
+#define GDT_ENTRIES         5       // Null, code, data, and the TSS (two entries).
+
+#define IDT_INTERRUPT_GATE  0x8E    // Present, ring 0, 64-bit interrupt gate.
+
+#define INTERRUPT_VECTORS   256
+#define INTERRUPT_FIRST_IRQ 32
+
+#define IST_DOUBLE_FAULT    1
+#define IST_NMI             2
+#define IST_MACHINE_CHECK   3
+#define IST_STACK_SIZE      (16 * 1024)
+
+
+typedef struct __attribute__((packed)) Tss
+{
+    u32 _reserved0;
+    u64 rsp[3];
+    u64 _reserved1;
+    u64 ist[7];                     // ist[0] is IST1.
+    u64 _reserved2;
+    u16 _reserved3;
+    u16 io_map_base;
+} Tss;
+
+typedef struct CpuTables
+{
+    u64 gdt[GDT_ENTRIES];
+    Tss tss;
+} CpuTables;
+
+typedef struct __attribute__((packed)) IdtGate
+{
+    u16 offset_low;
+    u16 selector;
+    u8  ist;
+    u8  type;
+    u16 offset_middle;
+    u32 offset_high;
+    u32 _reserved;
+} IdtGate;
+
+// What the stubs leave on the stack, from the lowest address up.
+typedef struct InterruptFrame
+{
+    u64 r15, r14, r13, r12, r11, r10, r9, r8;
+    u64 rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    u64 vector;
+    u64 error_code;                 // 0 for vectors without one.
+    u64 rip, cs, rflags, rsp, ss;   // Pushed by the CPU.
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame* frame, void* user);
+
+typedef struct InterruptEntry
+{
+    InterruptHandler handler;
+    void*            user;
+} InterruptEntry;
+
+
+const char* EXCEPTION_NAMES[INTERRUPT_FIRST_IRQ] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range",
+    "invalid opcode", "device not available", "double fault", "coprocessor overrun",
+    "invalid TSS", "segment not present", "stack fault", "general protection",
+    "page fault", "reserved", "x87 error", "alignment check", "machine check",
+    "SIMD error", "virtualization", "control protection", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved", "hypervisor injection",
+    "VMM communication", "security", "reserved",
+};
+
+
+IdtGate        g_idt[INTERRUPT_VECTORS] __attribute__((aligned(16)));
+InterruptEntry g_interrupt_handlers[INTERRUPT_VECTORS];
+u64            g_interrupt_counts[INTERRUPT_VECTORS];
+CpuTables      g_boot_cpu_tables;
+
+// Read by the common entry: whether to use XSAVE, and how much stack to
+// set aside for the state (alignment slack included).
+u8  g_interrupt_xsave      = 0;
+u64 g_interrupt_state_size = 512 + 64;
+
+// Set by apic.c; called after IRQ handlers.
+void (*g_interrupt_end_of_irq)(u64 vector) = NULL;
+
+// Set by threads.c; called last for IRQs, after the end of interrupt, and
+// may switch to another thread before returning.
+void (*g_interrupt_before_return)(InterruptFrame* frame) = NULL;
+
+extern u8 interrupt_stubs[];
+
+
+__asm__(
+    ".pushsection .text\n"
+
+    // Vectors where the CPU pushes an error code: #DF, #TS, #NP, #SS, #GP,
+    // #PF, #AC, #CP, #VC and #SX.
+    ".balign 16\n"
+    ".global interrupt_stubs\n"
+    "interrupt_stubs:\n"
+    ".set vector, 0\n"
+    ".rept 256\n"
+    "    .balign 16\n"
+    "    .if !(vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30)\n"
+    "        push $0\n"
+    "    .endif\n"
+    "    push $vector\n"
+    "    jmp interrupt_common\n"
+    "    .set vector, vector + 1\n"
+    ".endr\n"
+
+    "interrupt_common:\n"
+    "    push %rax\n"
+    "    push %rbx\n"
+    "    push %rcx\n"
+    "    push %rdx\n"
+    "    push %rsi\n"
+    "    push %rdi\n"
+    "    push %rbp\n"
+    "    push %r8\n"
+    "    push %r9\n"
+    "    push %r10\n"
+    "    push %r11\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    mov %rsp, %rbx\n"
+    "    cld\n"
+
+    // The XSAVE area has to be 64-byte aligned, and XRSTOR faults unless
+    // the reserved part of its header is zero.
+    "    sub g_interrupt_state_size(%rip), %rsp\n"
+    "    and $-64, %rsp\n"
+    "    cmpb $0, g_interrupt_xsave(%rip)\n"
+    "    je 1f\n"
+    "    xor %eax, %eax\n"
+    "    mov %rax, 512(%rsp)\n"
+    "    mov %rax, 520(%rsp)\n"
+    "    mov %rax, 528(%rsp)\n"
+    "    mov %rax, 536(%rsp)\n"
+    "    mov %rax, 544(%rsp)\n"
+    "    mov %rax, 552(%rsp)\n"
+    "    mov %rax, 560(%rsp)\n"
+    "    mov %rax, 568(%rsp)\n"
+    "    mov $-1, %eax\n"
+    "    mov $-1, %edx\n"
+    "    xsave64 (%rsp)\n"
+    "    jmp 2f\n"
+    "1:  fxsave64 (%rsp)\n"
+
+    "2:  mov %rbx, %rdi\n"
+    "    call interrupt_dispatch\n"
+
+    "    cmpb $0, g_interrupt_xsave(%rip)\n"
+    "    je 3f\n"
+    "    mov $-1, %eax\n"
+    "    mov $-1, %edx\n"
+    "    xrstor64 (%rsp)\n"
+    "    jmp 4f\n"
+    "3:  fxrstor64 (%rsp)\n"
+
+    "4:  mov %rbx, %rsp\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %r11\n"
+    "    pop %r10\n"
+    "    pop %r9\n"
+    "    pop %r8\n"
+    "    pop %rbp\n"
+    "    pop %rdi\n"
+    "    pop %rsi\n"
+    "    pop %rdx\n"
+    "    pop %rcx\n"
+    "    pop %rbx\n"
+    "    pop %rax\n"
+    "    add $16, %rsp\n"           // Vector and error code.
+    "    iretq\n"
+
+    ".popsection\n"
+);
+
+
+// Straight to the log port and the console: the log ring may be in the
+// middle of a write from the code that faulted. The console only once it's
+// been set up.
+static void interrupt_report(const char* text)
+{
+    log_string(text);
+    if (g_console.rows)
+        console_write(text);
+}
+
+static void interrupt_report_value(const char* name, u64 value)
+{
+    char text[17];
+    FormatHex8(text, value, 16, 0);
+    text[16] = '\0';
+
+    interrupt_report(name);
+    interrupt_report("0x");
+    interrupt_report(text);
+}
+
+static void interrupt_report_exception(InterruptFrame* frame)
+{
+    interrupt_report("\nException: ");
+    interrupt_report(EXCEPTION_NAMES[frame->vector]);
+    interrupt_report_value("\n  rip ", frame->rip);
+    interrupt_report_value("  error ", frame->error_code);
+    if (frame->vector == 14)
+        interrupt_report_value("  cr2 ", read_cr2());
+    interrupt_report_value("\n  rsp ", frame->rsp);
+    interrupt_report_value("  rbp ", frame->rbp);
+    interrupt_report_value("  rflags ", frame->rflags);
+    interrupt_report("\n");
+    if (g_console.rows)
+        console_present();
+}
+
+
+void interrupt_dispatch(InterruptFrame* frame)
+{
+    u64 vector = frame->vector & (INTERRUPT_VECTORS - 1);
+    g_interrupt_counts[vector] += 1;
+
+    InterruptEntry entry = g_interrupt_handlers[vector];
+    if (entry.handler)
+    {
+        entry.handler(frame, entry.user);
+    }
+    else if (vector < INTERRUPT_FIRST_IRQ)
+    {
+        interrupt_report_exception(frame);
+        for (;;)
+            __asm__ __volatile__("cli; hlt");
+    }
+
+    if (vector >= INTERRUPT_FIRST_IRQ && g_interrupt_end_of_irq)
+        g_interrupt_end_of_irq(vector);
+    if (vector >= INTERRUPT_FIRST_IRQ && g_interrupt_before_return)
+        g_interrupt_before_return(frame);
+}
+
+
+void interrupt_register(u8 vector, InterruptHandler handler, void* user)
+{
+    g_interrupt_handlers[vector] = (InterruptEntry) { .handler=handler, .user=user };
+}
+
+
+// Fill in the IDT. Needs the CPU features, for the FPU state size.
+void idt_init()
+{
+    u64 stubs = (u64) interrupt_stubs;
+    for (u64 vector = 0; vector < INTERRUPT_VECTORS; ++vector)
+    {
+        u64 offset = stubs + vector * 16;
+        g_idt[vector] = (IdtGate) {
+            .offset_low    = (u16) offset,
+            .selector      = GDT_KERNEL_CODE,
+            .ist           = 0,
+            .type          = IDT_INTERRUPT_GATE,
+            .offset_middle = (u16) (offset >> 16),
+            .offset_high   = (u32) (offset >> 32),
+        };
+    }
+    g_idt[2].ist  = IST_NMI;
+    g_idt[8].ist  = IST_DOUBLE_FAULT;
+    g_idt[18].ist = IST_MACHINE_CHECK;
+
+    if (g_cpu.xcr0 && g_cpu.xsave_size)
+    {
+        g_interrupt_xsave      = 1;
+        g_interrupt_state_size = g_cpu.xsave_size + 64;
+    }
+}
+
+
+// Build a CPU's GDT and TSS. The TSS gets its own stacks for the
+// exceptions that can arrive on a broken stack. Returns 0 if the arena is
+// out of memory. Load them on the CPU with `cpu_tables_load`.
+int cpu_tables_init(CpuTables* tables)
+{
+    *tables = (CpuTables) { 0 };
+    tables->tss.io_map_base = sizeof(Tss);
+
+    for (int ist = 1; ist <= IST_MACHINE_CHECK; ++ist)
+    {
+        u8* stack = arena_alloc(IST_STACK_SIZE, 16);
+        if (!stack)
+            return 0;
+        tables->tss.ist[ist - 1] = (u64) stack + IST_STACK_SIZE;
+    }
+
+    u64 tss   = (u64) &tables->tss;
+    u64 limit = sizeof(Tss) - 1;
+    tables->gdt[0] = 0;
+    tables->gdt[1] = 0x00AF9A000000FFFFull;     // 64-bit code, ring 0.
+    tables->gdt[2] = 0x00CF92000000FFFFull;     // Data, ring 0.
+    tables->gdt[3] = (limit & 0xFFFF)
+                   | ((tss & 0xFFFFFF) << 16)
+                   | (0x89ull << 40)            // Present, available 64-bit TSS.
+                   | (((limit >> 16) & 0xF) << 48)
+                   | (((tss >> 24) & 0xFF) << 56);
+    tables->gdt[4] = tss >> 32;
+    return 1;
+}
+
+
+// Load a CPU's GDT and TSS, and the IDT.
+void cpu_tables_load(CpuTables* tables)
+{
+    DescriptorTablePointer gdtr = { .limit=sizeof(tables->gdt) - 1, .base=(u64) tables->gdt };
+    DescriptorTablePointer idtr = { .limit=sizeof(g_idt) - 1,       .base=(u64) g_idt };
+
+    // A far return reloads CS.
+    __asm__ __volatile__(
+        "lgdt %0\n\t"
+        "pushq %1\n\t"
+        "leaq 1f(%%rip), %%rax\n\t"
+        "pushq %%rax\n\t"
+        "lretq\n"
+        "1:\n\t"
+        "mov %2, %%ds\n\t"
+        "mov %2, %%es\n\t"
+        "mov %2, %%ss\n\t"
+        "ltr %w3\n\t"
+        "lidt %4\n\t"
+        :
+        : "m" (gdtr), "i" (GDT_KERNEL_CODE), "r" (GDT_KERNEL_DATA), "r" (GDT_TSS), "m" (idtr)
+        : "rax", "memory"
+    );
+}
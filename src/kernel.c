@@ -1,18 +1,45 @@
 #include "bootloader.h"
 #include "types.h"
 
+#include "cpu.c"
+#include "log.c"
+#include "memory.c"
+#include "arena.c"
+#include "format.c"
+#include "pixels.c"
+#include "graphics.c"
+#include "glyph_atlas.c"
+#include "console.c"
+#include "boot_timeline.c"
+#include "time.c"
+#include "log_ring.c"
+#include "page_allocator.c"
+#include "paging.c"
+#include "write_combining.c"
+#include "boot_reclaim.c"
+#include "heap.c"
+#include "interrupts.c"
+#include "apic.c"
+#include "acpi.c"
+#include "smp.c"
+#include "tasks.c"
+#include "threads.c"
+
 
 
 #define IN
 #define OUT
 #define OPTIONAL
 
+#define KERNEL_TICK_NS 10000000ull     // The APIC timer's period: 100 Hz.
 
-typedef struct Cursor
-{
-    int row;
-    int col;
-} Cursor;
+#define KERNEL_ZERO_BLOCKS 4            // 4 MiB blocks zeroed to exercise the task scheduler.
+#define KERNEL_ZERO_GRAIN  64           // Pages per task.
+
+#define KERNEL_THREADS_PER_CPU 2        // Spinning threads started to exercise the scheduler.
+#define KERNEL_THREADS_MAX     64
+#define KERNEL_THREAD_RUN_NS   50000000ull
+#define KERNEL_THREAD_YIELD_NS 100000ull // How often the yielding half gives up the CPU.
 
 
 typedef struct Window
@@ -28,9 +55,9 @@ typedef struct Font
 } Font;
 
 
-Graphics*  g_graphics = NULL;
-Cursor*    g_cursor   = NULL;
-PSF1_Font* g_font     = NULL;
+PSF1_Font*   g_font   = NULL;
+BootTimeline g_boot_timeline;
+Context      g_context;     // The bootloader's copy lives on its stack.
 
 const Pixel BLACK = { .blue=0x00, .green=0x00, .red=0x00, .alpha=0x00 };
 const Pixel WHITE = { .blue=0xFF, .green=0xFF, .red=0xFF, .alpha=0xFF };
@@ -146,135 +173,128 @@ u8 LETTERS[FONT_LETTER_COUNT][FONT_LETTER_HEIGHT] = {
 
 
 
-inline u8 read_port(u16 port)
+// Kernel output goes through the log ring: `print` only appends, and
+// `print_flush` renders everything appended since to the log port and the
+// console, presenting the console once per flush.
+int g_print_line_start = 1;
+
+
+// "[seconds.microseconds] " since reset, if the TSC rate is known.
+static void print_log_timestamp(u64 tsc)
 {
-    u8 result = 0;
-    __asm__ __volatile__("in %%dx, %%al" : "=a" (result) : "d" (port));
-    return result;
+    u64 hz = g_boot_timeline.tsc_hz;
+    if (!hz)
+        return;
+
+    char  buffer[40];
+    char  micros[21];
+    usize length = 0;
+    usize count  = FormatDecimal8(micros, (tsc % hz) * 1000000 / hz);
+
+    buffer[length++] = '[';
+    length += FormatDecimal8(buffer + length, tsc / hz);
+    buffer[length++] = '.';
+    for (usize i = count; i < 6; ++i)
+        buffer[length++] = '0';
+    for (usize i = 0; i < count; ++i)
+        buffer[length++] = micros[i];
+    buffer[length++] = ']';
+    buffer[length++] = ' ';
+
+    log_write(buffer, length);
 }
 
-inline void write_port(u16 port, u8 data)
+static void print_sink(const LogRecord* record, void* user)
 {
-    __asm__ __volatile__("out %%al, %%dx" : : "a" (data), "d" (port));
-}
+    (void) user;
 
+    u64 begin = 0;
+    for (u64 i = 0; i < record->length; ++i)
+    {
+        console_put(record->text[i]);
+        if (record->text[i] != '\n')
+            continue;
+
+        if (g_print_line_start)
+            print_log_timestamp(record->tsc);
+        log_write(record->text + begin, i + 1 - begin);
+        g_print_line_start = 1;
+        begin = i + 1;
+    }
 
-void delay()
-{
-    u32 volatile x = 1;
-    while (x++ < 10000000);
+    if (begin < record->length)
+    {
+        if (g_print_line_start)
+            print_log_timestamp(record->tsc);
+        log_write(record->text + begin, record->length - begin);
+        g_print_line_start = 0;
+    }
 }
 
-
-inline void draw(Pixel pixel, int row, int col)
+void print_flush()
 {
-    g_graphics->base[g_graphics->pixels_per_scanline * row + col] = pixel;
+    log_ring_drain(print_sink, NULL);
+    console_present();
 }
 
-
-
-
-void print_char(char character)
+void print(const char* source)
 {
-    u8* glyph = g_font->glyphs + (character * g_font->header.font_height);
-    for (int row = 0; row < 16; ++row)
+    u64 length = 0;
+    while (source[length])
+        ++length;
+
+    // Nothing else drains yet, so make room rather than lose output.
+    u64 written = log_ring_write(source, length);
+    while (written < length)
     {
-        for (int col = 0; col < 8; ++col)
-        {
-            if (*glyph & (0x80 /* 0b10000000 */ >> col))
-                for (int i = 0; i < g_font->scale; ++i)
-                    for (int j = 0; j < g_font->scale; ++j)
-                        draw(WHITE, g_cursor->row + row*g_font->scale + i, g_cursor->col + col*g_font->scale + j);
-        }
-        glyph++;
+        print_flush();
+        written += log_ring_write(source + written, length - written);
     }
-//
-//
-//    if (32 <= source && source <= 127)
-//    {
-//        for (int row = 0; row < FONT_LETTER_HEIGHT; ++row)
-//        {
-//            for (int col = 0; col < FONT_LETTER_WIDTH; ++col)
-//            {
-//                char ascii = source;
-//                int  index = ascii - 32;
-//                u8*  glyph = get_glyph(index);
-//                u8   mask  = glyph[FONT_LETTER_HEIGHT-1 - row];
-//                u8   bit   = (1 << (8-col));
-//
-//                if (mask & bit)
-//                {
-//                    for (int i = 0; i < g_font->size; ++i)
-//                        for (int j = 0; j < g_font->size; ++j)
-//                            draw(WHITE, g_cursor->row + row*g_font->size + i, g_cursor->col + col*g_font->size + j);
-//                }
-//            }
-//        }
-//    }
 }
 
 
-void newline()
+void print_u64(u64 value)
 {
-    int row_step = g_font->scale * g_font->header.font_height;
+    char buffer[21];
+    FormatDecimal8(buffer, value);
+    print(buffer);
+}
 
-    int height = (int) g_graphics->height;
-    int width  = (int) g_graphics->width;
 
-    g_cursor->col  = 0;
-    g_cursor->row += row_step;
-    if (g_cursor->row + row_step >= height)
+// Print the boot timeline as one line per phase, in milliseconds.
+void print_boot_timeline(const BootTimeline* timeline)
+{
+    if (!timeline->tsc_hz)
     {
-        int row = 0;
-        for (; row < height-1; row+=row_step)
-        {
-            for (int y = 0; y < row_step; ++y)
-            {
-                int row_above_index   = (row+y)          * width;
-                int row_current_index = (row+y+row_step) * width;
-                for (int col = 0; col < width; ++col)
-                {
-                    g_graphics->base[row_above_index+col] = g_graphics->base[row_current_index+col];
-                }
-            }
-        }
-
-        for (int y = 0; y < height-row; ++y)
-        {
-            int row_current_index = (row+y+row_step) * width;
-            for (int col = 0; col < g_graphics->width; ++col)
-            {
-                g_graphics->base[row_current_index+col] = BLACK;
-            }
-        }
-
-        g_cursor->row -= row_step;
+        print("Boot timeline: TSC frequency unknown\n");
+        return;
     }
-}
 
+    u64 total = 0;
+    print("Boot timeline (TSC at ");
+    print_u64(timeline->tsc_hz / 1000000);
+    print(" MHz):\n");
 
-void print(const char* source)
-{
-    while (*source != '\0')
+    for (u32 i = 0; i < timeline->count; ++i)
     {
-        if (*source == '\n')
-        {
-            newline();
-        }
-        else
-        {
-            print_char(*source);
-
-            int col_step = g_font->scale * (g_font->header.font_height / 2);  // TODO(ted): FIX! Width is hardcoded.
-            g_cursor->col += col_step;
-            if (g_cursor->col + col_step >= g_graphics->width)
-            {
-                newline();
-            }
-        }
-
-        source++;
+        u64 us = boot_timeline_phase_us(timeline, i);
+        total += us;
+
+        print("  ");
+        print(timeline->phases[i].name);
+        print(": ");
+        print_u64(us / 1000);
+        print(".");
+        print_u64(us / 100 % 10);
+        print_u64(us / 10 % 10);
+        print_u64(us % 10);
+        print(" ms\n");
     }
+
+    print("  total since reset: ");
+    print_u64(total / 1000);
+    print(" ms\n");
+    print_flush();
 }
 
 
@@ -291,23 +311,402 @@ void debug_halt()
 
 void fill(Pixel pixel)
 {
-    for (int i = 0; i < g_graphics->size / sizeof(Pixel); ++i)
-        g_graphics->base[i] = pixel;
+    graphics_fill(pixel);
+}
+
+
+static void kernel_count_cpu(PerCpu* cpu, void* user)
+{
+    (void) cpu;
+    __atomic_add_fetch((u32 *) user, 1, __ATOMIC_RELAXED);
+}
+
+// Zero pages [begin, end) of the blocks in `argument`.
+static void kernel_zero_pages(u64 begin, u64 end, void* argument)
+{
+    const u64* blocks    = argument;
+    u64 pages_per_block  = 1ull << PAGE_MAX_ORDER;
+    for (u64 page = begin; page < end; ++page)
+        memset((u8 *) blocks[page / pages_per_block] + (page % pages_per_block) * PAGE_SIZE, 0, PAGE_SIZE);
+}
+
+typedef struct KernelZeroResult
+{
+    u64 bytes;
+    u64 serial_ns;
+    u64 parallel_ns;
+} KernelZeroResult;
+
+// Zero a few MiB on one CPU and then across all of them.
+static KernelZeroResult kernel_zero_benchmark()
+{
+    KernelZeroResult result = { 0 };
+
+    u64 blocks[KERNEL_ZERO_BLOCKS];
+    u64 count = 0;
+    while (count < KERNEL_ZERO_BLOCKS && (blocks[count] = page_alloc_order(PAGE_MAX_ORDER)))
+        ++count;
+
+    u64 pages = count << PAGE_MAX_ORDER;
+    if (pages)
+    {
+        // The first pass also faults in the TLB entries and warms up the
+        // code, so the parallel pass isn't the one paying for it.
+        u64 start = now_ns();
+        kernel_zero_pages(0, pages, blocks);
+        result.serial_ns = now_ns() - start;
+
+        start = now_ns();
+        task_parallel_for(0, pages, KERNEL_ZERO_GRAIN, kernel_zero_pages, blocks);
+        result.parallel_ns = now_ns() - start;
+        result.bytes       = pages * PAGE_SIZE;
+    }
+
+    for (u64 i = 0; i < count; ++i)
+        page_free(blocks[i]);
+    return result;
+}
+
+
+typedef struct KernelThreadWork
+{
+    u64 deadline;
+    int yields;
+} KernelThreadWork;
+
+typedef struct KernelThreadResult
+{
+    u32 threads;
+    u64 ns;
+} KernelThreadResult;
+
+// Spin until the deadline, yielding now and then or waiting for preemption.
+static void kernel_thread_spin(void* argument)
+{
+    const KernelThreadWork* work = argument;
+    u64 next_yield = now_ns() + KERNEL_THREAD_YIELD_NS;
+    for (u64 now = now_ns(); now < work->deadline; now = now_ns())
+    {
+        if (work->yields && now >= next_yield)
+        {
+            thread_yield();
+            next_yield = now + KERNEL_THREAD_YIELD_NS;
+        }
+        __asm__ __volatile__("pause");
+    }
+}
+
+// More threads than CPUs, so they have to share them for a while.
+static KernelThreadResult kernel_thread_benchmark(u32 cpus)
+{
+    KernelThreadResult result = { 0 };
+
+    u32 count = cpus * KERNEL_THREADS_PER_CPU;
+    if (count > KERNEL_THREADS_MAX)
+        count = KERNEL_THREADS_MAX;
+
+    u64 start = now_ns();
+    KernelThreadWork work[2] = {
+        { .deadline = start + KERNEL_THREAD_RUN_NS, .yields = 0 },
+        { .deadline = start + KERNEL_THREAD_RUN_NS, .yields = 1 },
+    };
+    Thread* threads[KERNEL_THREADS_MAX];
+
+    for (u32 i = 0; i < count; ++i)
+        if ((threads[result.threads] = thread_create(kernel_thread_spin, &work[i % 2])))
+            ++result.threads;
+    for (u32 i = 0; i < result.threads; ++i)
+        thread_join(threads[i]);
+    result.ns = now_ns() - start;
+    return result;
 }
 
 
 int start(Context* context)
 {
-    Cursor cursor = { 0, 0 };
+    // The context lives on the bootloader's stack; keep our own copy.
+    g_context = *context;
+    context   = &g_context;
+
+    BootTimeline* timeline = &g_boot_timeline;
+    *timeline = context->timeline;
+    boot_timeline_mark(timeline, "kernel entry");
+
+    // Before anything picks a code path from the feature bits.
+    cpu_enable_simd();
+    memory_init();
+    log_init();
+    log_ring_init();
+    log_string("Kernel started\n");
+
+    // The same TSC the bootloader measured, just more precisely.
+    if (time_init(timeline->tsc_hz))
+        timeline->tsc_hz = g_time.tsc_hz;
+    boot_timeline_mark(timeline, "tsc calibration");
+
+    arena_init(&context->memory);
+
+    // As early as the IST stacks can come from the arena, so faults from
+    // here on are reported instead of going to the firmware's handlers.
+    idt_init();
+    int tables_ready = cpu_tables_init(&g_boot_cpu_tables);
+    if (tables_ready)
+        cpu_tables_load(&g_boot_cpu_tables);
+    boot_timeline_mark(timeline, "interrupt tables");
+
+    int pages_ready = page_allocator_init(&context->memory);
+    boot_timeline_mark(timeline, "page allocator");
+
+    // Before reclaiming: the bootloader's tables live in memory that's
+    // about to be freed.
+    int paging_ready = pages_ready && paging_init(context);
+    boot_timeline_mark(timeline, "paging");
+
+    BootReclaimResult reclaimed = { 0 };
+    if (pages_ready)
+        reclaimed = boot_reclaim(context);
+    boot_timeline_mark(timeline, "reclaim boot memory");
+
+    heap_init();
 
-    g_cursor   = &cursor;
     g_font     = &context->font;
-    g_graphics = &context->graphics;
+    pixels_init();
+    graphics_init(&context->graphics);
+    boot_timeline_mark(timeline, "graphics init");
+
+    WriteCombiningResult write_combining = write_combining_map_framebuffer(&context->graphics);
+    boot_timeline_mark(timeline, "write combining");
 
     g_font->scale = 3;
+    console_init(g_font);
+    boot_timeline_mark(timeline, "console init");
+
+    int apic_ready = tables_ready && apic_init();
+    if (apic_ready && g_apic.timer_hz)
+        apic_timer_periodic(KERNEL_TICK_NS);
+    interrupts_enable();
+    boot_timeline_mark(timeline, "local apic");
+
+    u32 cpus_online = smp_init(context, &g_boot_cpu_tables, KERNEL_TICK_NS);
+    boot_timeline_mark(timeline, "start cpus");
+
+    // One warm-up round, then time one.
+    u32 cpus_answered = 0;
+    smp_run_all(kernel_count_cpu, &cpus_answered);
+    u64 run_all_start = now_ns();
+    smp_run_all(kernel_count_cpu, &cpus_answered);
+    u64 run_all_ns = now_ns() - run_all_start;
+
+    int tasks_ready = tasks_init();
+    KernelZeroResult zeroed = kernel_zero_benchmark();
+    boot_timeline_mark(timeline, "task scheduler");
+
+    int threads_ready = threads_init();
+    KernelThreadResult threaded = { 0 };
+    if (threads_ready)
+        threaded = kernel_thread_benchmark(cpus_online);
+    boot_timeline_mark(timeline, "threads");
+
+    print("Framebuffer write-combining: ");
+    print(WRITE_COMBINING_MODE_STRINGS[write_combining.mode]);
+    if (write_combining.mode == WRITE_COMBINING_PAT)
+    {
+        print(" (1G/2M/4K pages: ");
+        print_u64(write_combining.pages_1g);  print("/");
+        print_u64(write_combining.pages_2m);  print("/");
+        print_u64(write_combining.pages_4k);  print(", split: ");
+        print_u64(write_combining.splits);    print(")");
+    }
+    else if (write_combining.mode == WRITE_COMBINING_MTRR)
+    {
+        print(" (variable MTRR ");
+        print_u64(write_combining.mtrr);
+        print(")");
+    }
+    print("\n");
+    print("Memory operations: ");
+    print(g_memory_ops.name);
+    if (g_memory_ops.rep_threshold != (size_t) -1)
+    {
+        print(" (rep movsb from ");
+        print_u64(g_memory_ops.rep_threshold);
+        print(" bytes)");
+    }
+    print("\n");
+    print("Pixel operations: ");
+    print(g_pixel_ops.name);
+    print("\n");
+    print("TSC: ");
+    if (g_time.tsc_hz)
+    {
+        print_u64(g_time.tsc_hz / 1000000);
+        print(".");
+        print_u64(g_time.tsc_hz / 100000 % 10);
+        print_u64(g_time.tsc_hz / 10000 % 10);
+        print_u64(g_time.tsc_hz / 1000 % 10);
+        print(" MHz from ");
+        print(TIME_SOURCE_STRINGS[g_time.source]);
+        print(g_time.invariant ? " (invariant)\n" : " (not invariant)\n");
+    }
+    else
+    {
+        print("rate unknown\n");
+    }
+    print("CPU features:");
+    for (int feature = 0; feature < CPU_FEATURE_COUNT; ++feature)
+    {
+        if (cpu_has(feature))
+        {
+            print(" ");
+            print(CPU_FEATURE_NAMES[feature]);
+        }
+    }
+    print(" (XSAVE area: ");
+    print_u64(g_cpu.xsave_size);
+    print(" bytes)\n");
+    print("Paging: ");
+    if (paging_ready)
+    {
+        print_u64(g_paging.direct_map_size >> 30);
+        print(" GiB direct map (1G/2M/4K pages: ");
+        print_u64(g_paging.pages_1g);  print("/");
+        print_u64(g_paging.pages_2m);  print("/");
+        print_u64(g_paging.pages_4k);  print(", ");
+        print_u64(g_paging.tables);
+        print(" tables)\n");
+    }
+    else
+    {
+        print("still on the bootloader's tables\n");
+    }
+    print("Physical memory: ");
+    if (pages_ready)
+    {
+        print_u64(g_pages.free_pages * PAGE_SIZE >> 20);
+        print(" MiB free in ");
+        print_u64(g_pages.range_count);
+        print(" ranges (frame table: ");
+        print_u64(g_pages.count * sizeof(PageFrame) >> 10);
+        print(" KiB)\n");
+        print("Reclaimed from boot services and loader: ");
+        print_u64(reclaimed.pages);
+        print(" pages (");
+        print_u64(reclaimed.pages * PAGE_SIZE >> 20);
+        print(" MiB, ");
+        print_u64(reclaimed.pinned);
+        print(" pages kept for page tables, GDT and IDT)\n");
+        print("Boot arena: ");
+        print_u64(g_arena.used >> 10);
+        print(" KiB in ");
+        print_u64(g_arena.allocations);
+        print(" allocations (");
+        print_u64(g_arena.chunk_pages);
+        print(" pages from the page allocator)\n");
+    }
+    else
+    {
+        print("no usable memory in the memory map\n");
+    }
+    print("Interrupts: ");
+    if (apic_ready)
+    {
+        print(g_apic.x2apic ? "x2APIC" : "xAPIC");
+        print(" id ");
+        print_u64(g_apic.id);
+        print(", timer ");
+        print_u64(g_apic.timer_hz / 1000);
+        print(" kHz, ");
+        print_u64(1000000000ull / KERNEL_TICK_NS);
+        print(" Hz tick (");
+        print(g_interrupt_xsave ? "XSAVE" : "FXSAVE");
+        print(" state: ");
+        print_u64(g_interrupt_state_size - 64);
+        print(" bytes)\n");
+    }
+    else
+    {
+        print(tables_ready ? "no local APIC\n" : "no memory for the IST stacks\n");
+    }
+    print("CPUs: ");
+    print_u64(cpus_online);
+    print(" online of ");
+    print_u64(g_acpi.cpu_count ? g_acpi.cpu_count : 1);
+    print(" in the MADT");
+    if (g_acpi.cpus_hotplug)
+    {
+        print(", ");
+        print_u64(g_acpi.cpus_hotplug);
+        print(" hot-pluggable");
+    }
+    if (cpus_online > 1)
+    {
+        print(" (started in ");
+        print_u64(g_smp.startup_ns / 1000);
+        print(" us, run on all: ");
+        print_u64(run_all_ns / 1000);
+        print(".");
+        print_u64(run_all_ns / 100 % 10);
+        print(" us, ");
+        print_u64(cpus_answered / 2);
+        print(" answered)");
+    }
+    print("\n");
+    print("Tasks: ");
+    if (tasks_ready && zeroed.bytes)
+    {
+        u64 stolen = 0;
+        for (u32 i = 0; i < g_tasks.count; ++i)
+            stolen += g_tasks.queues[i].stolen;
+
+        print("zeroed ");
+        print_u64(zeroed.bytes >> 20);
+        print(" MiB in ");
+        print_u64(zeroed.parallel_ns / 1000);
+        print(" us on all CPUs, ");
+        print_u64(zeroed.serial_ns / 1000);
+        print(" us on one (");
+        print_u64(stolen);
+        print(" stolen, idle with ");
+        print(g_smp.use_mwait ? "mwait)\n" : "hlt)\n");
+    }
+    else
+    {
+        print(tasks_ready ? "no memory to zero\n" : "no memory for the deques\n");
+    }
+    print("Threads: ");
+    if (threads_ready && threaded.threads)
+    {
+        ThreadStats stats = thread_stats();
+        print_u64(threaded.threads);
+        print(" for ");
+        print_u64(threaded.ns / 1000000);
+        print(" ms, ");
+        print_u64(stats.switches);
+        print(" switches (");
+        print_u64(stats.preemptions);
+        print(" preempted, ");
+        print_u64(stats.yields);
+        print(" yielded, ");
+        print_u64(stats.migrations);
+        print(" migrated), switch ");
+        print_u64(stats.switch_latency.count ? stats.switch_latency.total / stats.switch_latency.count : 0);
+        print(" cycles (");
+        print_u64(stats.switch_latency.count ? stats.switch_latency.min : 0);
+        print("-");
+        print_u64(stats.switch_latency.max);
+        print("), queued ");
+        print_u64(stats.wait_latency.count ? cycles_to_ns(stats.wait_latency.total / stats.wait_latency.count) / 1000 : 0);
+        print(" us\n");
+    }
+    else
+    {
+        print(threads_ready ? "no memory for threads\n" : "no memory for the run queues\n");
+    }
+    boot_timeline_mark(timeline, "boot report");
+
+    print_boot_timeline(timeline);
 
     // debug_halt();
-    fill(BLACK);
 
     print(
         "\n"
@@ -321,15 +720,9 @@ int start(Context* context)
         "\n"
         "Aliquam hendrerit felis vitae lacus egestas sodales. Aliquam mauris lorem, aliquet at ultricies in, vulputate hendrerit justo. Praesent et accumsan ex. Fusce ac tempus ipsum, id iaculis eros. Integer id orci mattis, suscipit augue quis, luctus justo. Donec congue, magna quis mollis imperdiet, magna odio semper magna, sit amet dignissim tortor orci quis erat. Suspendisse fermentum est eget semper aliquet. Praesent gravida dui a metus iaculis consequat. "
     );
+    print_flush();
 
-
-    debug_halt();
-    for (int i = 0; i < context->graphics.size / sizeof(Pixel); ++i)
-    {
-        context->graphics.base[i] = (Pixel) { 0, 0xFF, 0xFF };
-    }
-
-
-    int value = (u64) context;
-    return LETTERS[value][2];
+    // From here on the bootstrap processor is just another idle CPU.
+    for (;;)
+        smp_idle(this_cpu());
 }
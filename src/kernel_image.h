@@ -0,0 +1,40 @@
+#pragma once
+// Compressed kernel image, produced from the kernel ELF by bin/kernel_pack.
+//
+//     KernelImageHeader
+//     KernelImageSegment[segment_count]
+//     Compressed bytes of each segment, back to back.
+//
+// A segment's bytes (up to its `file_size`) are cut into blocks of
+// `block_size` bytes, and every block is compressed on its own as an LZ4
+// block, so the bootloader can read and decompress the image a piece at a
+// time straight into the segment's final location. Each block is prefixed
+// with a u32 holding its compressed size; if KERNEL_IMAGE_BLOCK_STORED is
+// set the block didn't compress and is stored as-is. The size of the
+// decompressed block is implied: `block_size`, except for a segment's last.
+
+#include "types.h"
+
+
+#define KERNEL_IMAGE_MAGIC         0x345A4C4B   // "KLZ4"
+#define KERNEL_IMAGE_VERSION       1
+#define KERNEL_IMAGE_BLOCK_SIZE    (64 * 1024)
+#define KERNEL_IMAGE_BLOCK_STORED  0x80000000u
+
+
+typedef struct KernelImageHeader {
+    u32 magic;
+    u16 version;
+    u16 segment_count;
+    u32 block_size;
+    u32 _reserved;
+    u64 entry_point;
+    u64 uncompressed_size;  // Sum of all the segments' `file_size`.
+} __attribute__((packed)) KernelImageHeader;
+
+typedef struct KernelImageSegment {
+    u64 virtual_address;
+    u64 file_size;          // Bytes stored in the image, after decompression.
+    u64 memory_size;        // The rest, up to this, is zeroed.
+    u64 compressed_size;    // Bytes of this segment in the image, block headers included.
+} __attribute__((packed)) KernelImageSegment;
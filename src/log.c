@@ -0,0 +1,126 @@
+// Text logging through an I/O port, for the bootloader and the kernel.
+//
+// Unlike the firmware console or the framebuffer, this is cheap enough to
+// log a lot, and works before graphics and after ExitBootServices. The
+// backend is chosen at build time with LOG_BACKEND:
+//
+//     LOG_BACKEND_NONE      Logging compiles to nothing.
+//     LOG_BACKEND_DEBUGCON  QEMU/Bochs debug console (-debugcon file:debug.log).
+//     LOG_BACKEND_SERIAL    16550 UART on COM1 (-serial file:serial.log).
+//
+// Both backends check that the device exists in `log_init` and drop the
+// output otherwise, so a build with logging still boots on real hardware.
+#include "types.h"
+
+
+#define LOG_BACKEND_NONE      0
+#define LOG_BACKEND_DEBUGCON  1
+#define LOG_BACKEND_SERIAL    2
+
+#ifndef LOG_BACKEND
+#define LOG_BACKEND LOG_BACKEND_DEBUGCON
+#endif
+
+#ifndef LOG_DEBUGCON_PORT
+#define LOG_DEBUGCON_PORT 0xE9
+#endif
+
+#define LOG_SERIAL_PORT       0x3F8   // COM1.
+#define LOG_SERIAL_DIVISOR    1       // 115200 baud.
+#define LOG_SERIAL_FIFO_SIZE  16
+#define LOG_SERIAL_TIMEOUT    (1 << 20)
+
+// 16550 registers, relative to the base port.
+#define UART_DATA            0
+#define UART_INTERRUPTS      1
+#define UART_FIFO_CONTROL    2
+#define UART_LINE_CONTROL    3
+#define UART_MODEM_CONTROL   4
+#define UART_LINE_STATUS     5
+#define UART_SCRATCH         7
+
+#define UART_LINE_STATUS_THR_EMPTY  0x20   // With the FIFO enabled: the whole FIFO is empty.
+
+
+int g_log_present = 0;
+
+
+void log_init()
+{
+#if LOG_BACKEND == LOG_BACKEND_DEBUGCON
+    // Reading the port gives back 0xE9 when the debug console is there.
+    g_log_present = read_port(LOG_DEBUGCON_PORT) == 0xE9;
+#elif LOG_BACKEND == LOG_BACKEND_SERIAL
+    write_port(LOG_SERIAL_PORT + UART_SCRATCH, 0xAE);
+    if (read_port(LOG_SERIAL_PORT + UART_SCRATCH) != 0xAE)
+        return;
+
+    write_port(LOG_SERIAL_PORT + UART_INTERRUPTS,   0x00);   // Polled.
+    write_port(LOG_SERIAL_PORT + UART_LINE_CONTROL, 0x80);   // Divisor latch.
+    write_port(LOG_SERIAL_PORT + UART_DATA,         LOG_SERIAL_DIVISOR & 0xFF);
+    write_port(LOG_SERIAL_PORT + UART_INTERRUPTS,   LOG_SERIAL_DIVISOR >> 8);
+    write_port(LOG_SERIAL_PORT + UART_LINE_CONTROL, 0x03);   // 8N1.
+    write_port(LOG_SERIAL_PORT + UART_FIFO_CONTROL, 0xC7);   // Enable and clear FIFOs.
+    write_port(LOG_SERIAL_PORT + UART_MODEM_CONTROL, 0x03);  // DTR, RTS.
+    g_log_present = 1;
+#endif
+}
+
+
+#if LOG_BACKEND == LOG_BACKEND_SERIAL
+// Wait until the transmit FIFO has drained, then fill it in one go: one
+// status read per FIFO instead of one per byte.
+static void log_serial_write(const u8* data, u64 count)
+{
+    u64 i = 0;
+    while (i < count)
+    {
+        int spins = 0;
+        while (!(read_port(LOG_SERIAL_PORT + UART_LINE_STATUS) & UART_LINE_STATUS_THR_EMPTY))
+        {
+            if (++spins == LOG_SERIAL_TIMEOUT)
+            {
+                g_log_present = 0;  // Not draining; don't hang the boot on it.
+                return;
+            }
+            __asm__ __volatile__("pause");
+        }
+
+        // Terminals want "\r\n"; keep a spare slot for the '\r'.
+        for (int room = LOG_SERIAL_FIFO_SIZE; room >= 2 && i < count; ++i)
+        {
+            if (data[i] == '\n')
+            {
+                write_port(LOG_SERIAL_PORT + UART_DATA, '\r');
+                --room;
+            }
+            write_port(LOG_SERIAL_PORT + UART_DATA, data[i]);
+            --room;
+        }
+    }
+}
+#endif
+
+
+void log_write(const char* data, u64 count)
+{
+    if (!g_log_present || count == 0)
+        return;
+
+#if LOG_BACKEND == LOG_BACKEND_DEBUGCON
+    write_port_string(LOG_DEBUGCON_PORT, (const u8 *) data, count);
+#elif LOG_BACKEND == LOG_BACKEND_SERIAL
+    log_serial_write((const u8 *) data, count);
+#else
+    (void) data;
+#endif
+}
+
+
+void log_string(const char* string)
+{
+    u64 count = 0;
+    while (string[count])
+        ++count;
+    log_write(string, count);
+}
@@ -0,0 +1,151 @@
+// Lock-free multi-producer ring of log records.
+//
+// Writers only copy their text into a record and publish it; nothing is
+// rendered on their path. `log_ring_drain` later hands the records, in
+// order, to a sink (console, serial, ...), so a burst of writes is rendered
+// in one go.
+//
+// This is a bounded queue in the style of Dmitry Vyukov's MPMC queue: each
+// record carries a sequence number that says whose turn it is. A writer
+// claims a slot with one compare-and-swap on `head` and publishes it with a
+// release store of the sequence. When the ring is full, writes are dropped
+// and counted instead of waiting for the drain.
+#include "types.h"
+
+
+#define LOG_RING_RECORDS      256   // Power of two.
+#define LOG_RING_RECORD_TEXT  112   // Longer writes take several records.
+
+
+typedef struct LogRecord
+{
+    u64  sequence;   // == position: free. == position + 1: written.
+    u64  tsc;
+    u64  length;
+    char text[LOG_RING_RECORD_TEXT];
+} LogRecord;
+
+typedef struct LogRing
+{
+    u64       head;      // Next position to claim. Shared by all writers.
+    u64       tail;      // Next position to drain.
+    u64       dropped;   // Writes lost because the ring was full.
+    int       draining;
+    LogRecord records[LOG_RING_RECORDS];
+} LogRing;
+
+typedef void (*LogRingSink)(const LogRecord* record, void* user);
+
+
+LogRing g_log_ring;
+
+
+void log_ring_init()
+{
+    g_log_ring.head     = 0;
+    g_log_ring.tail     = 0;
+    g_log_ring.dropped  = 0;
+    g_log_ring.draining = 0;
+    for (u64 i = 0; i < LOG_RING_RECORDS; ++i)
+        g_log_ring.records[i].sequence = i;
+}
+
+
+// Claim the next free record, or return NULL if the ring is full.
+static LogRecord* log_ring_claim(u64* claimed)
+{
+    u64 position = __atomic_load_n(&g_log_ring.head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        LogRecord* record     = &g_log_ring.records[position & (LOG_RING_RECORDS - 1)];
+        u64        sequence   = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        i64        difference = (i64) (sequence - position);
+
+        if (difference == 0)
+        {
+            // On failure `position` is updated to the current head.
+            if (__atomic_compare_exchange_n(&g_log_ring.head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *claimed = position;
+                return record;
+            }
+        }
+        else if (difference < 0)
+        {
+            __atomic_add_fetch(&g_log_ring.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        else
+        {
+            position = __atomic_load_n(&g_log_ring.head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+// Append `length` bytes of `text`. Text longer than a record is split over
+// several; other writers may get in between them. Returns how many bytes
+// were written, which is less than `length` if the ring filled up.
+u64 log_ring_write(const char* text, u64 length)
+{
+    u64 tsc     = read_tsc();
+    u64 written = 0;
+
+    while (written < length)
+    {
+        u64        position;
+        LogRecord* record = log_ring_claim(&position);
+        if (!record)
+            break;
+
+        u64 count = length - written;
+        if (count > LOG_RING_RECORD_TEXT)
+            count = LOG_RING_RECORD_TEXT;
+
+        record->tsc    = tsc;
+        record->length = count;
+        memcpy(record->text, text + written, count);
+        __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+
+        written += count;
+    }
+
+    return written;
+}
+
+u64 log_ring_write_string(const char* string)
+{
+    u64 length = 0;
+    while (string[length])
+        ++length;
+    return log_ring_write(string, length);
+}
+
+
+// Pass every published record to `sink`, oldest first, and free them.
+// Stops at the first record that's claimed but not yet published. Only one
+// drain runs at a time; a concurrent call returns 0 right away. Returns the
+// number of records drained.
+u64 log_ring_drain(LogRingSink sink, void* user)
+{
+    if (__atomic_exchange_n(&g_log_ring.draining, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    u64 count = 0;
+    for (;;)
+    {
+        u64        position = g_log_ring.tail;
+        LogRecord* record   = &g_log_ring.records[position & (LOG_RING_RECORDS - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != position + 1)
+            break;
+
+        sink(record, user);
+
+        g_log_ring.tail = position + 1;
+        __atomic_store_n(&record->sequence, position + LOG_RING_RECORDS, __ATOMIC_RELEASE);
+        ++count;
+    }
+
+    __atomic_store_n(&g_log_ring.draining, 0, __ATOMIC_RELEASE);
+    return count;
+}
@@ -0,0 +1,99 @@
+// Decompressor for the LZ4 block format.
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+//
+// A block is a list of sequences: a token byte whose high nibble is the
+// literal length and low nibble the match length (minus 4), optional extra
+// length bytes, the literals, and a 16-bit little-endian offset back into
+// the output. Copies are done 16 bytes at a time whenever there's enough
+// room on both sides to overshoot; near the end of the buffers it falls back
+// to exact copies. All lengths and offsets are checked, so a corrupt block
+// fails instead of writing outside `destination`.
+#include "types.h"
+
+
+#define LZ4_MIN_MATCH  4
+#define LZ4_WILD_COPY  16
+
+
+// Read an LZ4 extended length: bytes are added until one isn't 255.
+static inline int lz4_read_length(const u8** source, const u8* end, u64* length)
+{
+    u8 byte;
+    do {
+        if (*source >= end)
+            return 0;
+        byte = *(*source)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+
+// Decompress one block. Returns the number of bytes written to
+// `destination`, or -1 if the block is malformed or doesn't fit.
+i64 lz4_decompress(const u8* source, u64 source_size, u8* destination, u64 destination_size)
+{
+    const u8* in      = source;
+    const u8* in_end  = source + source_size;
+    u8*       out     = destination;
+    u8*       out_end = destination + destination_size;
+
+    while (in < in_end)
+    {
+        u8  token    = *in++;
+        u64 literals = token >> 4;
+        if (literals == 15 && !lz4_read_length(&in, in_end, &literals))
+            return -1;
+
+        if ((u64) (in_end - in) < literals || (u64) (out_end - out) < literals)
+            return -1;
+
+        if ((u64) (in_end - in) >= literals + LZ4_WILD_COPY && (u64) (out_end - out) >= literals + LZ4_WILD_COPY)
+        {
+            for (u64 i = 0; i < literals; i += LZ4_WILD_COPY)
+                __builtin_memcpy(out + i, in + i, LZ4_WILD_COPY);
+        }
+        else
+        {
+            for (u64 i = 0; i < literals; ++i)
+                out[i] = in[i];
+        }
+        in  += literals;
+        out += literals;
+
+        // The last sequence has literals only.
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return -1;
+        u64 offset = (u64) in[0] | ((u64) in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (u64) (out - destination))
+            return -1;
+
+        u64 length = token & 15;
+        if (length == 15 && !lz4_read_length(&in, in_end, &length))
+            return -1;
+        length += LZ4_MIN_MATCH;
+
+        if ((u64) (out_end - out) < length)
+            return -1;
+
+        const u8* match = out - offset;
+        if (offset >= LZ4_WILD_COPY && (u64) (out_end - out) >= length + LZ4_WILD_COPY)
+        {
+            for (u64 i = 0; i < length; i += LZ4_WILD_COPY)
+                __builtin_memcpy(out + i, match + i, LZ4_WILD_COPY);
+        }
+        else
+        {
+            // Overlapping matches repeat the last `offset` bytes.
+            for (u64 i = 0; i < length; ++i)
+                out[i] = match[i];
+        }
+        out += length;
+    }
+
+    return out - destination;
+}
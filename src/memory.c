@@ -3,19 +3,375 @@
 // yourself as described in the C standard. You cannot and should not (if you
 // could) prevent the compiler from assuming these functions exist as the
 // compiler uses them for important optimizations.
+//
+// Since the compiler calls these for every struct copy, they're worth making
+// fast. Small sizes are handled inline with overlapping loads and stores.
+// Larger ones go to SSE2 (always present on x86-64) or AVX2 loops, and very
+// large ones to `rep movsb`/`rep stosb` when the CPU has ERMS (Enhanced REP
+// MOVSB/STOSB). `memory_init` picks the variants once at startup; until
+// then the SSE2 versions are used.
+//
+// Both the bootloader and the kernel include this file, so it must only
+// depend on cpu.c and types.h.
 #include <stddef.h>
 
-void* memcpy(void* destination, const void* source, size_t size)
+#include "types.h"
+
+
+typedef u16       UnalignedU16 __attribute__((aligned(1), may_alias));
+typedef u32       UnalignedU32 __attribute__((aligned(1), may_alias));
+typedef u64       UnalignedU64 __attribute__((aligned(1), may_alias));
+typedef char      Bytes128     __attribute__((vector_size(16)));
+typedef char      Bytes256     __attribute__((vector_size(32)));
+typedef char      UnalignedBytes128 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char      UnalignedBytes256 __attribute__((vector_size(32), aligned(1), may_alias));
+
+
+typedef struct MemoryOps
+{
+    const char* name;
+    void* (*copy)(void* destination, const void* source, size_t size);
+    void* (*set)(void* destination, int value, size_t size);
+    int   (*compare)(const void* a, const void* b, size_t size);
+
+    // Copies and sets of at least this many bytes use `rep movsb`/`rep stosb`.
+    size_t rep_threshold;
+} MemoryOps;
+
+
+// ---- Shared pieces ----
+
+static inline void rep_movsb(void* destination, const void* source, size_t size)
+{
+    __asm__ __volatile__("rep movsb" : "+D" (destination), "+S" (source), "+c" (size) : : "memory");
+}
+
+static inline void rep_stosb(void* destination, u8 value, size_t size)
+{
+    __asm__ __volatile__("rep stosb" : "+D" (destination), "+c" (size) : "a" (value) : "memory");
+}
+
+// 0 to 15 bytes. All loads happen before any store, so this is also safe
+// for overlapping ranges (memmove).
+static inline void copy_small(u8* destination, const u8* source, size_t size)
+{
+    if (size >= 8)
+    {
+        u64 head = *(const UnalignedU64 *) source;
+        u64 tail = *(const UnalignedU64 *) (source + size - 8);
+        *(UnalignedU64 *) destination              = head;
+        *(UnalignedU64 *) (destination + size - 8) = tail;
+    }
+    else if (size >= 4)
+    {
+        u32 head = *(const UnalignedU32 *) source;
+        u32 tail = *(const UnalignedU32 *) (source + size - 4);
+        *(UnalignedU32 *) destination              = head;
+        *(UnalignedU32 *) (destination + size - 4) = tail;
+    }
+    else if (size >= 2)
+    {
+        u16 head = *(const UnalignedU16 *) source;
+        u16 tail = *(const UnalignedU16 *) (source + size - 2);
+        *(UnalignedU16 *) destination              = head;
+        *(UnalignedU16 *) (destination + size - 2) = tail;
+    }
+    else if (size == 1)
+    {
+        *destination = *source;
+    }
+}
+
+static inline void set_small(u8* destination, u8 value, size_t size)
+{
+    u64 wide = 0x0101010101010101ull * value;
+    if (size >= 8)
+    {
+        *(UnalignedU64 *) destination              = wide;
+        *(UnalignedU64 *) (destination + size - 8) = wide;
+    }
+    else if (size >= 4)
+    {
+        *(UnalignedU32 *) destination              = (u32) wide;
+        *(UnalignedU32 *) (destination + size - 4) = (u32) wide;
+    }
+    else if (size >= 2)
+    {
+        *(UnalignedU16 *) destination              = (u16) wide;
+        *(UnalignedU16 *) (destination + size - 2) = (u16) wide;
+    }
+    else if (size == 1)
+    {
+        *destination = value;
+    }
+}
+
+static inline int compare_bytes(const u8* a, const u8* b, size_t size)
 {
     for (size_t i = 0; i < size; ++i)
-        ((u8*) destination)[i] = ((const u8*) source)[i];
+        if (a[i] != b[i])
+            return a[i] - b[i];
+    return 0;
+}
+
+
+// ---- SSE2 ----
+
+static void* sse2_copy(void* destination, const void* source, size_t size)
+{
+    u8*       target = (u8 *) destination;
+    const u8* origin = (const u8 *) source;
+
+    if (size < 16)
+    {
+        copy_small(target, origin, size);
+        return destination;
+    }
+
+    // The last 16 bytes are loaded up front and stored last, so the loop
+    // never needs a scalar tail.
+    Bytes128 tail = *(const UnalignedBytes128 *) (origin + size - 16);
+
+    size_t i = 0;
+    for (; i + 64 <= size - 16; i += 64)
+    {
+        Bytes128 a = *(const UnalignedBytes128 *) (origin + i);
+        Bytes128 b = *(const UnalignedBytes128 *) (origin + i + 16);
+        Bytes128 c = *(const UnalignedBytes128 *) (origin + i + 32);
+        Bytes128 d = *(const UnalignedBytes128 *) (origin + i + 48);
+        *(UnalignedBytes128 *) (target + i)      = a;
+        *(UnalignedBytes128 *) (target + i + 16) = b;
+        *(UnalignedBytes128 *) (target + i + 32) = c;
+        *(UnalignedBytes128 *) (target + i + 48) = d;
+    }
+    for (; i < size - 16; i += 16)
+        *(UnalignedBytes128 *) (target + i) = *(const UnalignedBytes128 *) (origin + i);
+
+    *(UnalignedBytes128 *) (target + size - 16) = tail;
     return destination;
 }
 
+static void* sse2_set(void* destination, int value, size_t size)
+{
+    u8* target = (u8 *) destination;
+
+    if (size < 16)
+    {
+        set_small(target, (u8) value, size);
+        return destination;
+    }
+
+    char     c      = (char) value;
+    Bytes128 vector = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        *(UnalignedBytes128 *) (target + i)      = vector;
+        *(UnalignedBytes128 *) (target + i + 16) = vector;
+        *(UnalignedBytes128 *) (target + i + 32) = vector;
+        *(UnalignedBytes128 *) (target + i + 48) = vector;
+    }
+    for (; i + 16 <= size; i += 16)
+        *(UnalignedBytes128 *) (target + i) = vector;
+
+    *(UnalignedBytes128 *) (target + size - 16) = vector;
+    return destination;
+}
+
+static int sse2_compare(const void* a, const void* b, size_t size)
+{
+    const u8* left  = (const u8 *) a;
+    const u8* right = (const u8 *) b;
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        Bytes128 x = *(const UnalignedBytes128 *) (left  + i);
+        Bytes128 y = *(const UnalignedBytes128 *) (right + i);
+        int equal = __builtin_ia32_pmovmskb128(__builtin_ia32_pcmpeqb128(x, y));
+        if (equal != 0xFFFF)
+        {
+            int j = __builtin_ctz(~equal);
+            return left[i + j] - right[i + j];
+        }
+    }
+
+    return compare_bytes(left + i, right + i, size - i);
+}
+
+static const MemoryOps MEMORY_OPS_SSE2 = {
+    .name          = "SSE2",
+    .copy          = sse2_copy,
+    .set           = sse2_set,
+    .compare       = sse2_compare,
+    .rep_threshold = (size_t) -1,
+};
+
+
+// ---- AVX2 ----
+
+__attribute__((target("avx2")))
+static void* avx2_copy(void* destination, const void* source, size_t size)
+{
+    u8*       target = (u8 *) destination;
+    const u8* origin = (const u8 *) source;
+
+    if (size < 32)
+        return sse2_copy(destination, source, size);
+
+    Bytes256 tail = *(const UnalignedBytes256 *) (origin + size - 32);
+
+    size_t i = 0;
+    for (; i + 128 <= size - 32; i += 128)
+    {
+        Bytes256 a = *(const UnalignedBytes256 *) (origin + i);
+        Bytes256 b = *(const UnalignedBytes256 *) (origin + i + 32);
+        Bytes256 c = *(const UnalignedBytes256 *) (origin + i + 64);
+        Bytes256 d = *(const UnalignedBytes256 *) (origin + i + 96);
+        *(UnalignedBytes256 *) (target + i)      = a;
+        *(UnalignedBytes256 *) (target + i + 32) = b;
+        *(UnalignedBytes256 *) (target + i + 64) = c;
+        *(UnalignedBytes256 *) (target + i + 96) = d;
+    }
+    for (; i < size - 32; i += 32)
+        *(UnalignedBytes256 *) (target + i) = *(const UnalignedBytes256 *) (origin + i);
+
+    *(UnalignedBytes256 *) (target + size - 32) = tail;
+    return destination;
+}
+
+__attribute__((target("avx2")))
+static void* avx2_set(void* destination, int value, size_t size)
+{
+    u8* target = (u8 *) destination;
+
+    if (size < 32)
+        return sse2_set(destination, value, size);
+
+    char     c      = (char) value;
+    Bytes256 vector = {
+        c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c,
+        c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c
+    };
+
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128)
+    {
+        *(UnalignedBytes256 *) (target + i)      = vector;
+        *(UnalignedBytes256 *) (target + i + 32) = vector;
+        *(UnalignedBytes256 *) (target + i + 64) = vector;
+        *(UnalignedBytes256 *) (target + i + 96) = vector;
+    }
+    for (; i + 32 <= size; i += 32)
+        *(UnalignedBytes256 *) (target + i) = vector;
+
+    *(UnalignedBytes256 *) (target + size - 32) = vector;
+    return destination;
+}
+
+__attribute__((target("avx2")))
+static int avx2_compare(const void* a, const void* b, size_t size)
+{
+    const u8* left  = (const u8 *) a;
+    const u8* right = (const u8 *) b;
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        Bytes256 x = *(const UnalignedBytes256 *) (left  + i);
+        Bytes256 y = *(const UnalignedBytes256 *) (right + i);
+        u32 equal = (u32) __builtin_ia32_pmovmskb256(__builtin_ia32_pcmpeqb256(x, y));
+        if (equal != 0xFFFFFFFF)
+        {
+            int j = __builtin_ctz(~equal);
+            return left[i + j] - right[i + j];
+        }
+    }
+
+    return sse2_compare(left + i, right + i, size - i);
+}
+
+static const MemoryOps MEMORY_OPS_AVX2 = {
+    .name          = "AVX2",
+    .copy          = avx2_copy,
+    .set           = avx2_set,
+    .compare       = avx2_compare,
+    .rep_threshold = (size_t) -1,
+};
+
+
+MemoryOps g_memory_ops = {
+    .name          = "SSE2",
+    .copy          = sse2_copy,
+    .set           = sse2_set,
+    .compare       = sse2_compare,
+    .rep_threshold = (size_t) -1,
+};
+
+
+void memory_init()
+{
+    g_memory_ops = cpu_has(CPU_FEATURE_AVX2) ? MEMORY_OPS_AVX2 : MEMORY_OPS_SSE2;
+
+    // ERMS makes `rep movsb` the fastest way to move large blocks; FSRM
+    // (Fast Short REP MOVSB) moves the break-even point much lower.
+    if (cpu_has(CPU_FEATURE_FSRM))
+        g_memory_ops.rep_threshold = 512;
+    else if (cpu_has(CPU_FEATURE_ERMS))
+        g_memory_ops.rep_threshold = 2048;
+}
+
+
+void* memcpy(void* destination, const void* source, size_t size)
+{
+    if (size >= g_memory_ops.rep_threshold)
+    {
+        rep_movsb(destination, source, size);
+        return destination;
+    }
+    return g_memory_ops.copy(destination, source, size);
+}
+
 void* memset(void* source, int value, size_t size)
 {
-    u8* pointer = (u8 *) source;
-    while (size--)
-        *pointer++ = (unsigned char) value;
-    return source;
+    if (size >= g_memory_ops.rep_threshold)
+    {
+        rep_stosb(source, (u8) value, size);
+        return source;
+    }
+    return g_memory_ops.set(source, value, size);
+}
+
+int memcmp(const void* a, const void* b, size_t size)
+{
+    return g_memory_ops.compare(a, b, size);
+}
+
+void* memmove(void* destination, const void* source, size_t size)
+{
+    u8*       target = (u8 *) destination;
+    const u8* origin = (const u8 *) source;
+
+    // Copying forwards is safe unless the destination starts inside the
+    // source (the unsigned difference covers both other cases).
+    if ((usize) (target - origin) >= size)
+        return memcpy(destination, source, size);
+
+    if (size < 16)
+    {
+        copy_small(target, origin, size);
+        return destination;
+    }
+
+    // Backwards, 16 bytes at a time. The first 16 bytes are loaded up front
+    // so the head needs no scalar loop.
+    Bytes128 head = *(const UnalignedBytes128 *) origin;
+
+    size_t i = size;
+    for (; i > 16; i -= 16)
+        *(UnalignedBytes128 *) (target + i - 16) = *(const UnalignedBytes128 *) (origin + i - 16);
+
+    *(UnalignedBytes128 *) target = head;
+    return destination;
 }
@@ -0,0 +1,278 @@
+// The kernel's own page tables.
+//
+// The bootloader enters the kernel on a copy of the firmware's identity
+// mapping with the kernel image added at KERNEL_VIRTUAL_BASE. `paging_init`
+// replaces that with tables the kernel owns:
+//
+//     0xFFFF800000000000  Direct map of all physical memory (PAGING_DIRECT_MAP).
+//     0xFFFFFFFF80000000  The kernel image (KERNEL_VIRTUAL_BASE), 2 MiB pages.
+//
+// The direct map uses 1 GiB pages when the CPU has them and 2 MiB pages
+// otherwise, so it costs a few tables and TLB entries instead of the
+// firmware's thousands of 4 KiB mappings. A large page is only used where
+// the memory map says the whole range is write-back RAM, or none of it is:
+// one page spanning memory types the MTRRs treat differently is undefined
+// (SDM 11.11.9). Anything that isn't RAM (the MMIO holes, the LAPIC) is
+// mapped uncacheable, and the first 2 MiB, where the fixed-range MTRRs
+// apply, always get 4 KiB pages.
+//
+// The lower half keeps an identity alias of the direct map: its PML4
+// entries point at the same PDPTs, so it costs no tables. The frame table,
+// the boot structures and the stack the kernel is running on are still
+// addressed physically.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define PAGE_PRESENT   (1ull << 0)
+#define PAGE_WRITABLE  (1ull << 1)
+#define PAGE_PWT       (1ull << 3)
+#define PAGE_PCD       (1ull << 4)
+#define PAGE_LARGE     (1ull << 7)    // PS in a PDPTE/PDE.
+#define PAGE_PAT       (1ull << 7)    // PAT in a PTE.
+#define PAGE_GLOBAL    (1ull << 8)
+#define PAGE_PAT_LARGE (1ull << 12)   // PAT in a PDPTE/PDE with PS set.
+#define PAGE_ADDRESS   0x000FFFFFFFFFF000ull
+
+#define PAGING_DIRECT_MAP     0xFFFF800000000000ull
+#define PAGING_MIN_DIRECT_MAP (4ull << 30)   // Covers the 32-bit MMIO hole (LAPIC, IOAPIC, HPET).
+#define PAGING_1G             (1ull << 30)
+#define PAGING_2M             (1ull << 21)
+#define PAGING_FIXED_MTRR_END (1ull << 20)   // The fixed-range MTRRs cover the first MiB.
+
+
+typedef struct Paging
+{
+    u64 pml4;               // Physical address, as loaded into CR3.
+    u64 direct_map_size;    // Bytes of physical memory mapped at PAGING_DIRECT_MAP.
+    u64 pages_1g;
+    u64 pages_2m;
+    u64 pages_4k;
+    u64 tables;             // Pages spent on page tables.
+} Paging;
+
+
+// From the linker script.
+extern u8 __kernel_start[];
+extern u8 __kernel_end[];
+
+Paging g_paging;
+
+
+static inline void* paging_direct(u64 physical)
+{
+    return (void *) (PAGING_DIRECT_MAP + physical);
+}
+
+// Physical address of something in the kernel image, the direct map or the
+// identity alias.
+static inline u64 paging_physical(const void* address)
+{
+    u64 value = (u64) address;
+    if (value >= KERNEL_VIRTUAL_BASE)
+        return value - KERNEL_VIRTUAL_BASE;
+    if (value >= PAGING_DIRECT_MAP)
+        return value - PAGING_DIRECT_MAP;
+    return value;
+}
+
+
+// A zeroed page for a table. Written through its physical address, which
+// is mapped both before and after the switch.
+static u64* paging_table()
+{
+    u64 address = page_alloc();
+    if (!address)
+        return NULL;
+
+    memset((void *) address, 0, PAGE_SIZE);
+    g_paging.tables += 1;
+    return (u64 *) address;
+}
+
+
+// The highest physical address anything in the memory map or the
+// framebuffer lives at.
+static u64 paging_physical_end(const Context* context)
+{
+    u64 end = PAGING_MIN_DIRECT_MAP;
+
+    const Memory* memory = &context->memory;
+    u64 entries = memory->MemoryMapSize / memory->DescriptorSize;
+    for (u64 i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *)
+            ((const u8 *) memory->MemoryMap + i * memory->DescriptorSize);
+
+        u64 descriptor_end = descriptor->PhysicalStart + descriptor->NumberOfPages * PAGE_SIZE;
+        if (descriptor_end > end)
+            end = descriptor_end;
+    }
+
+    u64 framebuffer_end = (u64) context->graphics.base + context->graphics.size;
+    if (framebuffer_end > end)
+        end = framebuffer_end;
+
+    return (end + PAGING_1G - 1) & ~(PAGING_1G - 1);
+}
+
+
+typedef enum PagingKind
+{
+    PAGING_UNCACHED,    // Not RAM, as far as the memory map knows.
+    PAGING_WRITE_BACK,
+    PAGING_MIXED,       // Needs smaller pages.
+} PagingKind;
+
+// Whether the memory map has [begin, end) as write-back RAM. Descriptors
+// don't overlap, so the covered bytes add up.
+static PagingKind paging_kind(const Memory* memory, u64 begin, u64 end)
+{
+    if (begin < PAGING_FIXED_MTRR_END && end - begin > PAGE_SIZE)
+        return PAGING_MIXED;
+
+    u64 covered = 0;
+    u64 entries = memory->MemoryMapSize / memory->DescriptorSize;
+    for (u64 i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *)
+            ((const u8 *) memory->MemoryMap + i * memory->DescriptorSize);
+        if (!(descriptor->Attribute & EFI_MEMORY_WB)
+            || descriptor->Type == EfiMemoryMappedIO
+            || descriptor->Type == EfiMemoryMappedIOPortSpace)
+            continue;
+
+        u64 first = descriptor->PhysicalStart;
+        u64 last  = first + descriptor->NumberOfPages * PAGE_SIZE;
+        if (first < begin)
+            first = begin;
+        if (last > end)
+            last = end;
+        if (first < last)
+            covered += last - first;
+    }
+
+    if (covered == 0)
+        return PAGING_UNCACHED;
+    return covered == end - begin ? PAGING_WRITE_BACK : PAGING_MIXED;
+}
+
+static u64 paging_leaf(u64 address, PagingKind kind)
+{
+    u64 entry = address | PAGE_PRESENT | PAGE_WRITABLE;
+    return kind == PAGING_UNCACHED ? entry | PAGE_PCD | PAGE_PWT : entry;
+}
+
+
+// Map 2 MiB at `address` into `pde`: one large page if it's all one kind,
+// a table of 4 KiB pages otherwise.
+static int paging_map_2m(u64* pde, u64 address, const Memory* memory)
+{
+    PagingKind kind = paging_kind(memory, address, address + PAGING_2M);
+    if (kind != PAGING_MIXED)
+    {
+        *pde = paging_leaf(address, kind) | PAGE_LARGE;
+        g_paging.pages_2m += 1;
+        return 1;
+    }
+
+    u64* pt = paging_table();
+    if (!pt)
+        return 0;
+    for (u64 i = 0; i < 512; ++i)
+    {
+        u64 page = address + i * PAGE_SIZE;
+        pt[i] = paging_leaf(page, paging_kind(memory, page, page + PAGE_SIZE));
+    }
+    *pde = (u64) pt | PAGE_PRESENT | PAGE_WRITABLE;
+    g_paging.pages_4k += 512;
+    return 1;
+}
+
+static int paging_map_direct(u64* pml4, u64 size, const Memory* memory, int huge)
+{
+    u64* pdpt = NULL;
+    for (u64 address = 0; address < size; address += PAGING_1G)
+    {
+        u64 pml4_index = 256 + (address >> 39);
+        if (pml4_index >= 511)
+            return 0;   // Past 255 TiB, into the kernel image's entry.
+
+        if ((address & ((1ull << 39) - 1)) == 0)
+        {
+            if (!(pdpt = paging_table()))
+                return 0;
+            pml4[pml4_index] = (u64) pdpt | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+
+        u64* pdpte = &pdpt[(address >> 30) & 511];
+        PagingKind kind = huge ? paging_kind(memory, address, address + PAGING_1G) : PAGING_MIXED;
+        if (kind != PAGING_MIXED)
+        {
+            *pdpte = paging_leaf(address, kind) | PAGE_LARGE;
+            g_paging.pages_1g += 1;
+            continue;
+        }
+
+        u64* pd = paging_table();
+        if (!pd)
+            return 0;
+        for (u64 i = 0; i < 512; ++i)
+            if (!paging_map_2m(&pd[i], address + i * PAGING_2M, memory))
+                return 0;
+        *pdpte = (u64) pd | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+
+    return 1;
+}
+
+
+static int paging_map_kernel(u64* pml4)
+{
+    u64 begin = paging_physical(__kernel_start) & ~(PAGING_2M - 1);
+    u64 end   = (paging_physical(__kernel_end) + PAGING_2M - 1) & ~(PAGING_2M - 1);
+
+    // The kernel model puts the whole image in the top 2 GiB; it fits in
+    // the last PDPT, starting at its second-to-last entry.
+    u64* pdpt = paging_table();
+    u64* pd   = paging_table();
+    if (!pdpt || !pd || end > PAGING_1G)
+        return 0;
+
+    for (u64 address = begin; address < end; address += PAGING_2M)
+    {
+        pd[address >> 21] = address | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE | PAGE_GLOBAL;
+        g_paging.pages_2m += 1;
+    }
+
+    pdpt[(KERNEL_VIRTUAL_BASE >> 30) & 511] = (u64) pd | PAGE_PRESENT | PAGE_WRITABLE;
+    pml4[(KERNEL_VIRTUAL_BASE >> 39) & 511] = (u64) pdpt | PAGE_PRESENT | PAGE_WRITABLE;
+    return 1;
+}
+
+
+// Build the kernel's page tables and switch to them. Needs the page
+// allocator. Returns 0, and leaves the bootloader's tables active, if it
+// runs out of memory.
+int paging_init(const Context* context)
+{
+    g_paging = (Paging) { 0 };
+
+    u64* pml4 = paging_table();
+    if (!pml4)
+        return 0;
+
+    int huge = cpu_has(CPU_FEATURE_PAGE_1G);
+
+    g_paging.direct_map_size = paging_physical_end(context);
+    if (!paging_map_direct(pml4, g_paging.direct_map_size, &context->memory, huge) || !paging_map_kernel(pml4))
+        return 0;
+
+    // The identity alias. pml4[511] belongs to the kernel image.
+    for (u64 i = 0; i < 255; ++i)
+        pml4[i] = pml4[256 + i];
+
+    g_paging.pml4 = (u64) pml4;
+    write_cr3(g_paging.pml4);
+    return 1;
+}
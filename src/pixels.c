@@ -0,0 +1,341 @@
+// 2D pixel operations: fill, rect fill, rect copy and scroll.
+//
+// Everything is built on four span primitives, with a scalar, an SSE2 and an
+// AVX2 implementation. `pixels_init` picks the widest one the CPU (and the
+// enabled XSAVE state) allows. Streaming variants use non-temporal stores;
+// they're used for the framebuffer and for anything too big to be worth
+// keeping in the cache.
+#include "bootloader.h"
+#include "types.h"
+
+
+// Writes larger than this bypass the cache even when the target is RAM.
+#define PIXELS_STREAM_THRESHOLD (512 * 1024)
+
+
+typedef u32       PixelBits __attribute__((may_alias));
+typedef long long Vector128 __attribute__((vector_size(16)));
+typedef long long Vector256 __attribute__((vector_size(32)));
+typedef long long UnalignedVector128 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef long long UnalignedVector256 __attribute__((vector_size(32), aligned(1), may_alias));
+
+
+typedef struct PixelSurface
+{
+    Pixel* pixels;
+    u32    width;
+    u32    height;
+    u32    pitch;      // In pixels.
+    int    uncached;   // Write-only memory (VRAM); always use streaming stores.
+} PixelSurface;
+
+typedef struct PixelOps
+{
+    const char* name;
+    void (*fill_span)(Pixel* destination, Pixel pixel, u32 count);
+    void (*copy_span)(Pixel* destination, const Pixel* source, u32 count);
+    void (*stream_fill_span)(Pixel* destination, Pixel pixel, u32 count);
+    void (*stream_copy_span)(Pixel* destination, const Pixel* source, u32 count);
+} PixelOps;
+
+
+static inline u32 pixel_bits(Pixel pixel)
+{
+    return (u32) pixel.blue | ((u32) pixel.green << 8) | ((u32) pixel.red << 16) | ((u32) pixel.alpha << 24);
+}
+
+
+// ---- Scalar ----
+
+static void scalar_fill_span(Pixel* destination, Pixel pixel, u32 count)
+{
+    PixelBits* target = (PixelBits *) destination;
+    u32        bits   = pixel_bits(pixel);
+    while (count--)
+        *target++ = bits;
+}
+
+static void scalar_copy_span(Pixel* destination, const Pixel* source, u32 count)
+{
+    PixelBits*       target = (PixelBits *) destination;
+    const PixelBits* origin = (const PixelBits *) source;
+    while (count--)
+        *target++ = *origin++;
+}
+
+static const PixelOps PIXEL_OPS_SCALAR = {
+    .name             = "scalar",
+    .fill_span        = scalar_fill_span,
+    .copy_span        = scalar_copy_span,
+    .stream_fill_span = scalar_fill_span,
+    .stream_copy_span = scalar_copy_span,
+};
+
+
+// ---- SSE2 (always present on x86-64) ----
+
+static void sse2_fill_span(Pixel* destination, Pixel pixel, u32 count)
+{
+    PixelBits* target = (PixelBits *) destination;
+    u32        bits   = pixel_bits(pixel);
+
+    for (; count && ((u64) target & 15); --count)
+        *target++ = bits;
+
+    long long wide   = ((long long) bits << 32) | bits;
+    Vector128 vector = { wide, wide };
+    for (; count >= 4; count -= 4, target += 4)
+        *(Vector128 *) target = vector;
+
+    while (count--)
+        *target++ = bits;
+}
+
+static void sse2_copy_span(Pixel* destination, const Pixel* source, u32 count)
+{
+    PixelBits*       target = (PixelBits *) destination;
+    const PixelBits* origin = (const PixelBits *) source;
+
+    for (; count >= 4; count -= 4, target += 4, origin += 4)
+        *(UnalignedVector128 *) target = *(const UnalignedVector128 *) origin;
+
+    while (count--)
+        *target++ = *origin++;
+}
+
+static void sse2_stream_fill_span(Pixel* destination, Pixel pixel, u32 count)
+{
+    PixelBits* target = (PixelBits *) destination;
+    u32        bits   = pixel_bits(pixel);
+
+    for (; count && ((u64) target & 15); --count)
+        *target++ = bits;
+
+    long long wide   = ((long long) bits << 32) | bits;
+    Vector128 vector = { wide, wide };
+    for (; count >= 4; count -= 4, target += 4)
+        __builtin_ia32_movntdq((Vector128 *) target, vector);
+
+    while (count--)
+        *target++ = bits;
+}
+
+static void sse2_stream_copy_span(Pixel* destination, const Pixel* source, u32 count)
+{
+    PixelBits*       target = (PixelBits *) destination;
+    const PixelBits* origin = (const PixelBits *) source;
+
+    for (; count && ((u64) target & 15); --count)
+        *target++ = *origin++;
+
+    for (; count >= 4; count -= 4, target += 4, origin += 4)
+        __builtin_ia32_movntdq((Vector128 *) target, *(const UnalignedVector128 *) origin);
+
+    while (count--)
+        *target++ = *origin++;
+}
+
+static const PixelOps PIXEL_OPS_SSE2 = {
+    .name             = "SSE2",
+    .fill_span        = sse2_fill_span,
+    .copy_span        = sse2_copy_span,
+    .stream_fill_span = sse2_stream_fill_span,
+    .stream_copy_span = sse2_stream_copy_span,
+};
+
+
+// ---- AVX2 ----
+
+__attribute__((target("avx2")))
+static void avx2_fill_span(Pixel* destination, Pixel pixel, u32 count)
+{
+    PixelBits* target = (PixelBits *) destination;
+    u32        bits   = pixel_bits(pixel);
+
+    for (; count && ((u64) target & 31); --count)
+        *target++ = bits;
+
+    long long wide   = ((long long) bits << 32) | bits;
+    Vector256 vector = { wide, wide, wide, wide };
+    for (; count >= 8; count -= 8, target += 8)
+        *(Vector256 *) target = vector;
+
+    while (count--)
+        *target++ = bits;
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_span(Pixel* destination, const Pixel* source, u32 count)
+{
+    PixelBits*       target = (PixelBits *) destination;
+    const PixelBits* origin = (const PixelBits *) source;
+
+    for (; count >= 8; count -= 8, target += 8, origin += 8)
+        *(UnalignedVector256 *) target = *(const UnalignedVector256 *) origin;
+
+    while (count--)
+        *target++ = *origin++;
+}
+
+__attribute__((target("avx2")))
+static void avx2_stream_fill_span(Pixel* destination, Pixel pixel, u32 count)
+{
+    PixelBits* target = (PixelBits *) destination;
+    u32        bits   = pixel_bits(pixel);
+
+    for (; count && ((u64) target & 31); --count)
+        *target++ = bits;
+
+    long long wide   = ((long long) bits << 32) | bits;
+    Vector256 vector = { wide, wide, wide, wide };
+    for (; count >= 8; count -= 8, target += 8)
+        __builtin_ia32_movntdq256((Vector256 *) target, vector);
+
+    while (count--)
+        *target++ = bits;
+}
+
+__attribute__((target("avx2")))
+static void avx2_stream_copy_span(Pixel* destination, const Pixel* source, u32 count)
+{
+    PixelBits*       target = (PixelBits *) destination;
+    const PixelBits* origin = (const PixelBits *) source;
+
+    for (; count && ((u64) target & 31); --count)
+        *target++ = *origin++;
+
+    for (; count >= 8; count -= 8, target += 8, origin += 8)
+        __builtin_ia32_movntdq256((Vector256 *) target, *(const UnalignedVector256 *) origin);
+
+    while (count--)
+        *target++ = *origin++;
+}
+
+static const PixelOps PIXEL_OPS_AVX2 = {
+    .name             = "AVX2",
+    .fill_span        = avx2_fill_span,
+    .copy_span        = avx2_copy_span,
+    .stream_fill_span = avx2_stream_fill_span,
+    .stream_copy_span = avx2_stream_copy_span,
+};
+
+
+PixelOps g_pixel_ops = {
+    .name             = "scalar",
+    .fill_span        = scalar_fill_span,
+    .copy_span        = scalar_copy_span,
+    .stream_fill_span = scalar_fill_span,
+    .stream_copy_span = scalar_copy_span,
+};
+
+
+void pixels_init()
+{
+    if (cpu_has(CPU_FEATURE_AVX2))
+        g_pixel_ops = PIXEL_OPS_AVX2;
+    else if (cpu_has(CPU_FEATURE_SSE2))
+        g_pixel_ops = PIXEL_OPS_SSE2;
+    else
+        g_pixel_ops = PIXEL_OPS_SCALAR;
+}
+
+
+static inline Pixel* pixels_at(const PixelSurface* surface, u32 x, u32 y)
+{
+    return surface->pixels + (u64) surface->pitch * y + x;
+}
+
+static inline int pixels_should_stream(const PixelSurface* surface, u32 w, u32 h)
+{
+    return surface->uncached || (u64) w * h * sizeof(Pixel) > PIXELS_STREAM_THRESHOLD;
+}
+
+// Non-temporal stores are weakly ordered; fence before anyone else looks.
+static inline void pixels_fence()
+{
+    __builtin_ia32_sfence();
+}
+
+
+// Clip a rectangle to the surface. Returns 0 if nothing is left.
+static int pixels_clip(const PixelSurface* surface, int* x, int* y, int* w, int* h)
+{
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > (int) surface->width)  *w = (int) surface->width  - *x;
+    if (*y + *h > (int) surface->height) *h = (int) surface->height - *y;
+    return *w > 0 && *h > 0;
+}
+
+
+void pixels_fill_rect(PixelSurface* surface, int x, int y, int w, int h, Pixel pixel)
+{
+    if (!pixels_clip(surface, &x, &y, &w, &h))
+        return;
+
+    if (pixels_should_stream(surface, w, h))
+    {
+        if (surface->pitch == (u32) w)
+            g_pixel_ops.stream_fill_span(pixels_at(surface, x, y), pixel, (u32) w * h);
+        else
+            for (int row = y; row < y + h; ++row)
+                g_pixel_ops.stream_fill_span(pixels_at(surface, x, row), pixel, w);
+        pixels_fence();
+    }
+    else
+    {
+        for (int row = y; row < y + h; ++row)
+            g_pixel_ops.fill_span(pixels_at(surface, x, row), pixel, w);
+    }
+}
+
+
+void pixels_fill(PixelSurface* surface, Pixel pixel)
+{
+    pixels_fill_rect(surface, 0, 0, surface->width, surface->height, pixel);
+}
+
+
+// Copy a w*h rectangle between surfaces (or within one, as long as each
+// destination row lies above its source row, like when scrolling up).
+void pixels_copy_rect(
+    PixelSurface* destination, int dx, int dy,
+    const PixelSurface* source, int sx, int sy,
+    int w, int h
+)
+{
+    if (sx < 0) { dx -= sx; w += sx; sx = 0; }
+    if (sy < 0) { dy -= sy; h += sy; sy = 0; }
+    if (sx + w > (int) source->width)  w = (int) source->width  - sx;
+    if (sy + h > (int) source->height) h = (int) source->height - sy;
+
+    int x = dx, y = dy, cw = w, ch = h;
+    if (!pixels_clip(destination, &x, &y, &cw, &ch))
+        return;
+    sx += x - dx;
+    sy += y - dy;
+
+    if (pixels_should_stream(destination, cw, ch))
+    {
+        for (int row = 0; row < ch; ++row)
+            g_pixel_ops.stream_copy_span(pixels_at(destination, x, y + row), pixels_at(source, sx, sy + row), cw);
+        pixels_fence();
+    }
+    else
+    {
+        for (int row = 0; row < ch; ++row)
+            g_pixel_ops.copy_span(pixels_at(destination, x, y + row), pixels_at(source, sx, sy + row), cw);
+    }
+}
+
+
+// Move the surface contents up by `lines` rows and clear the bottom.
+void pixels_scroll(PixelSurface* surface, int lines, Pixel background)
+{
+    int height = (int) surface->height;
+    if (lines > height)
+        lines = height;
+
+    pixels_copy_rect(surface, 0, 0, surface, 0, lines, surface->width, height - lines);
+    pixels_fill_rect(surface, 0, height - lines, surface->width, lines, background);
+}
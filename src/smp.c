@@ -0,0 +1,496 @@
+// Starting the application processors, and per-CPU data.
+//
+// The CPUs come from the MADT (acpi.c). Each AP is started with INIT-SIPI-
+// SIPI into a trampoline copied below 1 MiB: real mode, straight into long
+// mode on a copy of the kernel's PML4 (CR3 has to be below 4 GiB at that
+// point), then a jump to `smp_ap_entry` in the kernel image. All APs are
+// started at once; each one takes a ticket for its stack, finds its PerCpu
+// by APIC ID and comes up on its own GDT, TSS, GS base and APIC timer.
+//
+// %gs:0 points at the CPU's own PerCpu (`this_cpu`).
+//
+// Idle APs look for work from the idle hook (the task scheduler, tasks.c),
+// then sleep: `mwait` on the wake epoch when the CPU has it, `hlt`
+// otherwise. `smp_wake` bumps the epoch, and with `hlt` sends an IPI, but
+// only if someone is asleep. `smp_run_all` runs a function on every online
+// CPU and returns once all of them are done.
+//
+// The PAT is copied from the bootstrap processor so the write-combining
+// framebuffer mapping means the same everywhere. MTRRs aren't; the MTRR
+// fallback in write_combining.c only covers CPUs without a PAT.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define SMP_MAX_CPUS         ACPI_MAX_CPUS
+#define SMP_WAKE_VECTOR      0xF0
+#define SMP_STACK_ORDER      4                  // 64 KiB, like KERNEL_STACK_SIZE.
+#define SMP_LOW_MEMORY       0x100000ull        // SIPI vectors only reach the first MiB.
+#define SMP_INIT_WAIT_NS     10000000ull
+#define SMP_STARTUP_WAIT_NS  200000ull
+#define SMP_ONLINE_WAIT_NS   100000000ull
+
+#define MSR_GS_BASE          0xC0000101
+#define MSR_KERNEL_GS_BASE   0xC0000102
+
+#define SMP_CACHE_LINE       64
+
+#define SMP_TRAMPOLINE_OFFSET(symbol) ((u64) (symbol) - (u64) smp_trampoline)
+
+
+typedef struct PerCpu PerCpu;
+typedef void (*SmpWork)(PerCpu* cpu, void* user);
+typedef int  (*SmpIdleWork)(PerCpu* cpu);   // Returns 0 if there was nothing to do.
+
+struct PerCpu
+{
+    PerCpu*    self;            // At %gs:0.
+    u32        index;           // In g_cpus; the bootstrap processor is 0.
+    u32        apic_id;
+    u64        stack_top;
+    CpuTables* tables;
+    u32        online;
+    u32        work_generation; // Of the last `smp_run_all` this CPU ran.
+    u64        work_items;
+};
+
+// Sense-reversing barrier; reusable as soon as everyone has left.
+typedef struct SmpBarrier
+{
+    volatile u32 arrived;
+    volatile u32 generation;
+} SmpBarrier;
+
+typedef struct Smp
+{
+    u32 count;                  // CPUs in g_cpus.
+    u32 online;
+    u32 closed;                 // Startup is over; late APs stay halted.
+    Spinlock startup_lock;      // Over `online` and `closed` during startup.
+    u64 trampoline;             // Physical address, 0 if there's no low memory.
+    u64 pat;
+    u64 tick_ns;
+    u64 startup_ns;
+
+    SmpWork      work;
+    void*        work_user;
+    volatile u32 work_generation;
+    SmpBarrier   work_done;
+
+    SmpIdleWork  idle_work;
+    int          use_mwait;
+    u64          wakes;         // `smp_wake` calls that found a sleeper.
+
+    // Written by every CPU going to sleep and every wake; kept away from
+    // the read-mostly fields above.
+    volatile u32 sleepers     __attribute__((aligned(SMP_CACHE_LINE)));
+    volatile u32 wake_epoch   __attribute__((aligned(SMP_CACHE_LINE)));
+} Smp;
+
+
+PerCpu g_cpus[SMP_MAX_CPUS];
+Smp    g_smp;
+
+// Read by `smp_ap_entry`: one stack per AP, handed out by ticket.
+u64          g_smp_stacks[SMP_MAX_CPUS];
+u32          g_smp_stack_count;
+volatile u32 g_smp_tickets;
+
+extern u8 smp_trampoline[];
+extern u8 smp_trampoline_64[];
+extern u8 smp_trampoline_gdt[];
+extern u8 smp_trampoline_gdtr[];
+extern u8 smp_trampoline_jump[];
+extern u8 smp_trampoline_cr3[];
+extern u8 smp_trampoline_end[];
+
+
+__asm__(
+    ".pushsection .text\n"
+
+    // Copied to a page below 1 MiB and entered in real mode at offset 0,
+    // with CS set to the page. Addresses are relative to the copy; the
+    // absolute ones (GDT base, far jump) are filled in by `smp_init`.
+    ".balign 16\n"
+    ".global smp_trampoline\n"
+    "smp_trampoline:\n"
+    ".code16\n"
+    "    cli\n"
+    "    cld\n"
+    "    mov %cs, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov $0x6A0, %eax\n"                                        // PAE, PGE, OSFXSR, OSXMMEXCPT.
+    "    mov %eax, %cr4\n"
+    "    mov smp_trampoline_cr3 - smp_trampoline, %eax\n"
+    "    mov %eax, %cr3\n"
+    "    mov $0xC0000080, %ecx\n"                                   // EFER.LME
+    "    rdmsr\n"
+    "    or $0x100, %eax\n"
+    "    wrmsr\n"
+    "    lgdtl smp_trampoline_gdtr - smp_trampoline\n"
+    "    mov $0x80000011, %eax\n"                                   // PG, ET, PE.
+    "    mov %eax, %cr0\n"
+    "    ljmpl *(smp_trampoline_jump - smp_trampoline)\n"
+
+    ".code64\n"
+    ".global smp_trampoline_64\n"
+    "smp_trampoline_64:\n"
+    "    movabs $smp_ap_entry, %rax\n"
+    "    jmp *%rax\n"
+
+    ".balign 8\n"
+    ".global smp_trampoline_gdt\n"
+    "smp_trampoline_gdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00AF9A000000FFFF\n"                                 // Same selectors as GDT_KERNEL_CODE/DATA.
+    "    .quad 0x00CF92000000FFFF\n"
+    ".global smp_trampoline_gdtr\n"
+    "smp_trampoline_gdtr:\n"
+    "    .word 23\n"
+    "    .long 0\n"
+    ".global smp_trampoline_jump\n"
+    "smp_trampoline_jump:\n"
+    "    .long 0\n"
+    "    .word 0x08\n"
+    ".global smp_trampoline_cr3\n"
+    "smp_trampoline_cr3:\n"
+    "    .long 0\n"
+    ".global smp_trampoline_end\n"
+    "smp_trampoline_end:\n"
+
+    // In the kernel image, still on the trampoline's GDT and page tables.
+    "smp_ap_entry:\n"
+    "    mov $0x10, %eax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %ss\n"
+    "    mov $1, %eax\n"
+    "    lock xadd %eax, g_smp_tickets(%rip)\n"
+    "    cmp g_smp_stack_count(%rip), %eax\n"
+    "    jae 1f\n"
+    "    lea g_smp_stacks(%rip), %rcx\n"
+    "    mov (%rcx,%rax,8), %rsp\n"
+    "    mov %eax, %edi\n"
+    "    xor %ebp, %ebp\n"
+    "    call smp_ap_main\n"
+    "1:  cli\n"
+    "    hlt\n"
+    "    jmp 1b\n"
+
+    ".popsection\n"
+);
+
+
+static inline PerCpu* this_cpu()
+{
+    PerCpu* cpu;
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r" (cpu));
+    return cpu;
+}
+
+// For heap.c's per-CPU caches.
+static u32 smp_cpu_index()
+{
+    return this_cpu()->index;
+}
+
+
+void smp_barrier_wait(SmpBarrier* barrier, u32 participants)
+{
+    u32 generation = __atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&barrier->arrived, 1, __ATOMIC_ACQ_REL) == participants)
+    {
+        __atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->generation, generation + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE) == generation)
+        __asm__ __volatile__("pause");
+}
+
+
+// Wake the sleeping CPUs, if any. Call after publishing the work, which the
+// sleepers look for again after announcing themselves.
+void smp_wake()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&g_smp.sleepers, __ATOMIC_RELAXED))
+        return;
+
+    __atomic_add_fetch(&g_smp.wake_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&g_smp.wakes, 1, __ATOMIC_RELAXED);
+    if (!g_smp.use_mwait)
+        apic_send_ipi(0, APIC_IPI_ALL_BUT_SELF | APIC_IPI_ASSERT | APIC_IPI_FIXED | SMP_WAKE_VECTOR);
+}
+
+
+static int smp_run_all_pending(PerCpu* cpu)
+{
+    return __atomic_load_n(&g_smp.work_generation, __ATOMIC_ACQUIRE) != cpu->work_generation;
+}
+
+// Whether there's a `smp_run_all` to join, or the idle hook found (and ran)
+// something.
+static int smp_idle_found_work(PerCpu* cpu)
+{
+    return smp_run_all_pending(cpu) || (g_smp.idle_work && g_smp.idle_work(cpu));
+}
+
+// Sleep until the wake epoch moves on from `epoch` or an interrupt comes.
+// Interrupts are off between the check and the `mwait`/`hlt`, and come back
+// on with it, so neither the wake-up nor an interrupt can slip in between
+// and be missed.
+static void smp_sleep(u32 epoch)
+{
+    __asm__ __volatile__("cli" : : : "memory");
+    if (g_smp.use_mwait)
+        cpu_monitor(&g_smp.wake_epoch);
+
+    if (g_smp.wake_epoch != epoch)
+        interrupts_enable();
+    else if (g_smp.use_mwait)
+        interrupts_enable_and_mwait();
+    else
+        interrupts_enable_and_halt();
+}
+
+static void smp_idle(PerCpu* cpu)
+{
+    for (;;)
+    {
+        if (smp_run_all_pending(cpu))
+        {
+            cpu->work_generation = __atomic_load_n(&g_smp.work_generation, __ATOMIC_ACQUIRE);
+            g_smp.work(cpu, g_smp.work_user);
+            cpu->work_items += 1;
+            smp_barrier_wait(&g_smp.work_done, g_smp.online);
+            continue;
+        }
+        if (g_smp.idle_work && g_smp.idle_work(cpu))
+            continue;
+
+        // Announce, then look once more: a waker that didn't see us had
+        // published its work before we looked.
+        __atomic_add_fetch(&g_smp.sleepers, 1, __ATOMIC_SEQ_CST);
+        u32 epoch = __atomic_load_n(&g_smp.wake_epoch, __ATOMIC_SEQ_CST);
+        if (!smp_idle_found_work(cpu))
+            smp_sleep(epoch);
+        __atomic_sub_fetch(&g_smp.sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void smp_wake_interrupt(InterruptFrame* frame, void* user)
+{
+    (void) frame;
+    (void) user;
+}
+
+
+// Run `work` on every online CPU, this one included, and wait for all of
+// them to finish. From the bootstrap processor only.
+void smp_run_all(SmpWork work, void* user)
+{
+    g_smp.work      = work;
+    g_smp.work_user = user;
+    u32 generation  = __atomic_add_fetch(&g_smp.work_generation, 1, __ATOMIC_RELEASE);
+    smp_wake();
+
+    PerCpu* cpu = this_cpu();
+    cpu->work_generation = generation;
+    work(cpu, user);
+    cpu->work_items += 1;
+    smp_barrier_wait(&g_smp.work_done, g_smp.online);
+}
+
+
+void smp_ap_main(u32 ticket)
+{
+    cpu_enable_simd_state();
+    write_cr3(g_paging.pml4);
+
+    if (cpu_has(CPU_FEATURE_PAT))
+    {
+        // SDM 11.12.4, as in write_combining.c.
+        write_back_invalidate();
+        write_msr(MSR_PAT, g_smp.pat);
+        write_back_invalidate();
+        write_cr3(read_cr3());
+    }
+
+    apic_init_cpu();
+    u32 id = apic_id();
+
+    PerCpu* cpu = NULL;
+    for (u32 i = 1; i < g_smp.count; ++i)
+        if (g_cpus[i].apic_id == id)
+            cpu = &g_cpus[i];
+    if (!cpu)
+        return;
+
+    cpu->stack_top = g_smp_stacks[ticket];
+    cpu_tables_load(cpu->tables);
+    write_msr(MSR_GS_BASE, (u64) cpu);
+    write_msr(MSR_KERNEL_GS_BASE, (u64) cpu);
+
+    if (g_apic.timer_hz)
+        apic_timer_periodic(g_smp.tick_ns);
+
+    cpu->work_generation = __atomic_load_n(&g_smp.work_generation, __ATOMIC_ACQUIRE);
+
+    // Past the timeout, `smp_run_all` already counts on the CPUs it has.
+    spin_lock(&g_smp.startup_lock);
+    int late = g_smp.closed;
+    if (!late)
+    {
+        __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&g_smp.online, 1, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&g_smp.startup_lock);
+
+    if (late)
+    {
+        apic_timer_stop();
+        return;
+    }
+
+    // The trampoline came in with interrupts off.
+    interrupts_enable();
+    smp_idle(cpu);
+}
+
+
+// Two pages below 1 MiB (past the real-mode IVT) that nothing else uses:
+// free memory, or boot services memory, which is ours now and which the
+// page allocator doesn't manage down there.
+static u64 smp_find_trampoline(const Memory* memory)
+{
+    u64 entries = memory->MemoryMapSize / memory->DescriptorSize;
+    for (u64 i = 0; i < entries; ++i)
+    {
+        const EFI_MEMORY_DESCRIPTOR* descriptor = (const EFI_MEMORY_DESCRIPTOR *)
+            ((const u8 *) memory->MemoryMap + i * memory->DescriptorSize);
+        if (descriptor->Type != EfiConventionalMemory
+            && descriptor->Type != EfiBootServicesCode
+            && descriptor->Type != EfiBootServicesData)
+            continue;
+
+        u64 begin = descriptor->PhysicalStart;
+        u64 end   = begin + descriptor->NumberOfPages * PAGE_SIZE;
+        if (begin < PAGE_SIZE)
+            begin = PAGE_SIZE;
+        if (end > SMP_LOW_MEMORY)
+            end = SMP_LOW_MEMORY;
+        if (begin + 2 * PAGE_SIZE <= end)
+            return begin;
+    }
+    return 0;
+}
+
+// Copy the trampoline and a PML4 for it to `base`.
+static void smp_install_trampoline(u64 base)
+{
+    u8* code = (u8 *) base;
+    memcpy(code, smp_trampoline, smp_trampoline_end - smp_trampoline);
+
+    u64 pml4 = base + PAGE_SIZE;
+    memcpy((void *) pml4, (const void *) g_paging.pml4, PAGE_SIZE);
+
+    u32 gdt   = (u32) (base + SMP_TRAMPOLINE_OFFSET(smp_trampoline_gdt));
+    u32 entry = (u32) (base + SMP_TRAMPOLINE_OFFSET(smp_trampoline_64));
+    u32 cr3   = (u32) pml4;
+    memcpy(code + SMP_TRAMPOLINE_OFFSET(smp_trampoline_gdtr) + 2, &gdt,   4);
+    memcpy(code + SMP_TRAMPOLINE_OFFSET(smp_trampoline_jump),     &entry, 4);
+    memcpy(code + SMP_TRAMPOLINE_OFFSET(smp_trampoline_cr3),      &cr3,   4);
+}
+
+
+// Give an AP from the MADT its PerCpu, tables and stack. Returns 0 if it
+// can't be used or there's no memory.
+static int smp_prepare_cpu(u32 apic_id)
+{
+    if (!g_apic.x2apic && apic_id > 0xFF)
+        return 0;   // Not addressable in xAPIC mode.
+
+    PerCpu*    cpu    = &g_cpus[g_smp.count];
+    CpuTables* tables = arena_alloc(sizeof(CpuTables), 16);
+    u64        stack  = page_alloc_order(SMP_STACK_ORDER);
+    if (!tables || !stack || !cpu_tables_init(tables))
+        return 0;
+
+    *cpu = (PerCpu) {
+        .self    = cpu,
+        .index   = g_smp.count,
+        .apic_id = apic_id,
+        .tables  = tables,
+    };
+    g_smp_stacks[g_smp_stack_count++] = stack + (PAGE_SIZE << SMP_STACK_ORDER);
+    g_smp.count += 1;
+    return 1;
+}
+
+
+static void smp_send_to_new(u32 command)
+{
+    for (u32 i = 1; i < g_smp.count; ++i)
+        if (!__atomic_load_n(&g_cpus[i].online, __ATOMIC_ACQUIRE))
+            apic_send_ipi(g_cpus[i].apic_id, command);
+}
+
+
+// Set up the bootstrap processor's PerCpu and start every other CPU in the
+// MADT, each with a periodic timer every `tick_ns`. Without the local APIC
+// or the kernel's page tables, only the first part. Needs the IDT. Returns
+// the number of CPUs online.
+u32 smp_init(const Context* context, CpuTables* boot_tables, u64 tick_ns)
+{
+    g_smp = (Smp) { .count=1, .online=1, .tick_ns=tick_ns };
+
+    PerCpu* boot = &g_cpus[0];
+    *boot = (PerCpu) {
+        .self    = boot,
+        .apic_id = g_apic.version ? apic_id() : 0,
+        .tables  = boot_tables,
+        .online  = 1,
+    };
+    write_msr(MSR_GS_BASE, (u64) boot);
+    write_msr(MSR_KERNEL_GS_BASE, (u64) boot);
+    g_heap_cpu_index = smp_cpu_index;   // Every CPU sets GS before it can allocate.
+
+    if (!g_apic.version || !g_paging.pml4 || !acpi_init(context->rsdp))
+        return 1;
+    if (!(g_smp.trampoline = smp_find_trampoline(&context->memory)))
+        return 1;
+
+    for (u32 i = 0; i < g_acpi.cpu_count; ++i)
+        if (g_acpi.apic_ids[i] != boot->apic_id && !smp_prepare_cpu(g_acpi.apic_ids[i]))
+            break;
+    if (g_smp.count == 1)
+        return 1;
+
+    if (cpu_has(CPU_FEATURE_PAT))
+        g_smp.pat = read_msr(MSR_PAT);
+    g_smp.use_mwait = cpu_has(CPU_FEATURE_MONITOR);
+    interrupt_register(SMP_WAKE_VECTOR, smp_wake_interrupt, NULL);
+    smp_install_trampoline(g_smp.trampoline);
+
+    // The second SIPI is only for CPUs that missed the first.
+    u64 start = now_ns();
+    u32 startup = APIC_IPI_STARTUP | APIC_IPI_ASSERT | (u32) (g_smp.trampoline >> 12);
+    smp_send_to_new(APIC_IPI_INIT | APIC_IPI_ASSERT);
+    sleep_ns(SMP_INIT_WAIT_NS);
+    smp_send_to_new(startup);
+    sleep_ns(SMP_STARTUP_WAIT_NS);
+    smp_send_to_new(startup);
+
+    u64 deadline = now_ns() + SMP_ONLINE_WAIT_NS;
+    while (__atomic_load_n(&g_smp.online, __ATOMIC_ACQUIRE) < g_smp.count && now_ns() < deadline)
+        __asm__ __volatile__("pause");
+
+    spin_lock(&g_smp.startup_lock);
+    g_smp.closed = 1;
+    spin_unlock(&g_smp.startup_lock);
+
+    g_smp.startup_ns = now_ns() - start;
+    return g_smp.online;
+}
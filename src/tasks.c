@@ -0,0 +1,278 @@
+// Kernel tasks: fork-join across all CPUs with work stealing.
+//
+// Every CPU has a Chase-Lev deque of Task pointers. `task_spawn` pushes on
+// the bottom of the current CPU's deque; `task_join` pops from the bottom
+// (the newest task, whose data is likely still in cache) until the task
+// it's waiting for is done. CPUs with nothing to do steal from the top of
+// a random CPU's deque, where the oldest and usually largest pieces of
+// work are. Only the owner touches the bottom, so spawning and popping are
+// a few plain stores; only stealing (and popping the last task) needs a
+// compare-and-swap.
+//
+// Tasks run to completion on the stack of whichever CPU picks them up;
+// there's no context switch. A task must not wait for anything but the
+// tasks it spawned. The spawner owns the Task, typically on its stack, so
+// spawning doesn't allocate.
+//
+// Idle APs steal through smp.c's idle hook and sleep (`mwait`/`hlt`)
+// when there's nothing to steal; `task_spawn` wakes them. Threads (see
+// threads.c) may spawn and join too; the deque operations run with
+// preemption off, so a thread can't be switched out, or moved to another
+// CPU, halfway through working on the bottom of a deque it no longer owns.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define TASK_QUEUE_CAPACITY 1024    // Per CPU. A spawn past that runs the task right away.
+#define TASK_QUEUE_MASK     (TASK_QUEUE_CAPACITY - 1)
+#define TASK_STEAL_ROUNDS   2       // Random victims tried per idle CPU, per online CPU.
+
+
+typedef void (*TaskFunction)(void* argument);
+typedef void (*TaskRangeFunction)(u64 begin, u64 end, void* argument);
+
+typedef struct Task
+{
+    TaskFunction function;
+    void*        argument;
+    volatile u32 done;
+} Task;
+
+// `top` is written by thieves, `bottom` and the counters by the owner.
+typedef struct TaskQueue
+{
+    volatile i64 top            __attribute__((aligned(SMP_CACHE_LINE)));
+    volatile i64 bottom         __attribute__((aligned(SMP_CACHE_LINE)));
+    Task**       slots;
+    u64          random;        // xorshift64 state for picking victims.
+    u64          spawned;
+    u64          stolen;        // Tasks this CPU took from others.
+    u64          overflowed;    // Spawns run inline because the deque was full.
+} TaskQueue;
+
+typedef struct TaskRange
+{
+    TaskRangeFunction function;
+    void*             argument;
+    u64               begin;
+    u64               end;
+    u64               grain;
+} TaskRange;
+
+typedef struct Tasks
+{
+    TaskQueue* queues;          // One per entry in g_cpus.
+    u32        count;
+} Tasks;
+
+
+Tasks g_tasks;
+
+
+static inline void task_run(Task* task)
+{
+    task->function(task->argument);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+
+// Owner only.
+static Task* task_take(TaskQueue* queue)
+{
+    i64 bottom = queue->bottom - 1;
+    __atomic_store_n(&queue->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 top = __atomic_load_n(&queue->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Task* task = __atomic_load_n(&queue->slots[bottom & TASK_QUEUE_MASK], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        // The last task: race the thieves for it.
+        if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any CPU. NULL if the deque is empty or another CPU got there first.
+static Task* task_steal_from(TaskQueue* queue)
+{
+    i64 top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+        return NULL;
+
+    Task* task = __atomic_load_n(&queue->slots[top & TASK_QUEUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+// Try one random CPU other than `self`. NULL if there's no other CPU.
+static Task* task_steal(u32 self)
+{
+    if (g_tasks.count < 2)
+        return NULL;
+
+    TaskQueue* queue = &g_tasks.queues[self];
+    queue->random ^= queue->random << 13;
+    queue->random ^= queue->random >> 7;
+    queue->random ^= queue->random << 17;
+
+    u32 victim = (u32) (queue->random % (g_tasks.count - 1));
+    if (victim >= self)
+        victim += 1;
+
+    Task* task = task_steal_from(&g_tasks.queues[victim]);
+    if (task)
+        queue->stolen += 1;
+    return task;
+}
+
+
+// smp.c's idle hook.
+static int task_idle_work(PerCpu* cpu)
+{
+    if (g_tasks.count < 2)
+        return 0;   // Spawns ran on the spot; there's nothing queued.
+
+    Task* task = task_take(&g_tasks.queues[cpu->index]);
+    for (u32 i = 0; !task && i < TASK_STEAL_ROUNDS * g_smp.online; ++i)
+        task = task_steal(cpu->index);
+    if (!task)
+        return 0;
+
+    task_run(task);
+    return 1;
+}
+
+
+// Set up a deque for every CPU in g_cpus and let idle CPUs steal. Needs
+// `smp_init`. Returns 0 if the arena is out of memory; spawned tasks then
+// just run on the spot.
+int tasks_init()
+{
+    g_tasks = (Tasks) { 0 };
+
+    TaskQueue* queues = arena_alloc(g_smp.count * sizeof(TaskQueue), SMP_CACHE_LINE);
+    if (!queues)
+        return 0;
+
+    for (u32 i = 0; i < g_smp.count; ++i)
+    {
+        queues[i] = (TaskQueue) { .random = 0x9E3779B97F4A7C15ull * (i + 1) ^ read_tsc() };
+        if (!(queues[i].slots = arena_alloc(TASK_QUEUE_CAPACITY * sizeof(Task *), SMP_CACHE_LINE)))
+            return 0;
+    }
+
+    g_tasks.queues = queues;
+    g_tasks.count  = g_smp.count;
+    if (g_tasks.count > 1)
+        __atomic_store_n(&g_smp.idle_work, task_idle_work, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+// Make `function(argument)` available to run on any CPU. `task` must stay
+// alive until `task_join` returns.
+void task_spawn(Task* task, TaskFunction function, void* argument)
+{
+    task->function = function;
+    task->argument = argument;
+    task->done     = 0;
+
+    if (g_tasks.count < 2)
+    {
+        task_run(task);
+        return;
+    }
+
+    u64 flags = preempt_disable();
+    TaskQueue* queue = &g_tasks.queues[this_cpu()->index];
+    i64 bottom = queue->bottom;
+    i64 top    = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_QUEUE_CAPACITY)
+    {
+        queue->overflowed += 1;
+        preempt_enable(flags);
+        task_run(task);
+        return;
+    }
+
+    __atomic_store_n(&queue->slots[bottom & TASK_QUEUE_MASK], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
+    queue->spawned += 1;
+    preempt_enable(flags);
+    smp_wake();
+}
+
+// Wait for `task`, running other tasks (this CPU's first) in the meantime.
+void task_join(Task* task)
+{
+    if (g_tasks.count < 2)
+        return;
+
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+    {
+        u64 flags = preempt_disable();
+        u32 self  = this_cpu()->index;
+        Task* other = task_take(&g_tasks.queues[self]);
+        if (!other)
+            other = task_steal(self);
+        preempt_enable(flags);
+
+        if (other)
+            task_run(other);
+        else
+            __asm__ __volatile__("pause");
+    }
+}
+
+
+static void task_range_run(void* argument)
+{
+    TaskRange* range = argument;
+    if (range->end - range->begin <= range->grain)
+    {
+        range->function(range->begin, range->end, range->argument);
+        return;
+    }
+
+    // Give away the upper half and keep splitting the lower one, so thieves
+    // get big pieces.
+    u64 middle = range->begin + (range->end - range->begin) / 2;
+    TaskRange upper = *range;
+    TaskRange lower = *range;
+    upper.begin = middle;
+    lower.end   = middle;
+
+    Task task;
+    task_spawn(&task, task_range_run, &upper);
+    task_range_run(&lower);
+    task_join(&task);
+}
+
+// Call `function` on pieces of [begin, end) no larger than `grain`, spread
+// over all CPUs, and return once every piece is done.
+void task_parallel_for(u64 begin, u64 end, u64 grain, TaskRangeFunction function, void* argument)
+{
+    if (begin >= end)
+        return;
+
+    TaskRange range = {
+        .function = function,
+        .argument = argument,
+        .begin    = begin,
+        .end      = end,
+        .grain    = grain ? grain : 1,
+    };
+    task_range_run(&range);
+}
@@ -0,0 +1,530 @@
+// Kernel threads: preemptive, with a run queue per CPU.
+//
+// A thread is a stack and the callee-saved registers `thread_switch` left
+// on it. Switching is an ordinary call: the compiler has already saved
+// everything else the caller needs. A thread switches out when it yields
+// or exits, or when the APIC timer finds it has used up its time slice;
+// then the switch happens at the end of the timer interrupt, and the
+// interrupted state stays in that interrupt's frame on the thread's stack
+// until it's switched back in and the interrupt returns.
+//
+// No FPU/SIMD registers are saved on a switch, eagerly or lazily. A
+// voluntary switch is a call, after which the SysV ABI only expects the
+// MXCSR and x87 control words to survive; those two go on the stack with
+// the other callee-saved registers. A preempted thread's whole XSAVE state
+// was already saved by the interrupt entry (see interrupts.c) and comes
+// back with the interrupt's return. So a thread using AVX costs nothing
+// extra to switch, and there's no CR0.TS trap: the interrupt entry's XSAVE
+// would take it on every interrupt, and leaving another thread's registers
+// live across a switch is how LazyFP leaked them.
+//
+// Every CPU has a FIFO run queue of ready threads behind a spinlock. A new
+// thread goes to the CPU with the least to do. The running thread is
+// preempted only for a thread in its own queue; an idle CPU (one running
+// smp.c's idle loop) also pulls the oldest thread from the longest queue
+// elsewhere. A thread pulled that way may still be on its old CPU, in the
+// middle of switching out, and is only switched in once `on_cpu` drops.
+//
+// Each CPU's own context from before threads (`smp_idle`, or `start` on the
+// bootstrap processor) is its idle thread: it never gets preempted, never
+// sits in a queue, and is what runs when a CPU has no threads left.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define THREAD_STACK_ORDER      4       // 64 KiB, like KERNEL_STACK_SIZE.
+#define THREAD_TIMESLICE_TICKS  2       // Timer ticks before a thread can be preempted.
+
+// What `thread_switch` restores first: the default MXCSR (exceptions
+// masked, round to nearest) and x87 control word.
+#define THREAD_INITIAL_FP_CONTROL (0x1F80ull | (0x037Full << 32))
+
+
+typedef void (*ThreadFunction)(void* argument);
+
+typedef enum ThreadState
+{
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_DEAD,
+} ThreadState;
+
+typedef struct Thread Thread;
+struct Thread
+{
+    u64            rsp;         // Saved by `thread_switch`; at offset 0.
+    volatile u32   on_cpu;      // Still running, or still switching out; at offset 8.
+    u32            id;
+    ThreadState    state;
+    u32            cpu;         // Index of the CPU it last ran on.
+    Thread*        next;        // In a run queue.
+    u64            stack;       // Base of THREAD_STACK_ORDER pages; 0 for idle threads.
+    ThreadFunction function;
+    void*          argument;
+    u64            ready_tsc;   // When it was last queued.
+    volatile u32   done;        // Its stack is free, and `thread_join` can free the rest.
+};
+
+// In TSC cycles.
+typedef struct ThreadLatency
+{
+    u64 count;
+    u64 total;
+    u64 min;
+    u64 max;
+} ThreadLatency;
+
+typedef struct ThreadCpu
+{
+    Spinlock      lock      __attribute__((aligned(SMP_CACHE_LINE)));
+    Thread*       head;
+    Thread*       tail;
+    volatile u32  length;
+
+    // The rest only this CPU touches, with interrupts off.
+    Thread*       current   __attribute__((aligned(SMP_CACHE_LINE)));
+    Thread*       previous;     // Switched out by the switch in progress.
+    Thread        idle;
+    u32           ticks;        // Of the current thread's time slice.
+    u64           switch_start;
+
+    u64           switches;
+    u64           preemptions;
+    u64           yields;
+    u64           migrations;   // Threads this CPU pulled from another queue.
+    ThreadLatency switch_latency;   // From picking the next thread to running it.
+    ThreadLatency wait_latency;     // From being queued to running.
+} ThreadCpu;
+
+typedef struct Threads
+{
+    ThreadCpu* cpus;            // One per entry in g_cpus.
+    u32        count;
+    u32        next_id;
+    u32        next_cpu;        // Where the search for the least loaded CPU starts.
+} Threads;
+
+typedef struct ThreadStats
+{
+    u64           switches;
+    u64           preemptions;
+    u64           yields;
+    u64           migrations;
+    ThreadLatency switch_latency;
+    ThreadLatency wait_latency;
+} ThreadStats;
+
+
+Threads g_threads;
+
+
+void thread_exit();
+
+// Save the callee-saved registers on `prev`'s stack, take `next`'s stack
+// and return into `next`. Interrupts must be off.
+void thread_switch(Thread* prev, Thread* next);
+
+__asm__(
+    ".pushsection .text\n"
+    ".global thread_switch\n"
+    "thread_switch:\n"
+    "    push %rbp\n"
+    "    push %rbx\n"
+    "    push %r12\n"
+    "    push %r13\n"
+    "    push %r14\n"
+    "    push %r15\n"
+    "    sub $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    mov %rsp, (%rdi)\n"
+    "    mov (%rsi), %rsp\n"
+
+    // Off `prev`'s stack: another CPU may take it now.
+    "    movl $0, 8(%rdi)\n"
+
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    add $8, %rsp\n"
+    "    pop %r15\n"
+    "    pop %r14\n"
+    "    pop %r13\n"
+    "    pop %r12\n"
+    "    pop %rbx\n"
+    "    pop %rbp\n"
+    "    ret\n"
+    ".popsection\n"
+);
+
+
+static inline ThreadCpu* thread_this_cpu()
+{
+    return &g_threads.cpus[this_cpu()->index];
+}
+
+static void thread_latency_add(ThreadLatency* latency, u64 cycles)
+{
+    latency->count += 1;
+    latency->total += cycles;
+    if (cycles < latency->min)
+        latency->min = cycles;
+    if (cycles > latency->max)
+        latency->max = cycles;
+}
+
+static void thread_latency_merge(ThreadLatency* into, const ThreadLatency* from)
+{
+    into->count += from->count;
+    into->total += from->total;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+
+static void thread_enqueue(ThreadCpu* queue, Thread* thread)
+{
+    thread->state     = THREAD_READY;
+    thread->next      = NULL;
+    thread->ready_tsc = read_tsc();
+
+    spin_lock(&queue->lock);
+    if (queue->tail)
+        queue->tail->next = thread;
+    else
+        queue->head = thread;
+    queue->tail = thread;
+    __atomic_store_n(&queue->length, queue->length + 1, __ATOMIC_RELAXED);
+    spin_unlock(&queue->lock);
+}
+
+static Thread* thread_dequeue(ThreadCpu* queue)
+{
+    if (!__atomic_load_n(&queue->length, __ATOMIC_RELAXED))
+        return NULL;
+
+    spin_lock(&queue->lock);
+    Thread* thread = queue->head;
+    if (thread)
+    {
+        queue->head = thread->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        __atomic_store_n(&queue->length, queue->length - 1, __ATOMIC_RELAXED);
+        thread->next = NULL;
+    }
+    spin_unlock(&queue->lock);
+    return thread;
+}
+
+// The oldest thread of the longest queue other than `self`'s, for an idle
+// CPU.
+static Thread* thread_pull(u32 self)
+{
+    u32 busiest = self;
+    u32 longest = 0;
+    for (u32 i = 0; i < g_threads.count; ++i)
+    {
+        u32 length = __atomic_load_n(&g_threads.cpus[i].length, __ATOMIC_RELAXED);
+        if (i != self && length > longest)
+        {
+            busiest = i;
+            longest = length;
+        }
+    }
+    if (!longest)
+        return NULL;
+
+    Thread* thread = thread_dequeue(&g_threads.cpus[busiest]);
+    if (thread)
+        g_threads.cpus[self].migrations += 1;
+    return thread;
+}
+
+// The online CPU with the fewest threads queued or running, starting the
+// search somewhere new each time so ties spread out.
+static ThreadCpu* thread_least_loaded()
+{
+    u32 start = __atomic_fetch_add(&g_threads.next_cpu, 1, __ATOMIC_RELAXED);
+    ThreadCpu* best = NULL;
+    u32 best_load  = 0;
+    for (u32 n = 0; n < g_threads.count; ++n)
+    {
+        u32 i = (start + n) % g_threads.count;
+        if (!__atomic_load_n(&g_cpus[i].online, __ATOMIC_ACQUIRE))
+            continue;
+
+        ThreadCpu* cpu = &g_threads.cpus[i];
+        u32 load = __atomic_load_n(&cpu->length, __ATOMIC_RELAXED)
+                 + (__atomic_load_n(&cpu->current, __ATOMIC_RELAXED) != &cpu->idle);
+        if (!best || load < best_load)
+        {
+            best      = cpu;
+            best_load = load;
+        }
+    }
+    return best ? best : &g_threads.cpus[0];
+}
+
+
+// Bookkeeping on the far side of a switch, in whichever context it switched
+// to. Interrupts are off.
+static void thread_switch_finish()
+{
+    ThreadCpu* cpu = thread_this_cpu();
+    thread_latency_add(&cpu->switch_latency, read_tsc() - cpu->switch_start);
+
+    // A thread can't free the stack it exits on; the next one does.
+    Thread* previous = cpu->previous;
+    cpu->previous = NULL;
+    if (previous && previous->state == THREAD_DEAD)
+    {
+        page_free(previous->stack);
+        previous->stack = 0;
+        __atomic_store_n(&previous->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Run `next` instead of the current thread. Returns when something switches
+// back, possibly on another CPU. Interrupts are off.
+static void thread_switch_to(ThreadCpu* cpu, Thread* next)
+{
+    // Pulled from another CPU that may not be off its stack yet.
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        __asm__ __volatile__("pause");
+
+    u64 now = read_tsc();
+    if (next != &cpu->idle)
+        thread_latency_add(&cpu->wait_latency, now - next->ready_tsc);
+
+    Thread* prev = cpu->current;
+    next->on_cpu = 1;
+    next->state  = THREAD_RUNNING;
+    next->cpu    = (u32) (cpu - g_threads.cpus);
+
+    cpu->current      = next;
+    cpu->previous     = prev;
+    cpu->ticks        = 0;
+    cpu->switches    += 1;
+    cpu->switch_start = now;
+    thread_switch(prev, next);
+    thread_switch_finish();
+}
+
+// Give the CPU to the next thread in this CPU's queue, if there is one. An
+// exiting thread gives it to the idle thread otherwise. Interrupts are off
+// and the current thread isn't the idle one.
+static void thread_reschedule(ThreadCpu* cpu, int preempted)
+{
+    Thread* current = cpu->current;
+    Thread* next    = thread_dequeue(cpu);
+    if (current->state == THREAD_DEAD)
+    {
+        if (!next)
+            next = &cpu->idle;
+    }
+    else
+    {
+        if (!next)
+            return;
+        if (preempted)
+            cpu->preemptions += 1;
+        else
+            cpu->yields += 1;
+        thread_enqueue(cpu, current);
+    }
+    thread_switch_to(cpu, next);
+}
+
+// From the idle thread: run queued threads, this CPU's or another's, until
+// they all leave it idle again. Returns 0 if there were none.
+static int thread_run_queued(u32 index)
+{
+    u64 flags = interrupts_disable();
+    ThreadCpu* cpu = &g_threads.cpus[index];
+    Thread* next   = thread_dequeue(cpu);
+    if (!next)
+        next = thread_pull(index);
+    if (next)
+        thread_switch_to(cpu, next);
+    interrupts_restore(flags);
+    return next != NULL;
+}
+
+
+// The end of every IRQ: preempt the current thread once its time slice is
+// up. The APIC has already had its end of interrupt, so the next tick can
+// come in on whatever runs next.
+//
+// This takes run-queue locks, and `thread_switch_finish` frees stacks
+// through the page allocator's lock, all in interrupt context. That's only
+// safe with `g_preemption` set, which makes every spinlock keep interrupts
+// off: a lock this CPU already holds can't be interrupted into.
+// `threads_init` sets it before installing this hook.
+static void thread_interrupt_return(InterruptFrame* frame)
+{
+    if (frame->vector != APIC_TIMER_VECTOR || !g_preemption)
+        return;
+
+    ThreadCpu* cpu = thread_this_cpu();
+    if (cpu->current == &cpu->idle || ++cpu->ticks < THREAD_TIMESLICE_TICKS)
+        return;
+    thread_reschedule(cpu, 1);
+}
+
+// smp.c's idle hook: threads first, then tasks.
+static int thread_idle_work(PerCpu* cpu)
+{
+    return thread_run_queued(cpu->index) || task_idle_work(cpu);
+}
+
+// Where a new thread's first switch returns to.
+static void thread_entry()
+{
+    thread_switch_finish();
+    Thread* self = thread_this_cpu()->current;
+    interrupts_enable();
+
+    self->function(self->argument);
+    thread_exit();
+}
+
+
+// Set up a run queue for every CPU in g_cpus, make idle CPUs run threads,
+// and start preempting them on the timer. Needs `smp_init` and, for tasks
+// to keep running on idle CPUs, `tasks_init`. Returns 0 if the arena is out
+// of memory.
+int threads_init()
+{
+    g_threads = (Threads) { 0 };
+
+    ThreadCpu* cpus = arena_alloc(g_smp.count * sizeof(ThreadCpu), SMP_CACHE_LINE);
+    if (!cpus)
+        return 0;
+
+    for (u32 i = 0; i < g_smp.count; ++i)
+    {
+        memset(&cpus[i], 0, sizeof(ThreadCpu));
+        cpus[i].idle.on_cpu          = 1;
+        cpus[i].idle.state           = THREAD_RUNNING;
+        cpus[i].idle.cpu             = i;
+        cpus[i].current              = &cpus[i].idle;
+        cpus[i].switch_latency.min   = ~0ull;
+        cpus[i].wait_latency.min     = ~0ull;
+    }
+
+    g_threads.cpus  = cpus;
+    g_threads.count = g_smp.count;
+
+    // From now on, spinlocks keep interrupts off while held: their holders
+    // can't be preempted, and `thread_interrupt_return` may take them.
+    // Before the hook below is installed.
+    __atomic_store_n(&g_preemption, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&g_interrupt_before_return, thread_interrupt_return, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_smp.idle_work, thread_idle_work, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+// Start `function(argument)` on a thread of its own, on the least loaded
+// CPU. Returns NULL if there's no memory for it, or no `threads_init`.
+// Every thread must be joined.
+Thread* thread_create(ThreadFunction function, void* argument)
+{
+    if (!g_threads.count)
+        return NULL;
+
+    Thread* thread = kmalloc(sizeof(Thread));
+    u64     stack  = page_alloc_order(THREAD_STACK_ORDER);
+    if (!thread || !stack)
+    {
+        kfree(thread);
+        if (stack)
+            page_free(stack);
+        return NULL;
+    }
+
+    *thread = (Thread) {
+        .id       = __atomic_add_fetch(&g_threads.next_id, 1, __ATOMIC_RELAXED),
+        .stack    = stack,
+        .function = function,
+        .argument = argument,
+    };
+
+    // What `thread_switch` pops: the control words, six callee-saved
+    // registers and a return address, with the stack aligned for a call on
+    // arrival.
+    u64* top = (u64 *) (stack + (PAGE_SIZE << THREAD_STACK_ORDER));
+    *--top = 0;
+    *--top = (u64) thread_entry;
+    for (int i = 0; i < 6; ++i)
+        *--top = 0;
+    *--top = THREAD_INITIAL_FP_CONTROL;
+    thread->rsp = (u64) top;
+
+    thread_enqueue(thread_least_loaded(), thread);
+    smp_wake();
+    return thread;
+}
+
+// Let another thread on this CPU run, if one is waiting. From an idle
+// thread, run whatever is queued.
+void thread_yield()
+{
+    if (!g_threads.count)
+        return;
+
+    u64 flags = interrupts_disable();
+    PerCpu*    self = this_cpu();
+    ThreadCpu* cpu  = &g_threads.cpus[self->index];
+    if (cpu->current == &cpu->idle)
+        thread_run_queued(self->index);
+    else
+        thread_reschedule(cpu, 0);
+    interrupts_restore(flags);
+}
+
+// Finish the current thread. Also what returning from its function does.
+void thread_exit()
+{
+    interrupts_disable();
+    ThreadCpu* cpu = thread_this_cpu();
+    cpu->current->state = THREAD_DEAD;
+    thread_reschedule(cpu, 0);
+
+    for (;;)
+        __asm__ __volatile__("hlt");    // Never switched back to.
+}
+
+// Wait for `thread` to finish, running other threads in the meantime, and
+// free it.
+void thread_join(Thread* thread)
+{
+    while (!__atomic_load_n(&thread->done, __ATOMIC_ACQUIRE))
+    {
+        thread_yield();
+        __asm__ __volatile__("pause");
+    }
+    kfree(thread);
+}
+
+
+// The counters summed over all CPUs. Racy while threads run.
+ThreadStats thread_stats()
+{
+    ThreadStats stats = { 0 };
+    stats.switch_latency.min = ~0ull;
+    stats.wait_latency.min   = ~0ull;
+    for (u32 i = 0; i < g_threads.count; ++i)
+    {
+        const ThreadCpu* cpu = &g_threads.cpus[i];
+        stats.switches    += cpu->switches;
+        stats.preemptions += cpu->preemptions;
+        stats.yields      += cpu->yields;
+        stats.migrations  += cpu->migrations;
+        thread_latency_merge(&stats.switch_latency, &cpu->switch_latency);
+        thread_latency_merge(&stats.wait_latency,   &cpu->wait_latency);
+    }
+    return stats;
+}
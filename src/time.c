@@ -0,0 +1,181 @@
+// Kernel time: the TSC, calibrated once at boot.
+//
+// The TSC rate comes from CPUID leaf 0x15 when the CPU reports it (exact),
+// and is otherwise measured against PIT channel 2: the shortest of a few
+// 10 ms one-shot countdowns, so an interrupted run can only make a sample
+// longer, never shorter. Failing both, the bootloader's estimate is used.
+//
+// Conversions are a multiply and a shift, with the factors worked out once
+// at calibration, so `now_ns` is about as cheap as `rdtsc` itself.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define PIT_HZ              1193182ull
+#define PIT_CHANNEL2        0x42
+#define PIT_COMMAND         0x43
+#define PIT_GATE            0x61    // Bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output.
+#define TIME_PIT_SAMPLE_MS  10
+#define TIME_PIT_SAMPLES    3
+#define TIME_PIT_TIMEOUT    4               // In samples' worth of TSC time at the fallback rate.
+#define TIME_PIT_MAX_CYCLES 200000000ull    // Without a fallback rate: 50 ms at 4 GHz.
+#define TIME_SHIFT          32
+
+__extension__ typedef unsigned __int128 u128;
+
+
+typedef enum TimeSource
+{
+    TIME_SOURCE_NONE,
+    TIME_SOURCE_CPUID,
+    TIME_SOURCE_PIT,
+    TIME_SOURCE_BOOTLOADER,
+} TimeSource;
+
+const char* TIME_SOURCE_STRINGS[] = {
+    "none",
+    "CPUID leaf 0x15",
+    "PIT",
+    "bootloader estimate",
+};
+
+typedef struct Time
+{
+    u64        tsc_hz;
+    u64        ns_per_cycle;    // 2^TIME_SHIFT * 10^9 / tsc_hz
+    u64        cycles_per_ns;   // 2^TIME_SHIFT * tsc_hz / 10^9
+    TimeSource source;
+    int        invariant;       // The TSC keeps its rate across P- and C-states.
+} Time;
+
+
+Time g_time;
+
+
+static inline u64 cycles_to_ns(u64 cycles)
+{
+    return (u64) (((u128) cycles * g_time.ns_per_cycle) >> TIME_SHIFT);
+}
+
+static inline u64 ns_to_cycles(u64 ns)
+{
+    return (u64) (((u128) ns * g_time.cycles_per_ns) >> TIME_SHIFT);
+}
+
+// Nanoseconds since reset.
+static inline u64 now_ns()
+{
+    return cycles_to_ns(read_tsc());
+}
+
+
+// CPUID.15h: TSC = crystal * EBX / EAX, with the crystal in ECX. Many CPUs
+// leave ECX 0, and then the rate isn't known exactly.
+static u64 time_cpuid_hz()
+{
+    if (g_cpu.max_leaf < 0x15)
+        return 0;
+
+    CpuidResult leaf = cpuid(0x15, 0);
+    if (!leaf.eax || !leaf.ebx || !leaf.ecx)
+        return 0;
+    return (u64) leaf.ecx * leaf.ebx / leaf.eax;
+}
+
+
+// TSC ticks across one PIT countdown of `count` ticks, or 0 if the PIT
+// doesn't seem to be there: no output after `timeout` TSC ticks. Each port
+// read takes about a microsecond, so counting reads would take far longer.
+static u64 time_pit_sample(u16 count, u64 timeout)
+{
+    u8 gate = read_port(PIT_GATE);
+    write_port(PIT_GATE, (gate & ~0x02) | 0x01);
+
+    // Channel 2, low then high byte, mode 0 (interrupt on terminal count):
+    // the output goes high when the count reaches 0.
+    write_port(PIT_COMMAND, 0xB0);
+    write_port(PIT_CHANNEL2, (u8) count);
+    write_port(PIT_CHANNEL2, (u8) (count >> 8));
+
+    u64 begin = read_tsc();
+    u64 end   = begin;
+    while (!(read_port(PIT_GATE) & 0x20))
+    {
+        end = read_tsc();
+        if (end - begin > timeout)
+        {
+            begin = end = 0;
+            break;
+        }
+    }
+
+    write_port(PIT_GATE, gate);
+    return end - begin;
+}
+
+static u64 time_pit_hz(u64 fallback_hz)
+{
+    u16 count   = (u16) (PIT_HZ * TIME_PIT_SAMPLE_MS / 1000);
+    u64 timeout = fallback_hz ? fallback_hz / 1000 * TIME_PIT_SAMPLE_MS * TIME_PIT_TIMEOUT : TIME_PIT_MAX_CYCLES;
+    u64 best    = ~0ull;
+    for (int i = 0; i < TIME_PIT_SAMPLES; ++i)
+    {
+        u64 ticks = time_pit_sample(count, timeout);
+        if (!ticks)
+            return 0;
+        if (ticks < best)
+            best = ticks;
+    }
+    return best * PIT_HZ / count;
+}
+
+
+// Calibrate the TSC. `fallback_hz` is used if nothing better is found
+// (e.g. the bootloader's measurement). Returns the rate, 0 if unknown.
+u64 time_init(u64 fallback_hz)
+{
+    g_time = (Time) { 0 };
+    g_time.invariant = cpu_has(CPU_FEATURE_INVARIANT_TSC);
+
+    if ((g_time.tsc_hz = time_cpuid_hz()))
+        g_time.source = TIME_SOURCE_CPUID;
+    else if ((g_time.tsc_hz = time_pit_hz(fallback_hz)))
+        g_time.source = TIME_SOURCE_PIT;
+    else if ((g_time.tsc_hz = fallback_hz))
+        g_time.source = TIME_SOURCE_BOOTLOADER;
+    else
+        return 0;
+
+    // Both fit in 64 bits, which keeps libgcc's 128-bit division out.
+    u64 giga = 1000000000ull;
+    g_time.ns_per_cycle  = (giga << TIME_SHIFT) / g_time.tsc_hz;
+    g_time.cycles_per_ns = ((g_time.tsc_hz / giga) << TIME_SHIFT) + ((g_time.tsc_hz % giga) << TIME_SHIFT) / giga;
+    return g_time.tsc_hz;
+}
+
+
+// Wait until the TSC reaches `deadline`. With WAITPKG the core sits in a
+// light sleep state (C0.2) instead of spinning.
+static void time_wait_until(u64 deadline)
+{
+    if (cpu_has(CPU_FEATURE_WAITPKG))
+    {
+        for (u64 now = read_tsc(); now < deadline; now = read_tsc())
+        {
+            // tpause ecx; spelled out for assemblers that don't know it.
+            __asm__ __volatile__(
+                ".byte 0x66, 0x0F, 0xAE, 0xF1"
+                : : "c" (0), "a" ((u32) deadline), "d" ((u32) (deadline >> 32)) : "cc", "memory"
+            );
+        }
+        return;
+    }
+
+    while (read_tsc() < deadline)
+        __asm__ __volatile__("pause");
+}
+
+void sleep_ns(u64 ns)
+{
+    time_wait_until(read_tsc() + ns_to_cycles(ns));
+}
@@ -0,0 +1,271 @@
+// Map the framebuffer write-combining.
+//
+// Firmware usually leaves the framebuffer uncached, which makes every store a
+// separate bus transaction. Write-combining lets the CPU merge stores into
+// full-line bursts, which is exactly what the flush of the back buffer does.
+//
+// The preferred way is the PAT: entry 4 is reprogrammed to WC and the page
+// table entries covering the framebuffer select it. Large pages that only
+// partly overlap the framebuffer are split first, so no neighbouring MMIO is
+// touched. If the CPU has no PAT, a free variable MTRR is used instead.
+#include "bootloader.h"
+#include "types.h"
+
+
+#define PAT_TYPE_WC       0x01
+#define PAT_WC_INDEX      4            // PAT=1, PCD=0, PWT=0.
+#define MTRR_TYPE_UC      0x00
+#define MTRR_TYPE_WC      0x01
+
+#define WRITE_COMBINING_SPLIT_TABLES 8
+
+
+typedef enum WriteCombiningMode
+{
+    WRITE_COMBINING_NONE,
+    WRITE_COMBINING_PAT,
+    WRITE_COMBINING_MTRR,
+} WriteCombiningMode;
+
+typedef struct WriteCombiningResult
+{
+    WriteCombiningMode mode;
+    u64 pages_1g;       // Leaf entries changed, per page size.
+    u64 pages_2m;
+    u64 pages_4k;
+    u64 splits;         // Large pages split to fit the range.
+    int mtrr;           // Variable MTRR used, if mode is WRITE_COMBINING_MTRR.
+} WriteCombiningResult;
+
+
+// Page tables for splitting large pages. At most two partial pages per
+// level can straddle the range.
+u64 g_write_combining_tables[WRITE_COMBINING_SPLIT_TABLES][512] __attribute__((aligned(4096)));
+int g_write_combining_tables_used = 0;
+
+
+const char* WRITE_COMBINING_MODE_STRINGS[] = {
+    "none (firmware default)",
+    "PAT",
+    "MTRR",
+};
+
+
+static void write_combining_program_pat()
+{
+    u64 pat = read_msr(MSR_PAT);
+    pat &= ~(0xFFull << (PAT_WC_INDEX * 8));
+    pat |=  ((u64) PAT_TYPE_WC << (PAT_WC_INDEX * 8));
+
+    // SDM 11.12.4: flush caches and TLBs around a PAT change.
+    u64 flags = interrupts_disable();
+    write_back_invalidate();
+    write_msr(MSR_PAT, pat);
+    write_back_invalidate();
+    write_cr3(read_cr3());
+    interrupts_restore(flags);
+}
+
+
+// Replace a large page with a table of the next smaller page size, keeping
+// the same translation and attributes. Returns 0 if out of tables.
+static int write_combining_split(u64* entry, u64 child_size, int child_is_large)
+{
+    if (g_write_combining_tables_used == WRITE_COMBINING_SPLIT_TABLES)
+        return 0;
+
+    u64* table  = g_write_combining_tables[g_write_combining_tables_used++];
+    u64  parent = *entry;
+    u64  pat    = parent & PAGE_PAT_LARGE;
+    u64  base   = parent & PAGE_ADDRESS & ~PAGE_PAT_LARGE;
+    u64  flags  = parent & ~PAGE_ADDRESS;
+
+    if (!child_is_large)
+    {
+        // PS becomes PAT in a PTE.
+        flags &= ~PAGE_LARGE;
+        if (pat)
+            flags |= PAGE_PAT;
+        pat = 0;
+    }
+
+    for (u64 i = 0; i < 512; ++i)
+        table[i] = (base + i * child_size) | pat | flags;
+
+    // Non-leaf entries ignore the cache bits and PS must be clear.
+    *entry = paging_physical(table) | (parent & 0x3F & ~(PAGE_PWT | PAGE_PCD));
+    return 1;
+}
+
+
+static inline u64 write_combining_leaf(u64 entry, u64 pat_bit)
+{
+    return (entry & ~(PAGE_PWT | PAGE_PCD)) | pat_bit;
+}
+
+
+// Walk the active page tables and point every leaf covering
+// [start, end) at the WC PAT entry.
+static int write_combining_remap(u64 start, u64 end, WriteCombiningResult* result)
+{
+    u64* pml4 = (u64 *) (read_cr3() & PAGE_ADDRESS);
+
+    u64 address = start;
+    while (address < end)
+    {
+        u64 pml4e = pml4[(address >> 39) & 511];
+        if (!(pml4e & PAGE_PRESENT))
+            return 0;
+
+        u64* pdpt  = (u64 *) (pml4e & PAGE_ADDRESS);
+        u64* pdpte = &pdpt[(address >> 30) & 511];
+        if (!(*pdpte & PAGE_PRESENT))
+            return 0;
+
+        if (*pdpte & PAGE_LARGE)
+        {
+            u64 page = address & ~((1ull << 30) - 1);
+            if (page >= start && page + (1ull << 30) <= end)
+            {
+                *pdpte = write_combining_leaf(*pdpte, PAGE_PAT_LARGE);
+                result->pages_1g += 1;
+                address = page + (1ull << 30);
+            }
+            else if (write_combining_split(pdpte, 1ull << 21, 1))
+            {
+                result->splits += 1;
+            }
+            else
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        u64* pd  = (u64 *) (*pdpte & PAGE_ADDRESS);
+        u64* pde = &pd[(address >> 21) & 511];
+        if (!(*pde & PAGE_PRESENT))
+            return 0;
+
+        if (*pde & PAGE_LARGE)
+        {
+            u64 page = address & ~((1ull << 21) - 1);
+            if (page >= start && page + (1ull << 21) <= end)
+            {
+                *pde = write_combining_leaf(*pde, PAGE_PAT_LARGE);
+                result->pages_2m += 1;
+                address = page + (1ull << 21);
+            }
+            else if (write_combining_split(pde, 1ull << 12, 0))
+            {
+                result->splits += 1;
+            }
+            else
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        u64* pt  = (u64 *) (*pde & PAGE_ADDRESS);
+        u64* pte = &pt[(address >> 12) & 511];
+        if (!(*pte & PAGE_PRESENT))
+            return 0;
+
+        *pte = write_combining_leaf(*pte, PAGE_PAT);
+        result->pages_4k += 1;
+        address += 1ull << 12;
+    }
+
+    return 1;
+}
+
+
+// Fallback without PAT: claim a free variable MTRR. Needs a power-of-two
+// sized, naturally aligned range, so the size is rounded up.
+static int write_combining_mtrr(u64 start, u64 size, WriteCombiningResult* result)
+{
+    u64 capabilities = read_msr(MSR_MTRR_CAP);
+    int count        = (int) (capabilities & 0xFF);
+    if (!(capabilities & (1 << 10)))  // WC not supported.
+        return 0;
+
+    u64 length = 1ull << 12;
+    while (length < size)
+        length <<= 1;
+    if (start & (length - 1))
+        return 0;
+
+    u32 address_bits = 36;
+    if (cpuid(0x80000000, 0).eax >= 0x80000008)
+        address_bits = cpuid(0x80000008, 0).eax & 0xFF;
+    u64 address_mask = ((1ull << address_bits) - 1) & PAGE_ADDRESS;
+
+    for (int i = 0; i < count; ++i)
+    {
+        u32 mask_msr = MSR_MTRR_PHYS_BASE0 + 2*i + 1;
+        if (read_msr(mask_msr) & (1 << 11))  // Valid bit; in use.
+            continue;
+
+        // SDM 11.11.8: caches off, flush, MTRRs off while changing them.
+        u64 flags = interrupts_disable();
+        u64 cr0   = read_cr0();
+        write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+        write_back_invalidate();
+        write_cr3(read_cr3());
+
+        u64 default_type = read_msr(MSR_MTRR_DEF_TYPE);
+        write_msr(MSR_MTRR_DEF_TYPE, default_type & ~(1ull << 11));
+        write_msr(MSR_MTRR_PHYS_BASE0 + 2*i, (start & address_mask) | MTRR_TYPE_WC);
+        write_msr(mask_msr, (~(length - 1) & address_mask) | (1 << 11));
+        write_msr(MSR_MTRR_DEF_TYPE, default_type);
+
+        write_back_invalidate();
+        write_cr3(read_cr3());
+        write_cr0(cr0);
+        interrupts_restore(flags);
+
+        result->mtrr = i;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+WriteCombiningResult write_combining_map_framebuffer(Graphics* graphics)
+{
+    WriteCombiningResult result = { .mode=WRITE_COMBINING_NONE, .mtrr=-1 };
+
+    // The framebuffer is addressed through the identity alias, which shares
+    // its tables with the direct map, so both get write-combining.
+    u64 start = (u64) graphics->base & PAGE_ADDRESS;
+    u64 end   = ((u64) graphics->base + graphics->size + 0xFFF) & PAGE_ADDRESS;
+
+    if (cpu_has(CPU_FEATURE_PAT))
+    {
+        write_combining_program_pat();
+
+        // Firmware may have made its page tables read-only.
+        u64 flags = interrupts_disable();
+        u64 cr0   = read_cr0();
+        write_cr0(cr0 & ~CR0_WP);
+
+        int done = write_combining_remap(start, end, &result);
+
+        write_cr0(cr0);
+        write_cr3(read_cr3());
+        interrupts_restore(flags);
+
+        if (done)
+        {
+            result.mode = WRITE_COMBINING_PAT;
+            return result;
+        }
+    }
+
+    if (cpu_has(CPU_FEATURE_MTRR) && write_combining_mtrr(start, end - start, &result))
+        result.mode = WRITE_COMBINING_MTRR;
+
+    return result;
+}